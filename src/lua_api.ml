@@ -80,7 +80,12 @@ lua_State* push_hello () {
     This binding is to be considered "thread safe". This means that you can use
     the library in a threaded setup, but keep in mind that you {b cannot} share
     a Lua state [Lua_api_lib.state] between threads, because Lua itself doesn't
-    allow this. *)
+    allow this.
+
+    By default Lua code is executed holding the OCaml runtime lock, so states
+    used by different threads run one at a time. Create the states with
+    [LuaL.newstate ~release_runtime:true ()] to execute Lua code in parallel:
+    see {!Lua_aux_lib.newstate}. *)
 
 
 (**************************)
@@ -92,3 +97,9 @@ module Lua = Lua_api_lib
 
 module LuaL = Lua_aux_lib
 (** For reference see {! Lua_aux_lib} *)
+
+module Scheduler = Lua_scheduler
+(** For reference see {! Lua_scheduler} *)
+
+module Executor = Lua_executor
+(** For reference see {! Lua_executor} *)
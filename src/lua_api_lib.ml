@@ -38,6 +38,11 @@ type lua_type =
   | LUA_TUSERDATA
   | LUA_TTHREAD
 
+type limited_status =
+  | Finished of thread_status
+  | Instruction_limit_reached
+  | Deadline_reached
+
 type 'a lua_Reader = state -> 'a -> string option
 
 type writer_status =
@@ -46,6 +51,17 @@ type writer_status =
 
 type 'a lua_Writer = state -> string -> 'a -> writer_status
 
+type bigstring =
+  (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+type lua_value =
+  | Nil
+  | Boolean of bool
+  | Number of float
+  | String of string
+  | Table of (lua_value * lua_value) list
+  | Opaque of lua_type
+
 let thread_status_of_int = function
   | 0 -> LUA_OK
   | 1 -> LUA_YIELD
@@ -111,6 +127,8 @@ let globalsindex = -10002
 (**************)
 exception Error of thread_status
 exception Type_error of string
+exception Conversion_error of string
+exception Call_error of string
 exception Not_a_C_function
 exception Not_a_Lua_thread
 exception Not_a_block_value
@@ -128,10 +146,96 @@ let tolstring ls index =
 
 let tostring = tolstring
 
+external tobigstring__wrapper : state -> int -> bigstring = "lua_tobigstring__stub"
+  (** Raises [Type_error] *)
+
+let tobigstring ls index =
+  try Some (tobigstring__wrapper ls index)
+  with Type_error _ -> None
+
+external tolstring_into : state -> int -> Bytes.t -> int -> int = "lua_tolstring_into__stub"
+
+external tofloatarray__wrapper : state -> int -> float array = "lua_tofloatarray__stub"
+  (** Raises [Type_error] *)
+
+let tofloatarray ls index =
+  try Some (tofloatarray__wrapper ls index)
+  with Type_error _ -> None
+
+external toflatfloatarray__wrapper : state -> int -> floatarray = "lua_toflatfloatarray__stub"
+  (** Raises [Type_error] *)
+
+let toflatfloatarray ls index =
+  try Some (toflatfloatarray__wrapper ls index)
+  with Type_error _ -> None
+
+external tointarray__wrapper : state -> int -> int array = "lua_tointarray__stub"
+  (** Raises [Type_error] *)
+
+let tointarray ls index =
+  try Some (tointarray__wrapper ls index)
+  with Type_error _ -> None
+
+external tostringarray__wrapper : state -> int -> string array = "lua_tostringarray__stub"
+  (** Raises [Type_error] *)
+
+let tostringarray ls index =
+  try Some (tostringarray__wrapper ls index)
+  with Type_error _ -> None
+
+external tofloatbigarray__wrapper :
+  state -> int -> (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t
+  = "lua_tofloatbigarray__stub"
+  (** Raises [Type_error] *)
+
+let tofloatbigarray ls index =
+  try Some (tofloatbigarray__wrapper ls index)
+  with Type_error _ -> None
+
+external to_value__wrapper : state -> int -> int -> lua_value = "lua_to_value__stub"
+  (** Raises [Conversion_error] *)
+
+let to_value ?(max_depth=100) ls index =
+  to_value__wrapper ls max_depth index
+
+external push_value : state -> lua_value -> unit = "lua_push_value__stub"
+
 external pushlstring : state -> string -> unit = "lua_pushlstring__stub"
 
 let pushstring = pushlstring
 
+external pushsubstring : state -> string -> off:int -> len:int -> unit
+  = "lua_pushsubstring__stub"
+
+external pushsubbytes : state -> Bytes.t -> off:int -> len:int -> unit
+  = "lua_pushsubstring__stub"
+
+external pushbigstring__wrapper : state -> bigstring -> int -> int -> unit
+  = "lua_pushbigstring__stub"
+
+let pushbigstring ls ?(off=0) ?len b =
+  let len = match len with Some l -> l | None -> Bigarray.Array1.dim b - off in
+  pushbigstring__wrapper ls b off len
+
+external pushbuffer__wrapper : state -> bigstring -> int -> int -> unit
+  = "lua_pushbuffer__stub"
+
+let pushbuffer ls ?(off=0) ?len b =
+  let len = match len with Some l -> l | None -> Bigarray.Array1.dim b - off in
+  pushbuffer__wrapper ls b off len
+
+external pushfloatarray : state -> float array -> unit = "lua_pushfloatarray__stub"
+
+external pushflatfloatarray : state -> floatarray -> unit = "lua_pushfloatarray__stub"
+
+external pushintarray : state -> int array -> unit = "lua_pushintarray__stub"
+
+external pushstringarray : state -> string array -> unit = "lua_pushstringarray__stub"
+
+external pushfloatbigarray :
+  state -> (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t -> unit
+  = "lua_pushfloatbigarray__stub"
+
 (* This is the "porting" of the standard panic function from Lua source:
    lua-5.1.5/src/lauxlib.c line 639 *)
 let default_panic (ls : state) =
@@ -152,41 +256,55 @@ external concat : state -> int -> unit = "lua_concat__stub"
 
 external pushcfunction : state -> oCamlFunction -> unit = "lua_pushcfunction__stub"
 
+external pushfloat1 : state -> (float -> float) -> unit = "lua_pushfloat1__stub"
+
+external pushfloat2 : state -> (float -> float -> float) -> unit = "lua_pushfloat2__stub"
+
+external pushint1 : state -> (int -> int) -> unit = "lua_pushint1__stub"
+
+external pushstring1 : state -> (string -> string) -> unit = "lua_pushstring1__stub"
+
 external pushlightuserdata : state -> 'a -> unit = "lua_pushlightuserdata__stub"
 
+external releaselightuserdata : state -> int -> bool = "lua_releaselightuserdata__stub"
+
 external lua_pcall__wrapper : state -> int -> int -> int -> int = "lua_pcall__stub"
 
 let pcall ls nargs nresults errfunc =
   lua_pcall__wrapper ls nargs nresults errfunc |> thread_status_of_int
 
-exception Memory_allocation_error
+external pcall_limited__wrapper : state -> int -> int -> int -> int * float -> int
+  = "lua_pcall_limited__stub"
 
-let cpcall ls func ud =
-  let cpcall_panic (_ls : state) : int = raise Memory_allocation_error in
-  let old_panic = atpanic ls cpcall_panic in
-  try
-    match checkstack ls 2 with (* ALLOCATES MEMORY, COULD FAIL! *)
-    | true -> begin
-        pushcfunction ls func;
-        pushlightuserdata ls ud; (* ALLOCATES MEMORY, COULD FAIL! *)
-        let _unused = atpanic ls old_panic in
-        pcall ls 1 0 0
-      end
-    | false ->
-        let _unused = atpanic ls old_panic in
-        LUA_ERRMEM
-  with
-  | Memory_allocation_error ->
-      let _unused = atpanic ls old_panic in
-      LUA_ERRMEM
-  | e ->
-      let _unused = atpanic ls old_panic in
-      raise e
+let pcall_limited ?max_instructions ?timeout ls nargs nresults errfunc =
+  match max_instructions, timeout with
+  | None, None -> Finished (pcall ls nargs nresults errfunc)
+  | _ ->
+      let max_instructions = match max_instructions with Some n -> max n 0 | None -> -1 in
+      let timeout = match timeout with Some t -> max t 0.0 | None -> -1.0 in
+      match pcall_limited__wrapper ls nargs nresults errfunc (max_instructions, timeout) with
+      | -1 -> Instruction_limit_reached
+      | -2 -> Deadline_reached
+      | status -> Finished (thread_status_of_int status)
 
 external createtable : state -> int -> int -> unit = "lua_createtable__stub"
 
 external dump : state -> 'a lua_Writer -> 'a -> writer_status = "lua_dump__stub"
 
+external dump_to_string__wrapper : state -> bool -> string = "lua_dump_to_string__stub"
+  (** Raises [Type_error] *)
+
+let dump_to_string ?(strip=false) ls =
+  try Some (dump_to_string__wrapper ls strip)
+  with Type_error _ -> None
+
+external dump_to_bigstring__wrapper : state -> bool -> bigstring = "lua_dump_to_bigstring__stub"
+  (** Raises [Type_error] *)
+
+let dump_to_bigstring ?(strip=false) ls =
+  try Some (dump_to_bigstring__wrapper ls strip)
+  with Type_error _ -> None
+
 external equal : state -> int -> int -> bool = "lua_equal__stub"
 
 external error : state -> 'a = "lua_error__stub"
@@ -202,37 +320,52 @@ external getfield : state -> int -> string -> unit = "lua_getfield__stub"
 
 let getglobal ls name = getfield ls globalsindex name
 
-external getmetatable : state -> int -> bool = "lua_getmetatable__stub"
+external getmetatable : state -> (int [@untagged]) -> bool
+  = "lua_getmetatable__stub" "lua_getmetatable__unboxed" [@@noalloc]
 
 external gettable : state -> int -> unit = "lua_gettable__stub"
 
-external gettop : state -> int = "lua_gettop__stub"
+external gettop : state -> (int [@untagged])
+  = "lua_gettop__stub" "lua_gettop__unboxed" [@@noalloc]
 
-external insert : state -> int -> unit = "lua_insert__stub"
+external insert : state -> (int [@untagged]) -> unit
+  = "lua_insert__stub" "lua_insert__unboxed" [@@noalloc]
 
-external isboolean : state -> int -> bool = "lua_isboolean__stub"
+external isboolean : state -> (int [@untagged]) -> bool
+  = "lua_isboolean__stub" "lua_isboolean__unboxed" [@@noalloc]
 
-external iscfunction : state -> int -> bool = "lua_iscfunction__stub"
+external iscfunction : state -> (int [@untagged]) -> bool
+  = "lua_iscfunction__stub" "lua_iscfunction__unboxed" [@@noalloc]
 
-external isfunction : state -> int -> bool = "lua_isfunction__stub"
+external isfunction : state -> (int [@untagged]) -> bool
+  = "lua_isfunction__stub" "lua_isfunction__unboxed" [@@noalloc]
 
-external islightuserdata : state -> int -> bool = "lua_islightuserdata__stub"
+external islightuserdata : state -> (int [@untagged]) -> bool
+  = "lua_islightuserdata__stub" "lua_islightuserdata__unboxed" [@@noalloc]
 
-external isnil : state -> int -> bool = "lua_isnil__stub"
+external isnil : state -> (int [@untagged]) -> bool
+  = "lua_isnil__stub" "lua_isnil__unboxed" [@@noalloc]
 
-external isnone : state -> int -> bool = "lua_isnone__stub"
+external isnone : state -> (int [@untagged]) -> bool
+  = "lua_isnone__stub" "lua_isnone__unboxed" [@@noalloc]
 
-external isnoneornil : state -> int -> bool = "lua_isnoneornil__stub"
+external isnoneornil : state -> (int [@untagged]) -> bool
+  = "lua_isnoneornil__stub" "lua_isnoneornil__unboxed" [@@noalloc]
 
-external isnumber : state -> int -> bool = "lua_isnumber__stub"
+external isnumber : state -> (int [@untagged]) -> bool
+  = "lua_isnumber__stub" "lua_isnumber__unboxed" [@@noalloc]
 
-external isstring : state -> int -> bool = "lua_isstring__stub"
+external isstring : state -> (int [@untagged]) -> bool
+  = "lua_isstring__stub" "lua_isstring__unboxed" [@@noalloc]
 
-external istable : state -> int -> bool = "lua_istable__stub"
+external istable : state -> (int [@untagged]) -> bool
+  = "lua_istable__stub" "lua_istable__unboxed" [@@noalloc]
 
-external isthread : state -> int -> bool = "lua_isthread__stub"
+external isthread : state -> (int [@untagged]) -> bool
+  = "lua_isthread__stub" "lua_isthread__unboxed" [@@noalloc]
 
-external isuserdata : state -> int -> bool = "lua_isuserdata__stub"
+external isuserdata : state -> (int [@untagged]) -> bool
+  = "lua_isuserdata__stub" "lua_isuserdata__unboxed" [@@noalloc]
 
 external lessthan : state -> int -> int -> bool = "lua_lessthan__stub"
 
@@ -260,9 +393,10 @@ external next : state -> int -> int = "lua_next__stub"
 
 external objlen : state -> int -> int = "lua_objlen__stub"
 
-external pop : state -> int -> unit = "lua_pop__stub"
+external pop : state -> (int [@untagged]) -> unit
+  = "lua_pop__stub" "lua_pop__unboxed" [@@noalloc]
 
-external pushboolean : state -> bool -> unit = "lua_pushboolean__stub"
+external pushboolean : state -> bool -> unit = "lua_pushboolean__stub" [@@noalloc]
 
 let pushocamlfunction = pushcfunction
 
@@ -270,25 +404,31 @@ let pushfstring (state : state) =
   let k s = pushstring state s; s in
     Printf.ksprintf k
 
-external pushinteger : state -> int -> unit = "lua_pushinteger__stub"
+external pushinteger : state -> (int [@untagged]) -> unit
+  = "lua_pushinteger__stub" "lua_pushinteger__unboxed" [@@noalloc]
 
 external pushliteral : state -> string -> unit = "lua_pushlstring__stub"
 
-external pushnil : state -> unit = "lua_pushnil__stub"
+external pushnil : state -> unit = "lua_pushnil__stub" [@@noalloc]
 
-external pushnumber : state -> float -> unit = "lua_pushnumber__stub"
+external pushnumber : state -> (float [@unboxed]) -> unit
+  = "lua_pushnumber__stub" "lua_pushnumber__unboxed" [@@noalloc]
 
-external pushthread : state -> bool = "lua_pushthread__stub"
+external pushthread : state -> bool = "lua_pushthread__stub" [@@noalloc]
 
-external pushvalue : state -> int -> unit = "lua_pushvalue__stub"
+external pushvalue : state -> (int [@untagged]) -> unit
+  = "lua_pushvalue__stub" "lua_pushvalue__unboxed" [@@noalloc]
 
 let pushvfstring = pushfstring
 
-external rawequal : state -> int -> int -> bool = "lua_rawequal__stub"
+external rawequal : state -> (int [@untagged]) -> (int [@untagged]) -> bool
+  = "lua_rawequal__stub" "lua_rawequal__unboxed" [@@noalloc]
 
-external rawget : state -> int -> unit = "lua_rawget__stub"
+external rawget : state -> (int [@untagged]) -> unit
+  = "lua_rawget__stub" "lua_rawget__unboxed" [@@noalloc]
 
-external rawgeti : state -> int -> int -> unit = "lua_rawgeti__stub"
+external rawgeti : state -> (int [@untagged]) -> (int [@untagged]) -> unit
+  = "lua_rawgeti__stub" "lua_rawgeti__unboxed" [@@noalloc]
 
 external rawset : state -> int -> unit = "lua_rawset__stub"
 
@@ -300,10 +440,51 @@ let register ls name f =
   pushcfunction ls f;
   setglobal ls name
 
-external remove : state -> int -> unit = "lua_remove__stub"
+let register_float1 ls name f =
+  pushfloat1 ls f;
+  setglobal ls name
+
+let register_float2 ls name f =
+  pushfloat2 ls f;
+  setglobal ls name
+
+let register_int1 ls name f =
+  pushint1 ls f;
+  setglobal ls name
+
+let register_string1 ls name f =
+  pushstring1 ls f;
+  setglobal ls name
+
+external remove : state -> (int [@untagged]) -> unit
+  = "lua_remove__stub" "lua_remove__unboxed" [@@noalloc]
 
 external replace : state -> int -> unit = "lua_replace__stub"
 
+exception Memory_allocation_error
+
+let cpcall ls func ud =
+  let cpcall_panic (_ls : state) : int = raise Memory_allocation_error in
+  let old_panic = atpanic ls cpcall_panic in
+  try
+    match checkstack ls 2 with (* ALLOCATES MEMORY, COULD FAIL! *)
+    | true -> begin
+        pushcfunction ls func;
+        pushlightuserdata ls ud; (* ALLOCATES MEMORY, COULD FAIL! *)
+        let _unused = atpanic ls old_panic in
+        pcall ls 1 0 0
+      end
+    | false ->
+        let _unused = atpanic ls old_panic in
+        LUA_ERRMEM
+  with
+  | Memory_allocation_error ->
+      let _unused = atpanic ls old_panic in
+      LUA_ERRMEM
+  | e ->
+      let _unused = atpanic ls old_panic in
+      raise e
+
 external lua_resume__wrapper : state -> int -> int = "lua_resume__stub"
 
 let resume ls narg =
@@ -317,13 +498,14 @@ external setmetatable : state -> int -> int = "lua_setmetatable__stub"
 
 external settable : state -> int -> unit = "lua_settable__stub"
 
-external settop : state -> int -> unit = "lua_settop__stub"
+external settop : state -> (int [@untagged]) -> unit
+  = "lua_settop__stub" "lua_settop__unboxed" [@@noalloc]
 
-external status_aux : state -> int = "lua_status__stub"
+(* the constructors of thread_status are in the same order as the codes *)
+external status : state -> thread_status = "lua_status__stub" [@@noalloc]
 
-let status ls = ls |> status_aux |> thread_status_of_int
-
-external toboolean : state -> int -> bool = "lua_toboolean__stub"
+external toboolean : state -> (int [@untagged]) -> bool
+  = "lua_toboolean__stub" "lua_toboolean__unboxed" [@@noalloc]
 
 external tocfunction_aux : state -> int -> oCamlFunction = "lua_tocfunction__stub"
 
@@ -333,9 +515,11 @@ let tocfunction ls index =
 
 let toocamlfunction = tocfunction
 
-external tointeger : state -> int -> int = "lua_tointeger__stub"
+external tointeger : state -> (int [@untagged]) -> (int [@untagged])
+  = "lua_tointeger__stub" "lua_tointeger__unboxed" [@@noalloc]
 
-external tonumber : state -> int -> float = "lua_tonumber__stub"
+external tonumber : state -> (int [@untagged]) -> (float [@unboxed])
+  = "lua_tonumber__stub" "lua_tonumber__unboxed" [@@noalloc]
 
 external tothread_aux : state -> int -> state = "lua_tothread__stub"
 
@@ -346,14 +530,13 @@ let tothread ls index =
 external touserdata_aux : state -> int -> 'a = "lua_touserdata__stub"
 
 let touserdata ls index =
-  if      islightuserdata ls index then (Some (`Light_userdata (touserdata_aux ls index)))
+  if      islightuserdata ls index then
+    (try Some (`Light_userdata (touserdata_aux ls index)) with Not_found -> None)
   else if isuserdata      ls index then (Some (`Userdata (touserdata_aux ls index)))
   else None
 
-external lua_type_wrapper : state -> int -> int = "lua_type__stub"
-
-let type_ state index =
-  lua_type_wrapper state index |> lua_type_of_int
+external type_ : state -> (int [@untagged]) -> lua_type
+  = "lua_type_variant__stub" "lua_type_variant__unboxed" [@@noalloc]
 
 let typename _ = function
   | LUA_TNONE -> "no value"
@@ -371,9 +554,321 @@ external xmove : state -> state -> int -> unit = "lua_xmove__stub"
 
 external yield : state -> int -> int = "lua_yield__stub"
 
+module Batch =
+struct
+  type op =
+    | Getglobal of string
+    | Setglobal of string
+    | Getfield of int * string
+    | Setfield of int * string
+    | Gettable of int
+    | Settable of int
+    | Rawgeti of int * int
+    | Pushnil
+    | Pushboolean of bool
+    | Pushinteger of int
+    | Pushnumber of float
+    | Pushstring of string
+    | Pushvalue of int
+    | Pusharg of int
+    | Pcall of int * int * int
+    | Pop of int
+    | Settop of int
+    | Toboolean of int
+    | Tonumber of int
+    | Tostring of int
+
+  (* The fields code, strings and numbers are read by lua_batch_run__stub.
+     Every operation is encoded in code as its opcode (the index of the
+     constructor in [op]) followed by its integer operands; the strings and
+     the floats are stored in their own arrays, in order of appearance. The
+     opcode 20 checks that the stack can grow by its operand. *)
+  type program =
+    {
+      code : int array;
+      strings : string array;
+      numbers : float array;
+      nargs : int;
+      nresults : int;
+    }
+
+  let compile ops =
+    let code = ref [] and length = ref 0 and strings = ref [] and numbers = ref [] in
+    let nargs = ref 0 and nresults = ref 0 in
+    let emit opcode operands =
+      code := List.rev_append (opcode :: operands) !code;
+      length := !length + 1 + List.length operands in
+    let string s = strings := s :: !strings in
+    let result () = incr nresults in
+    (* The growth of the stack is checked once for every segment of the
+       program: from the start, and from the points where its height is known
+       only at run time (a Pcall with multret, a Settop to an absolute index).
+       The operand of the check is set when the program is compiled. *)
+    let checks = ref [] and height = ref 0 and growth = ref (ref 0) in
+    let check_stack () =
+      let g = ref 0 in
+      emit 20 [0];
+      checks := (!length - 1, g) :: !checks;
+      height := 0;
+      growth := g in
+    let stack n =
+      height := !height + n;
+      if !height > !(!growth) then !growth := !height in
+    check_stack ();
+    List.iter
+      (function
+        | Getglobal k -> string k; emit 0 []; stack 1
+        | Setglobal k -> string k; emit 1 []; stack (-1)
+        | Getfield (index, k) -> string k; emit 2 [index]; stack 1
+        | Setfield (index, k) -> string k; emit 3 [index]; stack (-1)
+        | Gettable index -> emit 4 [index]
+        | Settable index -> emit 5 [index]; stack (-2)
+        | Rawgeti (index, n) -> emit 6 [index; n]; stack 1
+        | Pushnil -> emit 7 []; stack 1
+        | Pushboolean b -> emit 8 [if b then 1 else 0]; stack 1
+        | Pushinteger n -> emit 9 [n]; stack 1
+        | Pushnumber n -> numbers := n :: !numbers; emit 10 []; stack 1
+        | Pushstring s -> string s; emit 11 []; stack 1
+        | Pushvalue index -> emit 12 [index]; stack 1
+        | Pusharg n ->
+            if n < 0 then invalid_arg "Lua_api_lib.Batch.compile";
+            nargs := max !nargs (n + 1);
+            emit 13 [n];
+            stack 1
+        | Pcall (nargs, nresults, errfunc) ->
+            emit 14 [nargs; nresults; errfunc];
+            if nresults < 0 then check_stack ()
+            else stack (nresults - nargs - 1)
+        | Pop n -> emit 15 [n]; stack (-n)
+        | Settop index ->
+            emit 16 [index];
+            if index >= 0 then check_stack ()
+            else stack (index + 1)
+        | Toboolean index -> result (); emit 17 [index]
+        | Tonumber index -> result (); emit 18 [index]
+        | Tostring index -> result (); emit 19 [index])
+      ops;
+    let code = Array.of_list (List.rev !code) in
+    List.iter (fun (pos, g) -> code.(pos) <- !g) !checks;
+    {
+      code;
+      strings = Array.of_list (List.rev !strings);
+      numbers = Array.of_list (List.rev !numbers);
+      nargs = !nargs;
+      nresults = !nresults;
+    }
+
+  let nargs p = p.nargs
+
+  let nresults p = p.nresults
+
+  let results p = Array.make p.nresults Nil
+
+  external run__wrapper :
+    state -> program -> lua_value array -> lua_value array -> int = "lua_batch_run__stub"
+
+  let run ls p args results =
+    if Array.length args < p.nargs || Array.length results < p.nresults
+    then invalid_arg "Lua_api_lib.Batch.run";
+    thread_status_of_int (run__wrapper ls p args results)
+end
+
+module Key =
+struct
+  (* The fields are read by push_key, in lua_api_lib_stubs.c *)
+  type t =
+    {
+      name : string;
+      reference : int;
+      state : state;
+    }
+
+  external create__wrapper : state -> string -> int = "lua_key_create__stub"
+
+  let create ls name = { name; reference = create__wrapper ls name; state = ls }
+
+  let name k = k.name
+end
+
+external pushkey : state -> Key.t -> unit = "lua_pushkey__stub"
+
+external getfield_key : state -> int -> Key.t -> unit = "lua_getfield_key__stub"
+
+external setfield_key : state -> int -> Key.t -> unit = "lua_setfield_key__stub"
+
+external rawget_key : state -> int -> Key.t -> unit = "lua_rawget_key__stub"
+
+external rawset_key : state -> int -> Key.t -> unit = "lua_rawset_key__stub"
+
+let getglobal_key ls k = getfield_key ls globalsindex k
+
+let setglobal_key ls k = setfield_key ls globalsindex k
+
+module Fn =
+struct
+  (* The order of the constructors is the one of enum fn_type, in
+     lua_api_lib_stubs.c *)
+  type _ ty =
+    | Unit : unit ty
+    | Bool : bool ty
+    | Int : int ty
+    | Float : float ty
+    | String : string ty
+    | Value : lua_value ty
+
+  type _ signature =
+    | Returning : 'r ty -> 'r signature
+    | Arrow : 'a ty * 'b signature -> ('a -> 'b) signature
+
+  let returning r = Returning r
+
+  let ( @-> ) a b = Arrow (a, b)
+
+  (* The fields are read by lua_fn_call__stub *)
+  type 'f t =
+    {
+      state : state;
+      mutable reference : int;
+      mutable handler : int;
+      arg_types : int array;
+      result_type : int;
+      signature : 'f signature;
+    }
+
+  let code_of_ty : type a. a ty -> int = function
+    | Unit -> 0
+    | Bool -> 1
+    | Int -> 2
+    | Float -> 3
+    | String -> 4
+    | Value -> 5
+
+  let rec arg_types : type a. a signature -> int list = function
+    | Returning _ -> []
+    | Arrow (a, b) -> code_of_ty a :: arg_types b
+
+  let rec result_type : type a. a signature -> int = function
+    | Returning r -> code_of_ty r
+    | Arrow (_, b) -> result_type b
+
+  external ref_ : state -> int -> int = "luaL_ref__stub"
+
+  external unref : state -> int -> int -> unit = "luaL_unref__stub"
+
+  let create ls signature =
+    {
+      state = ls;
+      reference = ref_ ls registryindex;
+      handler = -2;                         (* LUA_NOREF *)
+      arg_types = Array.of_list (arg_types signature);
+      result_type = result_type signature;
+      signature;
+    }
+
+  let of_global ls name signature =
+    getglobal ls name;
+    create ls signature
+
+  let set_error_handler h =
+    unref h.state registryindex h.handler;
+    h.handler <- ref_ h.state registryindex
+
+  let release h =
+    unref h.state registryindex h.reference;
+    unref h.state registryindex h.handler;
+    h.reference <- -2;
+    h.handler <- -2
+
+  external call__wrapper : 'f t -> Obj.t -> Obj.t = "lua_fn_call__stub"
+
+  (* The arguments, in reverse order, are passed in a block of tag 0: an
+     array would be a flat float array when the first argument is a float *)
+  let block_of_args args =
+    let n = List.length args in
+    let block = Obj.new_block 0 n in
+    List.iteri (fun i x -> Obj.set_field block (n - 1 - i) x) args;
+    block
+
+  let call (type f) (h : f t) : f =
+    let rec curry : type a. a signature -> Obj.t list -> a = fun s args ->
+      match s with
+      | Returning _ -> Obj.obj (call__wrapper h (block_of_args args))
+      | Arrow (_, b) -> fun x -> curry b (Obj.repr x :: args) in
+    curry h.signature []
+end
+
+module Profiler =
+struct
+  type mode =
+    | Instructions of int
+    | Interval of float
+
+  type report =
+    {
+      samples : int;
+      stacks : (string list * int) list;
+      callbacks : int;
+      callback_time : float;
+    }
+
+  external start__wrapper : state -> bool -> int -> float -> int -> unit
+    = "lua_profiler_start__stub"
+
+  let start ?(mode=Instructions 10_000) ?(max_depth=64) ls =
+    if max_depth <= 0 then invalid_arg "Lua_api_lib.Profiler.start";
+    match mode with
+    | Instructions n when n > 0 -> start__wrapper ls false n 0.0 max_depth
+    | Interval t when t > 0.0 -> start__wrapper ls true 0 t max_depth
+    | _ -> invalid_arg "Lua_api_lib.Profiler.start"
+
+  external stop : state -> unit = "lua_profiler_stop__stub"
+
+  external report__wrapper : state -> int * (string * int) array * int * float
+    = "lua_profiler_report__stub"
+
+  let report ls =
+    let (samples, stacks, callbacks, callback_time) = report__wrapper ls in
+    let stacks = Array.to_list stacks in
+    let stacks = List.sort (fun (_, n1) (_, n2) -> compare n2 n1) stacks in
+    {
+      samples;
+      stacks = List.map (fun (s, n) -> (String.split_on_char ';' s, n)) stacks;
+      callbacks;
+      callback_time;
+    }
+
+  let lines r =
+    let tbl = Hashtbl.create 64 in
+    List.iter
+      (fun (stack, n) ->
+        match List.rev stack with
+        | leaf :: _ ->
+            let prev = try Hashtbl.find tbl leaf with Not_found -> 0 in
+            Hashtbl.replace tbl leaf (prev + n)
+        | [] -> ())
+      r.stacks;
+    let l = Hashtbl.fold (fun frame n acc -> (frame, n) :: acc) tbl [] in
+    List.sort (fun (_, n1) (_, n2) -> compare n2 n1) l
+
+  let collapsed r =
+    let b = Buffer.create 4096 in
+    List.iter
+      (fun (stack, n) ->
+        Buffer.add_string b (String.concat ";" stack);
+        Buffer.add_char b ' ';
+        Buffer.add_string b (string_of_int n);
+        Buffer.add_char b '\n')
+      r.stacks;
+    Buffer.contents b
+end
+
+external same_thread : state -> state -> bool = "lua_same_thread__stub" [@@noalloc]
+
 let init =
   lazy (
     Callback.register_exception "Lua_type_error" (Type_error "");
+    Callback.register_exception "Lua_conversion_error" (Conversion_error "");
+    Callback.register_exception "Lua_call_error" (Call_error "");
     Callback.register_exception "Not_a_C_function" Not_a_C_function;
     Callback.register_exception "Not_a_Lua_thread" Not_a_Lua_thread;
     Callback.register_exception "Not_a_block_value" Not_a_block_value;
@@ -68,6 +68,13 @@ type lua_type =
   | LUA_TUSERDATA
   | LUA_TTHREAD
 
+(** The result of {!Lua_api_lib.pcall_limited}. This type is not present in
+    the official API. *)
+type limited_status =
+  | Finished of thread_status       (** The call returned or failed *)
+  | Instruction_limit_reached       (** The call was interrupted *)
+  | Deadline_reached                (** The call was interrupted *)
+
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_Reader}lua_Reader}
     documentation. *)
@@ -82,6 +89,24 @@ type writer_status =
     documentation. *)
 type 'a lua_Writer = state -> string -> 'a -> writer_status
 
+(** A sequence of bytes stored outside the OCaml heap. This type is not present
+    in the official API and is used by the functions that share memory with Lua
+    strings, like {!Lua_api_lib.tobigstring}. *)
+type bigstring =
+  (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+(** A tree of Lua values, as converted by {!Lua_api_lib.to_value} and
+    {!Lua_api_lib.push_value}. This type is not present in the official API.
+    Functions, userdata, light userdata and threads can't be converted and are
+    represented only by their type. *)
+type lua_value =
+  | Nil
+  | Boolean of bool
+  | Number of float
+  | String of string
+  | Table of (lua_value * lua_value) list  (** The pairs (key, value) *)
+  | Opaque of lua_type
+
 (************************)
 (** {2 Constant values} *)
 (************************)
@@ -110,6 +135,8 @@ val globalsindex : int
 
 exception Error of thread_status
 exception Type_error of string
+exception Conversion_error of string
+exception Call_error of string
 
 (*********************************************)
 (** {2 Functions not present in the Lua API} *)
@@ -184,6 +211,27 @@ val dump : state -> 'a lua_Writer -> 'a -> writer_status
     {{:http://www.lua.org/manual/5.1/manual.html#lua_dump}lua_dump}
     documentation. *)
 
+val dump_to_string : ?strip:bool -> state -> string option
+(** Dumps the Lua function at the top of the stack as a binary chunk, like
+    {!Lua_api_lib.dump}, but the chunk is collected natively and returned as a
+    single string, without calling back OCaml for every fragment. If [strip]
+    is [true] (default is [false]) the debug information (line numbers, names
+    of local variables and upvalues, source name) is not saved, producing a
+    smaller chunk. Returns [None] if the value at the top of the stack is not
+    a Lua function. The function is not popped from the stack.
+
+    To append the chunk to a [Buffer.t], use {!Lua_api_lib.dump_to_string}
+    and [Buffer.add_string], or {!Lua_api_lib.dump_to_bigstring} to avoid the
+    copy in the OCaml heap.
+
+    {b NOTE}: this function is not present in the official API. *)
+
+val dump_to_bigstring : ?strip:bool -> state -> bigstring option
+(** Same as {!Lua_api_lib.dump_to_string}, but the chunk is returned in a
+    bigarray, allocated outside the OCaml heap and without any copy.
+
+    {b NOTE}: this function is not present in the official API. *)
+
 external equal : state -> int -> int -> bool = "lua_equal__stub"
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_equal}lua_equal}
@@ -218,7 +266,8 @@ val getglobal : state -> string -> unit
     documentation. Like in the original Lua source code this function is
     implemented in OCaml using [getfield]. *)
 
-external getmetatable : state -> int -> bool = "lua_getmetatable__stub"
+external getmetatable : state -> (int [@untagged]) -> bool
+  = "lua_getmetatable__stub" "lua_getmetatable__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_getmetatable}lua_getmetatable}
     documentation. *)
@@ -228,72 +277,86 @@ external gettable : state -> int -> unit = "lua_gettable__stub"
     {{:http://www.lua.org/manual/5.1/manual.html#lua_gettable}lua_gettable}
     documentation. *)
 
-external gettop : state -> int = "lua_gettop__stub"
+external gettop : state -> (int [@untagged])
+  = "lua_gettop__stub" "lua_gettop__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_gettop}lua_gettop}
     documentation. *)
 
-external insert : state -> int -> unit = "lua_insert__stub"
+external insert : state -> (int [@untagged]) -> unit
+  = "lua_insert__stub" "lua_insert__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_insert}lua_insert}
     documentation. *)
 
-external isboolean : state -> int -> bool = "lua_isboolean__stub"
+external isboolean : state -> (int [@untagged]) -> bool
+  = "lua_isboolean__stub" "lua_isboolean__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_isboolean}lua_isboolean}
     documentation. *)
 
-external iscfunction : state -> int -> bool = "lua_iscfunction__stub"
+external iscfunction : state -> (int [@untagged]) -> bool
+  = "lua_iscfunction__stub" "lua_iscfunction__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_iscfunction}lua_iscfunction}
     documentation. *)
 
-external isfunction : state -> int -> bool = "lua_isfunction__stub"
+external isfunction : state -> (int [@untagged]) -> bool
+  = "lua_isfunction__stub" "lua_isfunction__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_isfunction}lua_isfunction}
     documentation. *)
 
-external islightuserdata : state -> int -> bool = "lua_islightuserdata__stub"
+external islightuserdata : state -> (int [@untagged]) -> bool
+  = "lua_islightuserdata__stub" "lua_islightuserdata__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_islightuserdata}lua_islightuserdata}
     documentation. *)
 
-external isnil : state -> int -> bool = "lua_isnil__stub"
+external isnil : state -> (int [@untagged]) -> bool
+  = "lua_isnil__stub" "lua_isnil__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_isnil}lua_isnil}
     documentation. *)
 
-external isnone : state -> int -> bool = "lua_isnone__stub"
+external isnone : state -> (int [@untagged]) -> bool
+  = "lua_isnone__stub" "lua_isnone__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_isnone}lua_isnone}
     documentation. *)
 
-external isnoneornil : state -> int -> bool = "lua_isnoneornil__stub"
+external isnoneornil : state -> (int [@untagged]) -> bool
+  = "lua_isnoneornil__stub" "lua_isnoneornil__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_isnoneornil}lua_isnoneornil}
     documentation. *)
 
-external isnumber : state -> int -> bool = "lua_isnumber__stub"
+external isnumber : state -> (int [@untagged]) -> bool
+  = "lua_isnumber__stub" "lua_isnumber__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_isnumber}lua_isnumber}
     documentation. *)
 
-external isstring : state -> int -> bool = "lua_isstring__stub"
+external isstring : state -> (int [@untagged]) -> bool
+  = "lua_isstring__stub" "lua_isstring__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_isstring}lua_isstring}
     documentation. *)
 
-external istable : state -> int -> bool = "lua_istable__stub"
+external istable : state -> (int [@untagged]) -> bool
+  = "lua_istable__stub" "lua_istable__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_istable}lua_istable}
     documentation. *)
 
-external isthread : state -> int -> bool = "lua_isthread__stub"
+external isthread : state -> (int [@untagged]) -> bool
+  = "lua_isthread__stub" "lua_isthread__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_isthread}lua_isthread}
     documentation. *)
 
-external isuserdata : state -> int -> bool = "lua_isuserdata__stub"
+external isuserdata : state -> (int [@untagged]) -> bool
+  = "lua_isuserdata__stub" "lua_isuserdata__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_isuserdata}lua_isuserdata}
     documentation. *)
@@ -419,16 +482,91 @@ val pcall : state -> int -> int -> int -> thread_status
     {{:http://www.lua.org/manual/5.1/manual.html#lua_pcall}lua_pcall}
     documentation. *)
 
-external pop : state -> int -> unit = "lua_pop__stub"
+val pcall_limited :
+  ?max_instructions:int -> ?timeout:float ->
+  state -> int -> int -> int -> limited_status
+(** Same as {!Lua_api_lib.pcall}, but the call is interrupted if it executes
+    more than [max_instructions] Lua VM instructions or if it lasts more than
+    [timeout] seconds. The limits are checked by a count hook at least every
+    1000 instructions and when the instruction budget is exhausted, so they
+    are approximate, and the time spent in C and OCaml functions is not
+    interrupted. The coroutines get the hook when they are resumed by
+    {!Lua_api_lib.resume} or by the [coroutine] library opened by
+    {!Lua_aux_lib.openlibs}, so the limits hold also for the coroutines created
+    before the call. A coroutine library opened otherwise, or another library
+    resuming coroutines from C, escapes the limits. When a limit is reached a
+    Lua error is raised, and raised again before every following instruction
+    if the script catches it: the call fails as any call raising an error, the
+    error message is on the top of the stack and the state can be reused.
+    Without limits this is a plain {!Lua_api_lib.pcall}, with no hook.
+
+    The [debug] library can remove the hook of a thread: [debug.sethook], as
+    installed by {!Lua_aux_lib.openlibs}, raises an error during the call, but
+    a [debug] library opened otherwise must not be exposed to the script.
+
+    An inner call to [pcall_limited] (from an OCaml function called by the
+    script) is bounded by the instructions and the time left to the outer
+    call, and its instructions are charged to the outer call.
+
+    {b NOTE}: this function is not present in the official API. *)
+
+external pop : state -> (int [@untagged]) -> unit
+  = "lua_pop__stub" "lua_pop__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_pop}lua_pop}
     documentation. *)
 
-external pushboolean : state -> bool -> unit = "lua_pushboolean__stub"
+val pushbigstring : state -> ?off:int -> ?len:int -> bigstring -> unit
+(** Pushes onto the stack a Lua string with the content of the given bigarray,
+    or of its slice of [len] bytes starting at [off] (by default the whole
+    bigarray). The data is copied only once, directly into the Lua string,
+    without an intermediate OCaml string. Raises [Invalid_argument] if [off]
+    and [len] do not designate a valid slice.
+
+    {b NOTE}: this function is not present in the official API. *)
+
+external pushboolean : state -> bool -> unit = "lua_pushboolean__stub" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_pushboolean}lua_pushboolean}
     documentation. *)
 
+val pushbuffer : state -> ?off:int -> ?len:int -> bigstring -> unit
+(** Pushes onto the stack a "buffer": a full userdata giving Lua code read-only
+    access to the bigarray (or to its slice of [len] bytes starting at [off])
+    without copying nor interning it. From Lua, [buf[i]] is the [i]-th byte as
+    a number ([nil] when out of range), [#buf] is the length and [buf:sub(i, j)]
+    returns a Lua string with the same semantics of [string.sub].
+
+    The buffer keeps the bigarray alive until it is collected by Lua;
+    {!Lua_api_lib.touserdata} returns the whole bigarray as
+    [Some `Userdata b]. Raises [Invalid_argument] if [off] and [len] do not
+    designate a valid slice.
+
+    {b NOTE}: this function is not present in the official API. *)
+
+(** {b NOTE}: the following functions are not present in the official API.
+    Each of them pushes onto the stack a new table containing a copy of the
+    given array as a sequence (i.e. the element [i] of the array is stored at
+    the index [i + 1] of the table). The table is created with the right size
+    and filled with a single call to C. *)
+
+external pushfloatarray : state -> float array -> unit = "lua_pushfloatarray__stub"
+(** Pushes a table with the numbers of the array. *)
+
+external pushflatfloatarray : state -> floatarray -> unit = "lua_pushfloatarray__stub"
+(** Same as {!Lua_api_lib.pushfloatarray}, for a [Float.Array.t]. *)
+
+external pushfloatbigarray :
+  state -> (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t -> unit
+  = "lua_pushfloatbigarray__stub"
+(** Same as {!Lua_api_lib.pushfloatarray}, for a bigarray of floats. *)
+
+external pushintarray : state -> int array -> unit = "lua_pushintarray__stub"
+(** Pushes a table with the integers of the array. *)
+
+external pushstringarray : state -> string array -> unit = "lua_pushstringarray__stub"
+(** Pushes a table with the strings of the array. *)
+
 (** The function
     {{:http://www.lua.org/manual/5.1/manual.html#lua_pushcclosure}lua_pushcclosure}
     is not present because it makes very little sense to specify a "closure"
@@ -439,11 +577,37 @@ external pushboolean : state -> bool -> unit = "lua_pushboolean__stub"
 external pushcfunction : state -> oCamlFunction -> unit = "lua_pushcfunction__stub"
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_pushcfunction}lua_pushcfunction}
-    documentation. *)
+    documentation.
+
+    The function receives the thread calling it: the state itself or, when
+    called from a coroutine, the coroutine (as returned by
+    {!Lua_api_lib.tothread}), so that it can read its arguments and yield
+    with {!Lua_api_lib.yield}. *)
 
 val pushocamlfunction : state -> oCamlFunction -> unit
 (** Alias of {!Lua_api_lib.pushcfunction} *)
 
+(** {b NOTE}: the following functions are not present in the official API.
+    Each of them pushes an OCaml function with a fixed signature, called by
+    Lua with a single transition: the arguments are checked and converted by
+    C (raising the usual Lua "bad argument" error, like [luaL_checknumber]) and the result is pushed by C, so the OCaml
+    function does not touch the Lua stack. The function returns exactly one
+    value to Lua. *)
+
+external pushfloat1 : state -> (float -> float) -> unit = "lua_pushfloat1__stub"
+(** Pushes a function of one number returning a number. *)
+
+external pushfloat2 : state -> (float -> float -> float) -> unit = "lua_pushfloat2__stub"
+(** Pushes a function of two numbers returning a number. *)
+
+external pushint1 : state -> (int -> int) -> unit = "lua_pushint1__stub"
+(** Pushes a function of one integer returning an integer. The argument is
+    converted like {!Lua_api_lib.tointeger}. *)
+
+external pushstring1 : state -> (string -> string) -> unit = "lua_pushstring1__stub"
+(** Pushes a function of one string returning a string. A number argument is
+    converted to a string. *)
+
 val pushfstring : state -> ('a, unit, string, string) format4 -> 'a
 (** Pushes onto the stack a formatted string and returns the string itself.
     It is similar to the standard library function sprintf.
@@ -454,7 +618,8 @@ val pushfstring : state -> ('a, unit, string, string) format4 -> 'a
     documentation, but you can use all the conversions of the
     {{:http://caml.inria.fr/pub/docs/manual-ocaml/libref/Printf.html}Printf module}. *)
 
-external pushinteger : state -> int -> unit = "lua_pushinteger__stub"
+external pushinteger : state -> (int [@untagged]) -> unit
+  = "lua_pushinteger__stub" "lua_pushinteger__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_pushinteger}lua_pushinteger}
     documentation. *)
@@ -489,14 +654,16 @@ let push_something state =
 
     This behaviour has a major drawback: while ensuring the lifetime of objects,
     it wastes memory. All the OCaml values pushed as light userdata will in fact
-    be collected when the garbage collector decide to collect the Lua state itself.
+    be collected when the garbage collector decide to collect the Lua state itself,
+    unless you release them explicitly with {!releaselightuserdata}.
     This means that if you have a long running task (e.g. a server) with a Lua
-    state and you use [pushlightuserdata], the values pushed will be {e never}
-    collected!
+    state and you use [pushlightuserdata] without releasing the values, the
+    values pushed will be {e never} collected!
 
     Moreover, if you push a value that have some resources associated with it
     (e.g. a channel, a socket or a DB handler) the resources will be released
-    only when the Lua state goes out of scope. *)
+    only when the Lua state goes out of scope or when the light userdata is
+    released. *)
 
 external pushliteral : state -> string -> unit = "lua_pushlstring__stub"
 (** See
@@ -508,12 +675,13 @@ external pushlstring : state -> string -> unit = "lua_pushlstring__stub"
     {{:http://www.lua.org/manual/5.1/manual.html#lua_pushlstring}lua_pushlstring}
     documentation. *)
 
-external pushnil : state -> unit = "lua_pushnil__stub"
+external pushnil : state -> unit = "lua_pushnil__stub" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_pushnil}lua_pushnil}
     documentation. *)
 
-external pushnumber : state -> float -> unit = "lua_pushnumber__stub"
+external pushnumber : state -> (float [@unboxed]) -> unit
+  = "lua_pushnumber__stub" "lua_pushnumber__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_pushnumber}lua_pushnumber}
     documentation. *)
@@ -523,12 +691,25 @@ val pushstring : state -> string -> unit
     {{:http://www.lua.org/manual/5.1/manual.html#lua_pushstring}lua_pushstring}
     documentation. *)
 
-val pushthread : state -> bool
+external pushsubstring : state -> string -> off:int -> len:int -> unit
+  = "lua_pushsubstring__stub"
+(** Pushes onto the stack the substring of [len] bytes starting at [off],
+    without creating the substring in the OCaml heap. Raises
+    [Invalid_argument] if [off] and [len] do not designate a valid substring.
+
+    {b NOTE}: this function is not present in the official API. *)
+
+external pushsubbytes : state -> Bytes.t -> off:int -> len:int -> unit
+  = "lua_pushsubstring__stub"
+(** Same as {!Lua_api_lib.pushsubstring} for a sequence of bytes. *)
+
+external pushthread : state -> bool = "lua_pushthread__stub" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_pushthread}lua_pushthread}
     documentation. *)
 
-external pushvalue : state -> int -> unit = "lua_pushvalue__stub"
+external pushvalue : state -> (int [@untagged]) -> unit
+  = "lua_pushvalue__stub" "lua_pushvalue__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_pushvalue}lua_pushvalue}
     documentation. *)
@@ -536,17 +717,20 @@ external pushvalue : state -> int -> unit = "lua_pushvalue__stub"
 val pushvfstring : state -> ('a, unit, string, string) format4 -> 'a
 (** Alias of {!Lua_api_lib.pushfstring} *)
 
-external rawequal : state -> int -> int -> bool = "lua_rawequal__stub"
+external rawequal : state -> (int [@untagged]) -> (int [@untagged]) -> bool
+  = "lua_rawequal__stub" "lua_rawequal__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_rawequal}lua_rawequal}
     documentation. *)
 
-external rawget : state -> int -> unit = "lua_rawget__stub"
+external rawget : state -> (int [@untagged]) -> unit
+  = "lua_rawget__stub" "lua_rawget__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_rawget}lua_rawget}
     documentation. *)
 
-external rawgeti : state -> int -> int -> unit = "lua_rawgeti__stub"
+external rawgeti : state -> (int [@untagged]) -> (int [@untagged]) -> unit
+  = "lua_rawgeti__stub" "lua_rawgeti__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_rawgeti}lua_rawgeti}
     documentation. *)
@@ -567,7 +751,45 @@ val register : state -> string -> oCamlFunction -> unit
     documentation. The function is implemented in OCaml using pushcfunction
     and setglobal. *)
 
-external remove : state -> int -> unit = "lua_remove__stub"
+val register_float1 : state -> string -> (float -> float) -> unit
+(** Same as {!Lua_api_lib.register}, using {!Lua_api_lib.pushfloat1}.
+
+    {b NOTE}: this function is not present in the official API. *)
+
+val register_float2 : state -> string -> (float -> float -> float) -> unit
+(** Same as {!Lua_api_lib.register}, using {!Lua_api_lib.pushfloat2}.
+
+    {b NOTE}: this function is not present in the official API. *)
+
+val register_int1 : state -> string -> (int -> int) -> unit
+(** Same as {!Lua_api_lib.register}, using {!Lua_api_lib.pushint1}.
+
+    {b NOTE}: this function is not present in the official API. *)
+
+val register_string1 : state -> string -> (string -> string) -> unit
+(** Same as {!Lua_api_lib.register}, using {!Lua_api_lib.pushstring1}.
+
+    {b NOTE}: this function is not present in the official API. *)
+
+external releaselightuserdata : state -> int -> bool = "lua_releaselightuserdata__stub"
+(** [releaselightuserdata ls index] releases the OCaml value referenced by the
+    light userdata at the given index, previously pushed with
+    {!pushlightuserdata}: the Lua state no longer keeps it alive and the memory
+    used by the binding for it is recycled by the next [pushlightuserdata].
+    Returns [false] if the value at [index] is not a light userdata pushed with
+    [pushlightuserdata] or if it was already released.
+
+    This function is not present in the Lua API. Use it in long running states
+    pushing light userdata over and over again: with a release for every push the
+    memory used by the state (and the work of the OCaml garbage collector) stays
+    constant.
+
+    After the release all the copies of that light userdata still reachable
+    inside the Lua state are stale: {!touserdata} returns [None] for them, even
+    after the memory is recycled by another [pushlightuserdata]. *)
+
+external remove : state -> (int [@untagged]) -> unit
+  = "lua_remove__stub" "lua_remove__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_remove}lua_remove}
     documentation. *)
@@ -610,17 +832,33 @@ external settable : state -> int -> unit = "lua_settable__stub"
     {{:http://www.lua.org/manual/5.1/manual.html#lua_settable}lua_settable}
     documentation. *)
 
-external settop : state -> int -> unit = "lua_settop__stub"
+external settop : state -> (int [@untagged]) -> unit
+  = "lua_settop__stub" "lua_settop__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_settop}lua_settop}
     documentation. *)
 
-val status : state -> thread_status
+external status : state -> thread_status = "lua_status__stub" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_status}lua_status}
     documentation. *)
 
-external toboolean : state -> int -> bool = "lua_toboolean__stub"
+val tobigstring : state -> int -> bigstring option
+(** Like {!Lua_api_lib.tolstring}, but the returned value is a view of the
+    string stored inside the Lua state: no copy is made and no memory is
+    allocated in the OCaml heap, whatever the length of the string.
+
+    {b WARNING}: the returned bigarray is valid only as long as the Lua string
+    is referenced by the state, e.g. while it stays on the stack. Once the
+    string is popped and collected by Lua, accessing the bigarray is undefined
+    behaviour. The bigarray must be considered read-only: Lua strings are
+    interned and shared, modifying one of them breaks the state.
+
+    {b NOTE}: like [lua_tolstring], if the value is a number it is converted
+    in place into a string. *)
+
+external toboolean : state -> (int [@untagged]) -> bool
+  = "lua_toboolean__stub" "lua_toboolean__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_toboolean}lua_toboolean}
     documentation. *)
@@ -633,7 +871,8 @@ val tocfunction : state -> int -> oCamlFunction option
 val toocamlfunction : state -> int -> oCamlFunction option
 (** Alias of {!Lua_api_lib.tocfunction} *)
 
-val tointeger : state -> int -> int
+external tointeger : state -> (int [@untagged]) -> (int [@untagged])
+  = "lua_tointeger__stub" "lua_tointeger__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_tointeger}lua_tointeger}
     documentation. *)
@@ -646,7 +885,64 @@ val tolstring : state -> int -> string option
     {b NOTE}: The original [len] argument is missing because, unlike in C,
     there is no impedance mismatch between OCaml and Lua strings *)
 
-val tonumber : state -> int -> float
+val tolstring_into : state -> int -> Bytes.t -> int -> int
+(** [tolstring_into ls index buf ofs] copies the string at the given acceptable
+    index into [buf], starting at position [ofs], and returns the length of the
+    Lua string. This function does not allocate: if the string is longer than
+    [Bytes.length buf - ofs] only that many bytes are copied, and the caller can
+    detect the truncation by comparing the result with the available space.
+    Raises [Invalid_argument] if [ofs] is not a valid position in [buf] and
+    {!Lua_api_lib.Type_error} if the value is not a string nor a number.
+
+    {b NOTE}: this function is not present in the official API. *)
+
+(** {b NOTE}: the following functions are not present in the official API.
+    Each of them reads the sequence of the table at the given acceptable index
+    (the elements from [1] to the length of the table, as defined by the
+    length operator) into a new array, in a single call to C. They return
+    [None] if the value is not a table or if one of the elements has not the
+    expected type: there is no automatic conversion between numbers and
+    strings. *)
+
+val tofloatarray : state -> int -> float array option
+(** Reads a sequence of numbers. *)
+
+val toflatfloatarray : state -> int -> floatarray option
+(** Same as {!Lua_api_lib.tofloatarray}, returning a [Float.Array.t]. *)
+
+val tofloatbigarray :
+  state -> int -> (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t option
+(** Same as {!Lua_api_lib.tofloatarray}, returning a bigarray. *)
+
+val tointarray : state -> int -> int array option
+(** Reads a sequence of numbers, converted to integers like
+    {!Lua_api_lib.tointeger}. *)
+
+val tostringarray : state -> int -> string array option
+(** Reads a sequence of strings. *)
+
+val to_value : ?max_depth:int -> state -> int -> lua_value
+(** Converts the value at the given acceptable index, and all the nested
+    tables, into a {!Lua_api_lib.lua_value}, in a single call to C. The order
+    of the pairs of a table is the order of {!Lua_api_lib.next}, the
+    metatables are ignored and no metamethod is called. A table referenced
+    twice is converted twice.
+
+    Raises [Conversion_error] if a table contains itself, directly or not, or
+    if the tables are nested more than [max_depth] levels (default 100).
+
+    {b NOTE}: this function is not present in the official API. *)
+
+external push_value : state -> lua_value -> unit = "lua_push_value__stub"
+(** Pushes onto the stack a copy of the given {!Lua_api_lib.lua_value},
+    creating all the nested tables. The stack is left unchanged and
+    [Conversion_error] is raised if a table has a [Nil] or NaN key, or if the
+    value contains an [Opaque] value.
+
+    {b NOTE}: this function is not present in the official API. *)
+
+external tonumber : state -> (int [@untagged]) -> (float [@unboxed])
+  = "lua_tonumber__stub" "lua_tonumber__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_tonumber}lua_tonumber}
     documentation. *)
@@ -665,8 +961,9 @@ val tothread : state -> int -> state option
 
 val touserdata : state -> int -> [> `Userdata of 'a | `Light_userdata of 'a ] option
 (** If the value at the given acceptable index is a full userdata, returns its
-    value as [Some `Userdata v]. If the value is a light userdata, returns its
-    value as [Some `Light_userdata v].
+    value as [Some `Userdata v]. If the value is a light userdata pushed with
+    {!pushlightuserdata} and not released, returns its value as
+    [Some `Light_userdata v].
     Otherwise, returns [None].
 
     {b WARNING}: using this function could be harmful because it actually breaks
@@ -674,7 +971,8 @@ val touserdata : state -> int -> [> `Userdata of 'a | `Light_userdata of 'a ] op
     programmer to push an OCaml value into the Lua state, and then retrieve it
     with a different type. Be very careful! *)
 
-val type_ : state -> int -> lua_type
+external type_ : state -> (int [@untagged]) -> lua_type
+  = "lua_type_variant__stub" "lua_type_variant__unboxed" [@@noalloc]
 (** See
     {{:http://www.lua.org/manual/5.1/manual.html#lua_type}lua_type}
     documentation. *)
@@ -694,6 +992,271 @@ val yield : state -> int -> int
     {{:http://www.lua.org/manual/5.1/manual.html#lua_yield}lua_yield}
     documentation. *)
 
+(********************)
+(** {2 Pinned keys} *)
+(********************)
+
+(** A string interned once in a state and kept alive by a reference in its
+    registry, to be used as a table key. Pushing a key doesn't traverse the
+    OCaml string, nor compute its hash, nor look it up in the table of the
+    strings of the state, so it is the fastest way to read the fields of
+    records stored in Lua tables:
+{[
+let id = Lua.Key.create ls "id" and price = Lua.Key.create ls "price"
+let read_item ls =
+  Lua.getfield_key ls (-1) id;
+  Lua.getfield_key ls (-2) price;
+  let r = (Lua.tointeger ls (-2), Lua.tonumber ls (-1)) in
+  Lua.pop ls 2;
+  r
+]}
+
+    A key belongs to the state (and to all its threads) used to create it and
+    lives as long as the state. Using it with another state works, but it is
+    not faster than the functions taking a string.
+
+    {b NOTE}: this module and the functions below are not present in the
+    official API. *)
+module Key :
+sig
+  type t
+
+  val create : state -> string -> t
+  (** Interns the string in the state. *)
+
+  val name : t -> string
+  (** The string of the key. *)
+end
+
+external pushkey : state -> Key.t -> unit = "lua_pushkey__stub"
+(** Pushes the string of the key onto the stack. *)
+
+external getfield_key : state -> int -> Key.t -> unit = "lua_getfield_key__stub"
+(** Same as {!Lua_api_lib.getfield}, with a pinned key. *)
+
+external setfield_key : state -> int -> Key.t -> unit = "lua_setfield_key__stub"
+(** Same as {!Lua_api_lib.setfield}, with a pinned key. *)
+
+external rawget_key : state -> int -> Key.t -> unit = "lua_rawget_key__stub"
+(** Same as {!Lua_api_lib.getfield_key}, without invoking metamethods (see
+    {!Lua_api_lib.rawget}). *)
+
+external rawset_key : state -> int -> Key.t -> unit = "lua_rawset_key__stub"
+(** Same as {!Lua_api_lib.setfield_key}, without invoking metamethods (see
+    {!Lua_api_lib.rawset}). *)
+
+val getglobal_key : state -> Key.t -> unit
+(** Same as {!Lua_api_lib.getglobal}, with a pinned key. *)
+
+val setglobal_key : state -> Key.t -> unit
+(** Same as {!Lua_api_lib.setglobal}, with a pinned key. *)
+
+(*************************)
+(** {2 Function handles} *)
+(*************************)
+
+(** A Lua function pinned in the registry with a typed signature, to be
+    called from OCaml as an OCaml function. Every call is a single call to C
+    that pushes the function and the arguments, runs a protected call and
+    converts the result:
+{[
+let score = Lua.Fn.(of_global ls "score" (Float @-> Int @-> returning String))
+let s = Lua.Fn.call score 3.5 42
+]}
+
+    {b NOTE}: this module is not present in the official API. *)
+module Fn :
+sig
+  type _ ty =
+    | Unit : unit ty        (** [nil] as argument, any result ignored *)
+    | Bool : bool ty        (** Results converted as {!Lua_api_lib.toboolean} *)
+    | Int : int ty          (** Results converted as {!Lua_api_lib.tointeger} *)
+    | Float : float ty      (** Results converted as {!Lua_api_lib.tonumber} *)
+    | String : string ty    (** Numbers are accepted as results *)
+    | Value : lua_value ty
+    (** Converted as {!Lua_api_lib.push_value} and {!Lua_api_lib.to_value} *)
+
+  type _ signature =
+    | Returning : 'r ty -> 'r signature
+    | Arrow : 'a ty * 'b signature -> ('a -> 'b) signature
+
+  val returning : 'r ty -> 'r signature
+
+  val ( @-> ) : 'a ty -> 'b signature -> ('a -> 'b) signature
+
+  type 'f t
+
+  val create : state -> 'f signature -> 'f t
+  (** Pops the function at the top of the stack and pins it in the registry. *)
+
+  val of_global : state -> string -> 'f signature -> 'f t
+  (** Pins the value of the given global variable. *)
+
+  val set_error_handler : 'f t -> unit
+  (** Pops the function at the top of the stack and uses it as the message
+      handler of every call (see [errfunc] in {!Lua_api_lib.pcall}), for
+      example to add a traceback to the error messages. *)
+
+  val release : 'f t -> unit
+  (** Removes the function and the message handler from the registry. The
+      handle can't be called anymore. *)
+
+  val call : 'f t -> 'f
+  (** [call h] is the OCaml function calling the Lua function, which is called
+      when all the arguments are given (immediately if the signature has no
+      arguments). Raises [Call_error] with the error message if the call
+      fails or if the result has not the expected type, [Conversion_error] if
+      an argument or the result can't be converted. The stack is left
+      unchanged. *)
+end
+
+(*****************)
+(** {2 Profiler} *)
+(*****************)
+
+(** A sampling profiler for the Lua code running in a state. The Lua call
+    stack is sampled from a count hook and the samples are aggregated by
+    stack, each frame being a function and its current line. The time spent
+    in the OCaml functions called by Lua is measured separately. The cost of
+    the profiler is a hook call every few thousand instructions and the walk
+    of the stack for every sample, so it can be left on for a fraction of the
+    production traffic.
+
+    The hook is installed on the given state, and on the threads
+    (coroutines) when they are resumed by {!Lua_api_lib.resume} or by the
+    [coroutine] library opened by {!Lua_aux_lib.openlibs}. A thread still
+    holding the hook after {!stop} removes it at its next event.
+
+    An OCaml function left by a Lua error (e.g. {!Lua_aux_lib.error}) is
+    not measured, and if the script catches the error the OCaml functions it
+    calls afterwards are not measured either, until the Lua code returns to
+    OCaml.
+
+    {b NOTE}: this module is not present in the official API. *)
+module Profiler :
+sig
+  type mode =
+    | Instructions of int   (** A sample every n Lua VM instructions *)
+    | Interval of float
+    (** A sample every n seconds, checked every 1000 instructions *)
+
+  type report =
+    {
+      samples : int;                        (** Total number of samples *)
+      stacks : (string list * int) list;
+      (** The sampled stacks, from the outermost frame, with their number of
+          samples, most sampled first. A frame is the name of the function and
+          the current line, e.g. ["compute test.lua:12"]. *)
+      callbacks : int;                      (** Number of calls to OCaml *)
+      callback_time : float;
+      (** Seconds spent in the OCaml functions called by Lua, nested calls
+          counted once *)
+    }
+
+  val start : ?mode:mode -> ?max_depth:int -> state -> unit
+  (** Starts profiling, discarding the data collected so far. The default
+      mode is [Instructions 10_000]; at most [max_depth] frames (default 64)
+      of a stack are kept. Raises [Invalid_argument] if a parameter is not
+      positive. *)
+
+  val stop : state -> unit
+  (** Stops profiling, keeping the collected data. *)
+
+  val report : state -> report
+  (** The data collected since the last {!start}, while the profiler is
+      running or after {!stop}. *)
+
+  val lines : report -> (string * int) list
+  (** The innermost frames of the samples (i.e. the functions and the lines
+      being executed) with their number of samples, most sampled first. *)
+
+  val collapsed : report -> string
+  (** The stacks in the "collapsed" format read by the flame graph tools:
+      a line per stack, with the frames separated by [';'] and followed by a
+      space and the number of samples. *)
+end
+
+(*********************************)
+(** {2 Batched stack operations} *)
+(*********************************)
+
+(** A sequence of stack operations, compiled once into a compact program and
+    then executed with a single call to C, instead of paying the OCaml to C
+    transition on every operation. A program can be run many times with
+    different arguments, e.g. to call the same Lua function from a hot path:
+{[
+let call_add = Lua.Batch.compile
+  [ Getglobal "add"; Pusharg 0; Pusharg 1; Pcall (2, 1, 0); Tonumber (-1); Pop 1 ]
+let results = Lua.Batch.results call_add
+let add ls x y =
+  match Lua.Batch.run ls call_add [| Number x; Number y |] results with
+  | Lua.LUA_OK -> results.(0)
+  | err -> raise (Lua.Error err)
+]}
+
+    {b NOTE}: this module is not present in the official API. *)
+module Batch :
+sig
+  type op =
+    | Getglobal of string           (** {!Lua_api_lib.getglobal} *)
+    | Setglobal of string           (** {!Lua_api_lib.setglobal} *)
+    | Getfield of int * string      (** {!Lua_api_lib.getfield} *)
+    | Setfield of int * string      (** {!Lua_api_lib.setfield} *)
+    | Gettable of int               (** {!Lua_api_lib.gettable} *)
+    | Settable of int               (** {!Lua_api_lib.settable} *)
+    | Rawgeti of int * int          (** {!Lua_api_lib.rawgeti} *)
+    | Pushnil                       (** {!Lua_api_lib.pushnil} *)
+    | Pushboolean of bool           (** {!Lua_api_lib.pushboolean} *)
+    | Pushinteger of int            (** {!Lua_api_lib.pushinteger} *)
+    | Pushnumber of float           (** {!Lua_api_lib.pushnumber} *)
+    | Pushstring of string          (** {!Lua_api_lib.pushstring} *)
+    | Pushvalue of int              (** {!Lua_api_lib.pushvalue} *)
+    | Pusharg of int
+    (** Pushes the n-th argument of {!run}, with {!Lua_api_lib.push_value} *)
+    | Pcall of int * int * int
+    (** {!Lua_api_lib.pcall}: if the call fails the execution stops *)
+    | Pop of int                    (** {!Lua_api_lib.pop} *)
+    | Settop of int                 (** {!Lua_api_lib.settop} *)
+    | Toboolean of int
+    (** Stores [Boolean] {!Lua_api_lib.toboolean} in the next result *)
+    | Tonumber of int
+    (** Stores [Number] {!Lua_api_lib.tonumber} in the next result *)
+    | Tostring of int
+    (** Stores [String] {!Lua_api_lib.tolstring} in the next result, or [Nil]
+        if the value is not a string nor a number *)
+
+  type program
+
+  val compile : op list -> program
+  (** Compiles a sequence of operations. The growth of the stack is computed
+      here, and checked by {!run} once at the start and after every [Pcall]
+      with [multret] or [Settop] to a non-negative index. Raises
+      [Invalid_argument] if an argument number is negative. *)
+
+  val nargs : program -> int
+  (** The number of arguments of the program. *)
+
+  val nresults : program -> int
+  (** The number of results of the program. *)
+
+  val results : program -> lua_value array
+  (** Allocates a vector large enough for the results of the program, that
+      can be reused by every run. *)
+
+  val run : state -> program -> lua_value array -> lua_value array -> thread_status
+  (** [run ls p args results] executes the program and stores in [results]
+      the values produced by [Toboolean], [Tonumber] and [Tostring], in
+      order. Returns [LUA_OK], or the error code of the first [Pcall] that
+      fails: in this case the execution stops and the error message is left
+      on the top of the stack. Like the corresponding functions, the
+      operations other than [Pcall] are not protected against Lua errors.
+      Raises [Invalid_argument] if [args] or [results] are too short,
+      [Conversion_error] if an argument can't be pushed and [Failure] if the
+      stack can't grow as much as the program needs. *)
+end
+
 (**/**)
 
+external same_thread : state -> state -> bool = "lua_same_thread__stub" [@@noalloc]
+
 val init : unit lazy_t
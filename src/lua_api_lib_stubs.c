@@ -1,6 +1,10 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -13,6 +17,7 @@
 #include <caml/fail.h>
 #include <caml/callback.h>
 #include <caml/signals.h>
+#include <caml/bigarray.h>
 
 #include "stub.h"
 
@@ -64,6 +69,36 @@ typedef struct writer_data
     value writer_data;
 } writer_data;
 
+/* A stack of the sampling profiler, with the number of samples */
+typedef struct profile_entry
+{
+    struct profile_entry *next;
+    uint32_t hash;
+    long samples;
+    char stack[];                             /* frames separated by ';' */
+} profile_entry;
+
+struct profiler
+{
+    int running;
+    int timer;                                /* sample on time, not instructions */
+    int period;                               /* instructions between samples */
+    double interval;                          /* seconds between samples */
+    double next_sample;
+    long instructions;                        /* since the last sample */
+    int max_depth;
+    long samples;
+    profile_entry **buckets;
+    size_t buckets_num;
+    size_t entries_num;
+    char *key;                                /* scratch buffer for a stack */
+    size_t key_size;
+    int callback_depth;                       /* nested OCaml callbacks */
+    double callback_start;
+    long callbacks;
+    double callback_time;
+};
+
 static void finalize_thread(value L);     /* Forward declaration */
 
 static struct custom_operations thread_lua_State_ops =
@@ -81,78 +116,245 @@ static struct custom_operations thread_lua_State_ops =
 /*****                         UTILITY FUNCTIONS                          *****/
 /******************************************************************************/
 /*
- * Pushes on the stack of L the array used to track the threads created via
- * lua_newthread
+ * Returns the binding data of L. The data is the container of the allocator
+ * data registered with lua_newstate, so it's retrieved in O(1) without
+ * touching the Lua stack; this is safe also when the state is running Lua code
+ * in another system thread.
  */
-static void push_threads_array(lua_State *L)
+ocaml_data * get_ocaml_data(lua_State *L)
 {
-    debug(3, "push_threads_array(%p)\n", (void*)L);
+    void *ud = NULL;
+    lua_getallocf(L, &ud);
+    return (ocaml_data*)((char*)ud - offsetof(ocaml_data, ad));
+}
 
-    lua_pushstring(L, UUID);
-    lua_gettable(L, LUA_REGISTRYINDEX);
-    lua_pushstring(L, "threads_array");
-    lua_gettable(L, -2);
-    lua_insert(L, -2);
-    lua_pop(L, 1);
 
-    debug(4, "push_threads_array: RETURN\n");
+/*
+ * Pushes on the stack of L the table used to track the threads created via
+ * lua_newthread: the keys are the threads, the values the number of OCaml
+ * values referring to each thread.
+ */
+static void push_threads_table(lua_State *L)
+{
+    debug(3, "push_threads_table(%p)\n", (void*)L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, get_ocaml_data(L)->threads_table_ref);
+    debug(4, "push_threads_table: RETURN\n");
 }
 
 
 /*
- * Pushes on the stack of L the array used to track the light userdata created via
- * lua_pushlightuserdata
+ * The light userdata pushed by lua_pushlightuserdata__stub are not pointers
+ * but handles: the index of the slot holding the OCaml value in the low bits,
+ * the generation of the slot in the high bits. A released slot is reused with
+ * the next generation, so a copy of the old handle still inside Lua never
+ * resolves to the new value. The slots are allocated by pages, which never
+ * move, since the value of every slot is a global root.
  */
-void push_lud_array(lua_State *L)
+#define LUD_PAGE_SIZE 1024
+#define LUD_INDEX_BITS (sizeof(void*) > 4 ? 32 : 20)
+#define LUD_INDEX_MASK (((uintptr_t)1 << LUD_INDEX_BITS) - 1)
+#define LUD_MAX_GENERATION (UINTPTR_MAX >> LUD_INDEX_BITS)
+
+static lud_slot *lud_slot_at(ocaml_data *data, int i)
 {
-    debug(3, "push_lud_array(%p)\n", (void*)L);
+    return &(data->lud_pages[i / LUD_PAGE_SIZE][i % LUD_PAGE_SIZE]);
+}
 
-    lua_pushstring(L, UUID);
-    lua_gettable(L, LUA_REGISTRYINDEX);
-    lua_pushstring(L, "light_userdata_array");
-    lua_gettable(L, -2);
-    lua_insert(L, -2);
-    lua_pop(L, 1);
+/* Stores the block v in a slot and returns its handle */
+void *lud_new(ocaml_data *data, value v)
+{
+    lud_slot *slot;
+    int i;
+
+    if (data->lud_free >= 0)
+    {
+        i = data->lud_free;
+        slot = lud_slot_at(data, i);
+        data->lud_free = slot->next_free;
+        caml_modify_generational_global_root(&(slot->v), v);
+    }
+    else
+    {
+        i = data->lud_slots_num;
+        if ((uintptr_t)i >= LUD_INDEX_MASK)
+            caml_raise_out_of_memory();
+        if (i % LUD_PAGE_SIZE == 0)
+        {
+            data->lud_pages =
+                (lud_slot**)caml_stat_resize(data->lud_pages,
+                                             (data->lud_pages_num + 1) * sizeof(lud_slot*));
+            data->lud_pages[data->lud_pages_num++] =
+                (lud_slot*)caml_stat_alloc(LUD_PAGE_SIZE * sizeof(lud_slot));
+        }
+        data->lud_slots_num++;
+        slot = lud_slot_at(data, i);
+        slot->v = v;
+        slot->generation = 1;
+        caml_register_generational_global_root(&(slot->v));
+    }
 
-    debug(4, "push_lud_array: RETURN\n");
+    return (void*)((slot->generation << LUD_INDEX_BITS) | (uintptr_t)i);
 }
 
+/* The cell of the value of a handle, NULL if the handle was released or was
+ * not returned by lud_new (e.g. a pointer pushed by a C library) */
+value *lud_resolve(ocaml_data *data, void *handle)
+{
+    uintptr_t h = (uintptr_t)handle;
+    uintptr_t i = h & LUD_INDEX_MASK;
 
-ocaml_data * get_ocaml_data(lua_State *L)
+    if (i >= (uintptr_t)data->lud_slots_num)
+        return NULL;
+    lud_slot *slot = lud_slot_at(data, (int)i);
+    if (slot->generation != (h >> LUD_INDEX_BITS) || !Is_block(slot->v))
+        return NULL;
+    return &(slot->v);
+}
+
+static int lud_release(ocaml_data *data, void *handle)
+{
+    if (lud_resolve(data, handle) == NULL)
+        return 0;
+
+    int i = (int)((uintptr_t)handle & LUD_INDEX_MASK);
+    lud_slot *slot = lud_slot_at(data, i);
+    caml_modify_generational_global_root(&(slot->v), Val_unit);
+
+    /* a slot that exhausted its generations is never reused */
+    if (slot->generation < LUD_MAX_GENERATION)
+    {
+        slot->generation++;
+        slot->next_free = data->lud_free;
+        data->lud_free = i;
+    }
+    return 1;
+}
+
+/* Called by the finalizer of the state */
+void lud_free_all(ocaml_data *data)
+{
+    int i;
+    for (i = 0; i < data->lud_slots_num; i++)
+        caml_remove_generational_global_root(&(lud_slot_at(data, i)->v));
+    for (i = 0; i < data->lud_pages_num; i++)
+        caml_stat_free(data->lud_pages[i]);
+    caml_stat_free(data->lud_pages);
+}
+
+
+/*
+ * States created with the "release_runtime" flag run Lua code without the
+ * OCaml runtime lock: the stubs executing Lua code call release_runtime and
+ * acquire_runtime around the Lua function, while every C function calling back
+ * OCaml from inside Lua (closures, panic function, __gc metamethods) is wrapped
+ * between begin_callback and end_callback.
+ *
+ * A callback left by a Lua error (luaL_error, luaL_checkstring...) longjmps
+ * past end_callback, so the runtime is still held when the Lua function
+ * returns: acquire_runtime re-acquires it only if it is really released.
+ */
+void release_runtime(ocaml_data *data)
+{
+    data->runtime_released = 1;
+    caml_enter_blocking_section();
+}
+
+void acquire_runtime(ocaml_data *data)
+{
+    if (data->runtime_released)
+    {
+        caml_leave_blocking_section();
+        data->runtime_released = 0;
+    }
+}
+
+int begin_callback(ocaml_data *data)
+{
+    if (data->runtime_released)
+    {
+        acquire_runtime(data);
+        return 1;
+    }
+    else
+        return 0;
+}
+
+void end_callback(ocaml_data *data, int acquired)
 {
-    lua_pushstring(L, UUID);
-    lua_gettable(L, LUA_REGISTRYINDEX);
-    lua_pushstring(L, "ocaml_data");
-    lua_gettable(L, -2);
-    ocaml_data *info = (ocaml_data*)lua_touserdata(L, -1);
-    lua_pop(L, 2);
-    return info;
+    if (acquired)
+        release_runtime(data);
 }
 
 
 static int panic_wrapper(lua_State *L)
 {
     ocaml_data *data = get_ocaml_data(L);
+    begin_callback(data);   /* a panic function never returns to Lua */
     return Int_val(caml_callback(data->panic_callback,  // callback
                                  data->state_value));   // Lua state
 }
 
-/* This function is taken from the Lua source code, file ltablib.c line 118 */
-static int tremove (lua_State *L)
+/*
+ * Increments the number of OCaml values referring to the thread at the given
+ * index of the stack of L.
+ */
+static void track_thread(lua_State *L, int index)
+{
+    debug(3, "track_thread(%p, %d)\n", (void*)L, index);
+
+    lua_pushvalue(L, index);
+    push_threads_table(L);
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);
+    int count = lua_tointeger(L, -1);         /* nil (not tracked) is 0 */
+    lua_pop(L, 1);
+
+    /* Here the stack is: thread, threads_table */
+    lua_insert(L, -2);
+    lua_pushinteger(L, count + 1);
+    lua_rawset(L, -3);                        /* threads_table[thread] = count + 1 */
+    lua_pop(L, 1);
+
+    debug(4, "track_thread: RETURN\n");
+}
+
+/*
+ * Decrements the number of OCaml values referring to the thread and, when no
+ * OCaml value is left, removes the thread from the table.
+ */
+static void untrack_thread(lua_State *thread)
 {
-    int e = aux_getn(L, 1);
-    int pos = luaL_optint(L, 2, e);
-    if (!(1 <= pos && pos <= e))  /* position is outside bounds? */
-        return 0;  /* nothing to remove */
-    luaL_setn(L, 1, e - 1);  /* t.n = n-1 */
-    lua_rawgeti(L, 1, pos);  /* result = t[pos] */
-    for ( ;pos<e; pos++) {
-        lua_rawgeti(L, 1, pos+1);
-        lua_rawseti(L, 1, pos);  /* t[pos] = t[pos+1] */
-    }
-    lua_pushnil(L);
-    lua_rawseti(L, 1, e);  /* t[e] = nil */
-    return 1;
+    debug(3, "untrack_thread(%p)\n", (void*)thread);
+
+    push_threads_table(thread);
+    lua_pushthread(thread);
+    lua_pushvalue(thread, -1);
+    lua_rawget(thread, -3);
+    int count = lua_tointeger(thread, -1);
+    lua_pop(thread, 1);
+
+    /* Here the stack is: thread, threads_table */
+    if (count > 1)
+        lua_pushinteger(thread, count - 1);
+    else
+        lua_pushnil(thread);
+    lua_rawset(thread, -3);                   /* threads_table[thread] = count - 1 */
+    lua_pop(thread, 1);
+
+    debug(4, "untrack_thread: RETURN\n");
+}
+
+/*
+ * Threads finalized by the OCaml GC while their state is running Lua code
+ * without the runtime lock cannot be touched: they are queued and untracked
+ * by the owner of the state as soon as the Lua code returns.
+ */
+void untrack_pending_threads(ocaml_data *data)
+{
+    int i;
+    for (i = 0; i < data->pending_threads_num; i++)
+        untrack_thread(data->pending_threads[i]);
+    data->pending_threads_num = 0;
 }
 
 static void finalize_thread(value L)
@@ -160,45 +362,335 @@ static void finalize_thread(value L)
     debug(3, "finalize_thread(value L)\n");
 
     lua_State *thread = lua_State_val(L);
-    push_threads_array(thread);
-    int table_pos = lua_gettop(thread);
+    ocaml_data *data = get_ocaml_data(thread);
+
+    if (data->runtime_released)
+    {
+        if (data->pending_threads_num == data->pending_threads_size)
+        {
+            data->pending_threads_size = 2 * data->pending_threads_size + 8;
+            data->pending_threads =
+                (lua_State**)caml_stat_resize(data->pending_threads,
+                                              data->pending_threads_size * sizeof(lua_State*));
+        }
+        data->pending_threads[data->pending_threads_num++] = thread;
+    }
+    else
+        untrack_thread(thread);
+
+    debug(4, "finalize_thread: RETURN\n");
+    return;
+}
+
+static double monotonic_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * A state has a single hook, shared by the features of the binding that need
+ * one: hook_dispatcher forwards the events to the active features, and
+ * set_hook installs or removes the hook after a feature is turned on or off.
+ *
+ * Lua hooks belong to a thread and are copied only to the coroutines it
+ * creates: every thread gets the hook of the state with refresh_hook, called
+ * before a coroutine is resumed (by the stubs and by the coroutine library
+ * installed by hook_coroutine_lib) and by the hook itself, so that a thread
+ * with an outdated hook updates or removes it at its next event.
+ */
+static void profiler_hook(lua_State *L, profiler *p, int count);
+static void limits_hook(lua_State *L, ocaml_data *data, call_limits *l, int count);
+static void refresh_hook(lua_State *L, ocaml_data *data);
+
+static void hook_dispatcher(lua_State *L, lua_Debug *ar)
+{
+    ocaml_data *data = get_ocaml_data(L);
+    int count = lua_gethookcount(L);
+    if (ar->event != LUA_HOOKCOUNT)
+        return;
+    if (data->profiler != NULL && data->profiler->running)
+        profiler_hook(L, data->profiler, count);
+    if (data->limits.active)
+        limits_hook(L, data, &data->limits, count);  /* may not return */
+    refresh_hook(L, data);
+}
+
+static void set_hook(lua_State *L, ocaml_data *data)
+{
+    int count = 0;
+
+    if (data->profiler != NULL && data->profiler->running)
+        count = data->profiler->timer ? 1000 : data->profiler->period;
+
+    if (data->limits.active)
+    {
+        /* the next check is at most at the end of the instruction budget */
+        long limits_count = 1000;
+        long remaining = data->limits.max_instructions - data->limits.instructions;
+        if (data->limits.reached != LIMIT_NONE)
+            limits_count = 1;
+        else if (data->limits.max_instructions >= 0 && remaining < limits_count)
+            limits_count = remaining > 0 ? remaining : 1;
+        if (count == 0 || limits_count < count)
+            count = (int)limits_count;
+    }
+
+    data->hook_count = count;
+    if (count > 0)
+        lua_sethook(L, hook_dispatcher, LUA_MASKCOUNT, count);
+    else
+        lua_sethook(L, NULL, 0, 0);
+}
+
+/* Same as set_hook with the current count, but the hook of L is left alone,
+ * with the instructions already counted, if it is up to date */
+static void refresh_hook(lua_State *L, ocaml_data *data)
+{
+    int count = data->hook_count;
+    if (count > 0)
+    {
+        if (lua_gethook(L) != hook_dispatcher || lua_gethookcount(L) != count)
+            lua_sethook(L, hook_dispatcher, LUA_MASKCOUNT, count);
+    }
+    else if (lua_gethook(L) != NULL)
+        lua_sethook(L, NULL, 0, 0);
+}
+
+/*
+ * Replacements of coroutine.resume and of the functions returned by
+ * coroutine.wrap: the original function is the first upvalue. The coroutine
+ * gets the hook of the state before running, the caller after (a limit may
+ * have been reached by the coroutine).
+ */
+static int resume_with_hook(lua_State *L)
+{
+    ocaml_data *data = get_ocaml_data(L);
+    lua_State *co = lua_tothread(L, 1);
+    if (co != NULL)
+        refresh_hook(co, data);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    refresh_hook(L, data);
+    return lua_gettop(L);
+}
 
-    lua_pushnil(thread);  /* first key */
+static int wrapped_resume_with_hook(lua_State *L)
+{
+    ocaml_data *data = get_ocaml_data(L);
+    refresh_hook(lua_tothread(L, lua_upvalueindex(2)), data);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    refresh_hook(L, data);
+    return lua_gettop(L);
+}
 
-    lua_State *el = NULL;
-    int found = 0;
+static int wrap_with_hook(lua_State *L)
+{
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, 1);        /* the original wrap */
+    lua_getupvalue(L, -1, 1);                 /* the coroutine */
+    lua_pushcclosure(L, wrapped_resume_with_hook, 2);
+    return 1;
+}
 
-    /* Find the thread element to be removed */
-    while (lua_next(thread, table_pos) != 0)
+/* Installs the replacements in the "coroutine" table, once */
+void hook_coroutine_lib(lua_State *L)
+{
+    lua_getglobal(L, "coroutine");
+    if (lua_istable(L, -1))
     {
-        el = lua_tothread(thread, -1);
-        if (el == thread)
+        lua_getfield(L, -1, "resume");
+        if (lua_tocfunction(L, -1) != resume_with_hook)
         {
-            found = 1;
-            break;
+            lua_pushcclosure(L, resume_with_hook, 1);
+            lua_setfield(L, -2, "resume");
+            lua_getfield(L, -1, "wrap");
+            lua_pushcclosure(L, wrap_with_hook, 1);
+            lua_setfield(L, -2, "wrap");
         }
-        lua_pop(thread, 1);
+        else
+            lua_pop(L, 1);
     }
+    lua_pop(L, 1);
+}
+
+/* debug.sethook would remove the hook of the binding from a thread: it is
+ * refused while a pcall_limited is running, so that a script can't escape
+ * its limits */
+static int sethook_with_limits(lua_State *L)
+{
+    if (get_ocaml_data(L)->limits.active)
+        return luaL_error(L, "debug.sethook is not allowed in a limited call");
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    return lua_gettop(L);
+}
 
-    /* If found, remove it from the table */
-    if (found)
+/* Installs the replacement of debug.sethook, once */
+void hook_debug_lib(lua_State *L)
+{
+    lua_getglobal(L, "debug");
+    if (lua_istable(L, -1))
     {
-        lua_pop(thread, 1);
-        if (tremove(thread) == 1)
+        lua_getfield(L, -1, "sethook");
+        if (lua_isfunction(L, -1) && lua_tocfunction(L, -1) != sethook_with_limits)
         {
-            lua_pop(thread, 1);
+            lua_pushcclosure(L, sethook_with_limits, 1);
+            lua_setfield(L, -2, "sethook");
         }
-        lua_pop(thread, 2);
+        else
+            lua_pop(L, 1);
     }
-    debug(4, "finalize_thread: RETURN\n");
-    return;
+    lua_pop(L, 1);
+}
+
+/*
+ * A callback left by a Lua error never decrements the callback_depth of the
+ * profiler: the stubs running Lua code save it and restore it when Lua
+ * returns.
+ */
+static int save_callback_depth(ocaml_data *data)
+{
+    return data->profiler != NULL ? data->profiler->callback_depth : 0;
+}
+
+static void restore_callback_depth(ocaml_data *data, int depth)
+{
+    if (data->profiler != NULL)
+        data->profiler->callback_depth = depth;
+}
+
+/*
+ * Calls an OCaml closure from a C function called by Lua, between
+ * begin_callback and end_callback. The time spent in the outermost callback is
+ * added to the profiler.
+ */
+static value call_ocaml_closure(ocaml_data *data, value closure, int narg, value args[])
+{
+    profiler *p = data->profiler;
+    if (p != NULL && p->running && p->callback_depth++ == 0)
+        p->callback_start = monotonic_time();
+
+    value result = caml_callbackN_exn(closure, narg, args);
+
+    if (p != NULL && p->callback_depth > 0 && --p->callback_depth == 0)
+    {
+        p->callbacks++;
+        p->callback_time += monotonic_time() - p->callback_start;
+    }
+
+    if (Is_exception_result(result))
+        caml_raise(Extract_exception(result));
+    return result;
 }
 
+/*
+ * The OCaml function receives the thread running it: the main thread is
+ * data->state_value, a coroutine is tracked and wrapped as by lua_tothread,
+ * so that the function can use its stack and yield.
+ */
 static int execute_ocaml_closure(lua_State *L)
 {
     value *ocaml_closure = (value*)lua_touserdata(L, lua_upvalueindex(1));
     ocaml_data *data = get_ocaml_data(L);
-    return Int_val(caml_callback(*ocaml_closure, data->state_value));
+    int is_main = (L == lua_State_val(data->state_value));
+    if (!is_main)
+    {
+        lua_pushthread(L);
+        track_thread(L, -1);
+        lua_pop(L, 1);
+    }
+    int acquired = begin_callback(data);
+    value arg = data->state_value;
+    if (!is_main)
+    {
+        /* no resource is held by the block: it must not speed up the GC */
+        arg = caml_alloc_custom(&thread_lua_State_ops, sizeof(lua_State *), 0, 1);
+        lua_State_val(arg) = L;
+    }
+    int retval = Int_val(call_ocaml_closure(data, *ocaml_closure, 1, &arg));
+    end_callback(data, acquired);
+    return retval;
+}
+
+/*
+ * The following functions execute the typed OCaml functions pushed by
+ * lua_pushfloat1__stub and the like: the arguments are checked and converted
+ * before entering the OCaml runtime, since a Lua error can't cross OCaml
+ * frames, and the result is pushed by the function itself.
+ */
+static int execute_ocaml_float1(lua_State *L)
+{
+    lua_Number x = luaL_checknumber(L, 1);
+    value *ocaml_closure = (value*)lua_touserdata(L, lua_upvalueindex(1));
+    ocaml_data *data = get_ocaml_data(L);
+    int acquired = begin_callback(data);
+    value arg = caml_copy_double(x);
+    lua_pushnumber(L, Double_val(call_ocaml_closure(data, *ocaml_closure, 1, &arg)));
+    end_callback(data, acquired);
+    return 1;
+}
+
+static int execute_ocaml_float2(lua_State *L)
+{
+    lua_Number x = luaL_checknumber(L, 1);
+    lua_Number y = luaL_checknumber(L, 2);
+    value *ocaml_closure = (value*)lua_touserdata(L, lua_upvalueindex(1));
+    ocaml_data *data = get_ocaml_data(L);
+    int acquired = begin_callback(data);
+    CAMLparam0();
+    CAMLlocalN(args, 2);
+    args[0] = caml_copy_double(x);
+    args[1] = caml_copy_double(y);
+    lua_Number result = Double_val(call_ocaml_closure(data, *ocaml_closure, 2, args));
+    CAMLdrop;
+    lua_pushnumber(L, result);
+    end_callback(data, acquired);
+    return 1;
+}
+
+static int execute_ocaml_int1(lua_State *L)
+{
+    lua_Integer n = luaL_checkinteger(L, 1);
+    value *ocaml_closure = (value*)lua_touserdata(L, lua_upvalueindex(1));
+    ocaml_data *data = get_ocaml_data(L);
+    int acquired = begin_callback(data);
+    value arg = Val_long(n);
+    lua_pushinteger(L, Long_val(call_ocaml_closure(data, *ocaml_closure, 1, &arg)));
+    end_callback(data, acquired);
+    return 1;
+}
+
+static int execute_ocaml_string1(lua_State *L)
+{
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    value *ocaml_closure = (value*)lua_touserdata(L, lua_upvalueindex(1));
+    ocaml_data *data = get_ocaml_data(L);
+    int acquired = begin_callback(data);
+    value arg = caml_alloc_string(len);
+    memcpy((char *)String_val(arg), s, len);
+    value result = call_ocaml_closure(data, *ocaml_closure, 1, &arg);
+
+    /* lua_pushlstring can raise a memory error, which must not skip
+     * end_callback: the result is copied to the scratch buffer of the state,
+     * which can't leak, and pushed after leaving the runtime */
+    len = caml_string_length(result);
+    if (len > data->scratch_size)
+    {
+        data->scratch = (char*)caml_stat_resize(data->scratch, len);
+        data->scratch_size = len;
+    }
+    memcpy(data->scratch, String_val(result), len);
+    end_callback(data, acquired);
+    lua_pushlstring(L, data->scratch, len);
+    return 1;
 }
 
 /******************************************************************************/
@@ -215,15 +707,35 @@ value lua_atpanic__stub(value L, value panicf)
     ocaml_data *data = get_ocaml_data(state);
 
     old_panicf = data->panic_callback;
-    caml_remove_global_root(&(data->panic_callback));
-    caml_register_global_root(&(data->panic_callback));
-    data->panic_callback = panicf;
+    caml_modify_generational_global_root(&(data->panic_callback), panicf);
     lua_atpanic(state, panic_wrapper);
 
     CAMLreturn(old_panicf);
 }
 
-STUB_STATE_INT_INT_VOID(lua_call, nargs, nresults)
+CAMLprim
+value lua_call__stub(value L, value nargs, value nresults)
+{
+    CAMLparam3(L, nargs, nresults);
+
+    lua_State *LL = lua_State_val(L);
+    ocaml_data *data = get_ocaml_data(LL);
+    int depth = save_callback_depth(data);
+
+    refresh_hook(LL, data);
+    if (data->release_runtime)
+    {
+        release_runtime(data);
+        lua_call(LL, Int_val(nargs), Int_val(nresults));
+        acquire_runtime(data);
+        untrack_pending_threads(data);
+    }
+    else
+        lua_call(LL, Int_val(nargs), Int_val(nresults));
+    restore_callback_depth(data, depth);
+
+    CAMLreturn(Val_unit);
+}
 
 STUB_STATE_INT_BOOL(lua_checkstack, extra)
 
@@ -268,21 +780,21 @@ value lua_dump__stub(value L, value writer, value data)
 
     writer_data *internal_data = (writer_data*)caml_stat_alloc(sizeof(writer_data));
 
-    caml_register_global_root(&(internal_data->writer_function));
-    caml_register_global_root(&(internal_data->state_value));
-    caml_register_global_root(&(internal_data->writer_data));
-
     internal_data->writer_function = writer;
     internal_data->state_value = L;
     internal_data->writer_data = data;
 
+    caml_register_generational_global_root(&(internal_data->writer_function));
+    caml_register_generational_global_root(&(internal_data->state_value));
+    caml_register_generational_global_root(&(internal_data->writer_data));
+
     int result = lua_dump(  lua_State_val(L),
                             writer_function,
                             (void*)internal_data  );
 
-    caml_remove_global_root(&(internal_data->writer_function));
-    caml_remove_global_root(&(internal_data->state_value));
-    caml_remove_global_root(&(internal_data->writer_data));
+    caml_remove_generational_global_root(&(internal_data->writer_function));
+    caml_remove_generational_global_root(&(internal_data->state_value));
+    caml_remove_generational_global_root(&(internal_data->writer_data));
 
     caml_stat_free(internal_data);
 
@@ -290,6 +802,79 @@ value lua_dump__stub(value L, value writer, value data)
     CAMLreturn(Val_int(result));
 }
 
+int dump_buffer_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+    dump_buffer *buf = (dump_buffer*)ud;
+    (void)L;
+
+    if (buf->len + sz > buf->size)
+    {
+        size_t new_size = (buf->size == 0) ? 4096 : buf->size;
+        while (new_size < buf->len + sz)
+            new_size *= 2;
+        char *new_data = (char*)realloc(buf->data, new_size);
+        if (new_data == NULL)
+            return 1;
+        buf->data = new_data;
+        buf->size = new_size;
+    }
+    memcpy(buf->data + buf->len, p, sz);
+    buf->len += sz;
+    return 0;
+}
+
+/* Dumps the function at the top of the stack into buf, without calling back
+ * OCaml. Raises Type_error if it is not a Lua function */
+static void dump_native(value L, value strip, dump_buffer *buf, char *type_error_msg)
+{
+    lua_State *LL = lua_State_val(L);
+
+    if (!lua_isfunction(LL, -1) || lua_iscfunction(LL, -1))
+        raise_type_error(type_error_msg);
+
+    buf->data = NULL;
+    buf->len = 0;
+    buf->size = 0;
+    if (dump_function(LL, dump_buffer_writer, buf, Bool_val(strip)) != 0)
+    {
+        free(buf->data);
+        caml_raise_out_of_memory();
+    }
+}
+
+CAMLprim
+value lua_dump_to_string__stub(value L, value strip)
+{
+    CAMLparam2(L, strip);
+    CAMLlocal1(ret_val);
+    dump_buffer buf;
+
+    dump_native(L, strip, &buf, "lua_dump_to_string: not a Lua function!");
+    ret_val = caml_alloc_string(buf.len);
+    memcpy(Bytes_val(ret_val), buf.data, buf.len);
+    free(buf.data);
+
+    CAMLreturn(ret_val);
+}
+
+CAMLprim
+value lua_dump_to_bigstring__stub(value L, value strip)
+{
+    CAMLparam2(L, strip);
+    CAMLlocal1(ret_val);
+    dump_buffer buf;
+
+    dump_native(L, strip, &buf, "lua_dump_to_bigstring: not a Lua function!");
+    /* shrink to fit, the bigarray becomes the owner of the data */
+    char *data = (char*)realloc(buf.data, buf.len);
+    if (data == NULL)
+        data = buf.data;
+    ret_val = caml_ba_alloc_dims( CAML_BA_CHAR | CAML_BA_C_LAYOUT | CAML_BA_MANAGED,
+                                  1, data, (intnat)buf.len );
+
+    CAMLreturn(ret_val);
+}
+
 STUB_STATE_INT_INT_BOOL(lua_equal, index1, index2)
 
 STUB_STATE_VOID(lua_error)
@@ -306,37 +891,37 @@ value lua_getfield__stub(value L, value index, value k)
     CAMLreturn(Val_unit);
 }
 
-STUB_STATE_INT_BOOL(lua_getmetatable, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_getmetatable, index)
 
 STUB_STATE_INT_VOID(lua_gettable, index)
 
-STUB_STATE_INT(lua_gettop)
+STUB_STATE_INT_NOALLOC(lua_gettop)
 
-STUB_STATE_INT_VOID(lua_insert, index)
+STUB_STATE_INT_VOID_NOALLOC(lua_insert, index)
 
-STUB_STATE_INT_BOOL(lua_isboolean, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_isboolean, index)
 
-STUB_STATE_INT_BOOL(lua_iscfunction, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_iscfunction, index)
 
-STUB_STATE_INT_BOOL(lua_isfunction, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_isfunction, index)
 
-STUB_STATE_INT_BOOL(lua_islightuserdata, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_islightuserdata, index)
 
-STUB_STATE_INT_BOOL(lua_isnil, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_isnil, index)
 
-STUB_STATE_INT_BOOL(lua_isnone, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_isnone, index)
 
-STUB_STATE_INT_BOOL(lua_isnoneornil, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_isnoneornil, index)
 
-STUB_STATE_INT_BOOL(lua_isnumber, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_isnumber, index)
 
-STUB_STATE_INT_BOOL(lua_isstring, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_isstring, index)
 
-STUB_STATE_INT_BOOL(lua_istable, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_istable, index)
 
-STUB_STATE_INT_BOOL(lua_isthread, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_isthread, index)
 
-STUB_STATE_INT_BOOL(lua_isuserdata, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_isuserdata, index)
 
 STUB_STATE_INT_INT_BOOL(lua_lessthan, index1, index2)
 
@@ -374,22 +959,22 @@ value lua_load__stub(value L, value reader, value data, value chunkname)
 
     reader_data *internal_data = (reader_data*)caml_stat_alloc(sizeof(reader_data));
 
-    caml_register_global_root(&(internal_data->state_value));
-    caml_register_global_root(&(internal_data->reader_function));
-    caml_register_global_root(&(internal_data->reader_data));
-
     internal_data->state_value = L;
     internal_data->reader_function = reader;
     internal_data->reader_data = data;
 
+    caml_register_generational_global_root(&(internal_data->state_value));
+    caml_register_generational_global_root(&(internal_data->reader_function));
+    caml_register_generational_global_root(&(internal_data->reader_data));
+
     int result = lua_load(  lua_State_val(L),
                             reader_function,
                             (void*)internal_data,
                             String_val(chunkname)  );
 
-    caml_remove_global_root(&(internal_data->state_value));
-    caml_remove_global_root(&(internal_data->reader_function));
-    caml_remove_global_root(&(internal_data->reader_data));
+    caml_remove_generational_global_root(&(internal_data->state_value));
+    caml_remove_generational_global_root(&(internal_data->reader_function));
+    caml_remove_generational_global_root(&(internal_data->reader_data));
 
     caml_stat_free(internal_data);
 
@@ -405,25 +990,8 @@ value lua_newthread__stub(value L)
     CAMLlocal1(thread_value);
     lua_State *LL = lua_State_val(L);
 
-    push_threads_array(LL);
     lua_State *thread = lua_newthread(LL);
-    lua_pushvalue(LL, -1);
-
-    /* The stack here is:
-     *  -----+-------------------------------------
-     *  | -1 | the new thread just created (COPY) |
-     *  -----+-------------------------------------
-     *  | -2 | the new thread just created        |
-     *  -----+------------------------------------|
-     *  | -3 | the threads array (n elements)     |
-     *  -----+-------------------------------------
-     */
-    int n = lua_objlen(LL, -3);
-    lua_pushinteger(LL, n + 1);
-    lua_insert(LL, -2);
-    lua_settable(LL, -4); /* a copy of the thread inserted in our registry */
-    lua_insert(LL, -2);
-    lua_pop(LL, 1);
+    track_thread(LL, -1);
 
     /* Here the stack contains only the new thread on its top */
 
@@ -447,16 +1015,12 @@ value lua_newuserdata__stub(value L, value ud)
     value *lua_ud = (value*)lua_newuserdata(LL, sizeof(value));
     debug(5, "lua_newuserdata__stub: calling lua_newuserdata(%p, %d) -> %p\n",
              (void*)LL, sizeof(value), (void*)lua_ud);
-    caml_register_global_root(lua_ud);
     *lua_ud = ud;
+    caml_register_generational_global_root(lua_ud);
 
     /* retrieve the metatable for this kind of userdata */
-    lua_pushstring(LL, UUID);
-    lua_gettable(LL, LUA_REGISTRYINDEX);
-    lua_pushstring(LL, "userdata_metatable");
-    lua_gettable(LL, -2);
-    lua_setmetatable(LL, -3);
-    lua_pop(LL, 1);
+    lua_rawgeti(LL, LUA_REGISTRYINDEX, get_ocaml_data(LL)->userdata_metatable_ref);
+    lua_setmetatable(LL, -2);
 
     debug(4, "lua_newuserdata__stub: RETURNS\n");
     CAMLreturn(Val_unit);
@@ -470,52 +1034,99 @@ CAMLprim
 value lua_pcall__stub(value L, value nargs, value nresults, value errfunc)
 {
   CAMLparam4(L, nargs, nresults, errfunc);
-  CAMLlocal1(status);
 
-  status = Val_int(lua_pcall( lua_State_val(L),
-                              Int_val(nargs),
-                              Int_val(nresults),
-                              Int_val(errfunc)) );
-  CAMLreturn(status);
-}
+  lua_State *LL = lua_State_val(L);
+  ocaml_data *data = get_ocaml_data(LL);
+  int depth = save_callback_depth(data);
+  int status;
 
-STUB_STATE_INT_VOID(lua_pop, n)
+  refresh_hook(LL, data);
+  if (data->release_runtime)
+  {
+    release_runtime(data);
+    status = lua_pcall(LL, Int_val(nargs), Int_val(nresults), Int_val(errfunc));
+    acquire_runtime(data);
+    untrack_pending_threads(data);
+  }
+  else
+    status = lua_pcall(LL, Int_val(nargs), Int_val(nresults), Int_val(errfunc));
+  restore_callback_depth(data, depth);
 
-STUB_STATE_BOOL_VOID(lua_pushboolean, b)
+  CAMLreturn(Val_int(status));
+}
 
-CAMLprim
-value lua_pushcfunction__stub(value L, value f)
-{
-    CAMLparam2(L, f);
+STUB_STATE_INT_VOID_NOALLOC(lua_pop, n)
 
-    debug(3, "lua_pushcfunction__stub(%p, %p)\n", (void*)L, (void*)f);
+STUB_STATE_BOOL_VOID_NOALLOC(lua_pushboolean, b)
 
+/*
+ * Pushes a C closure calling the given C function, with the OCaml closure f
+ * in a userdatum as its upvalue.
+ */
+static void push_ocaml_closure(lua_State *LL, value f, lua_CFunction trampoline)
+{
     /* Create the new userdatum containing the OCaml value of the closure */
-    lua_State *LL = lua_State_val(L);
     value *ocaml_closure = (value*)lua_newuserdata(LL, sizeof(value));
-    debug(5, "lua_pushcfunction__stub: calling lua_newuserdata(%p, %d) -> %p\n",
+    debug(5, "push_ocaml_closure: calling lua_newuserdata(%p, %d) -> %p\n",
              (void*)LL, sizeof(value), (void*)ocaml_closure);
 
-    caml_register_global_root(ocaml_closure);
     *ocaml_closure = f;
+    caml_register_generational_global_root(ocaml_closure);
 
     /* retrieve the metatable for this kind of userdata */
-    lua_pushstring(LL, UUID);
-    lua_gettable(LL, LUA_REGISTRYINDEX);
-    lua_pushstring(LL, "closure_metatable");
-    lua_gettable(LL, -2);
-    lua_setmetatable(LL, -3);
-    lua_pop(LL, 1);
+    lua_rawgeti(LL, LUA_REGISTRYINDEX, get_ocaml_data(LL)->closure_metatable_ref);
+    lua_setmetatable(LL, -2);
 
     /* at this point the stack has a userdatum on its top, with the correct metatable */
 
-    lua_pushcclosure(LL, execute_ocaml_closure, 1);
+    lua_pushcclosure(LL, trampoline, 1);
+}
+
+CAMLprim
+value lua_pushcfunction__stub(value L, value f)
+{
+    CAMLparam2(L, f);
 
+    debug(3, "lua_pushcfunction__stub(%p, %p)\n", (void*)L, (void*)f);
+    push_ocaml_closure(lua_State_val(L), f, execute_ocaml_closure);
     debug(4, "lua_pushcfunction__stub: RETURN\n");
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_pushfloat1__stub(value L, value f)
+{
+    CAMLparam2(L, f);
+    push_ocaml_closure(lua_State_val(L), f, execute_ocaml_float1);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_pushfloat2__stub(value L, value f)
+{
+    CAMLparam2(L, f);
+    push_ocaml_closure(lua_State_val(L), f, execute_ocaml_float2);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_pushint1__stub(value L, value f)
+{
+    CAMLparam2(L, f);
+    push_ocaml_closure(lua_State_val(L), f, execute_ocaml_int1);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_pushstring1__stub(value L, value f)
+{
+    CAMLparam2(L, f);
+    push_ocaml_closure(lua_State_val(L), f, execute_ocaml_string1);
     CAMLreturn(Val_unit);
 }
 
-STUB_STATE_INT_VOID(lua_pushinteger, n)
+STUB_STATE_INT_VOID_NOALLOC(lua_pushinteger, n)
 
 CAMLprim
 value lua_pushlightuserdata__stub(value L, value p)
@@ -528,23 +1139,10 @@ value lua_pushlightuserdata__stub(value L, value p)
 
     if (Is_block(p))
     {
-        /* the p value is an OCaml block */
-
-        /* Create the new userdatum containing the OCaml value ud */
-        value *lua_light_ud = (value*)caml_stat_alloc(sizeof(value));
-        debug(5, "lua_pushlightuserdata__stub: caml_stat_alloc -> %p\n", (void*)(lua_light_ud));
-        caml_register_global_root(lua_light_ud);
-        *lua_light_ud = p;
-
-        push_lud_array(LL);
-        lua_pushlightuserdata(LL, (void *)lua_light_ud);
-        lua_pushvalue(LL, -1);
-        int n = lua_objlen(LL, -3);
-        lua_pushinteger(LL, n + 1);
-        lua_insert(LL, -2);
-        lua_settable(LL, -4); /* the light user data inserted in our registry */
-        lua_insert(LL, -2);
-        lua_pop(LL, 1);
+        /* the p value is an OCaml block, kept alive by its slot */
+        void *handle = lud_new(get_ocaml_data(LL), p);
+        debug(5, "lua_pushlightuserdata__stub: handle %p\n", handle);
+        lua_pushlightuserdata(LL, handle);
     }
     else
     {
@@ -557,6 +1155,23 @@ value lua_pushlightuserdata__stub(value L, value p)
     CAMLreturn(Val_unit);
 }
 
+CAMLprim
+value lua_releaselightuserdata__stub(value L, value index)
+{
+    CAMLparam2(L, index);
+
+    debug(3, "lua_releaselightuserdata__stub(%p, %d)\n", (void*)L, Int_val(index));
+
+    lua_State *LL = lua_State_val(L);
+    int released = 0;
+
+    if (lua_islightuserdata(LL, Int_val(index)))
+        released = lud_release(get_ocaml_data(LL), lua_touserdata(LL, Int_val(index)));
+
+    debug(4, "lua_releaselightuserdata__stub: RETURN %d\n", released);
+    CAMLreturn(Val_bool(released));
+}
+
 CAMLprim
 value lua_pushlstring__stub(value L, value s)
 {
@@ -565,29 +1180,200 @@ value lua_pushlstring__stub(value L, value s)
     CAMLreturn(Val_unit);
 }
 
-STUB_STATE_VOID(lua_pushnil)
+/* Raises Invalid_argument if off and len do not designate a valid slice of a
+ * sequence of total_len bytes */
+void check_slice(size_t total_len, value off, value len, const char *fname)
+{
+  if (Long_val(off) < 0 || Long_val(len) < 0 ||
+      (size_t)Long_val(off) > total_len ||
+      (size_t)Long_val(len) > total_len - Long_val(off))
+    caml_invalid_argument(fname);
+}
+
+CAMLprim
+value lua_pushsubstring__stub(value L, value s, value off, value len)
+{
+    CAMLparam4(L, s, off, len);
+    check_slice(caml_string_length(s), off, len, "Lua.pushsubstring");
+    lua_pushlstring(lua_State_val(L), String_val(s) + Long_val(off), Long_val(len));
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_pushbigstring__stub(value L, value ba, value off, value len)
+{
+    CAMLparam4(L, ba, off, len);
+    check_slice(Caml_ba_array_val(ba)->dim[0], off, len, "Lua.pushbigstring");
+    lua_pushlstring( lua_State_val(L),
+                     (char*)Caml_ba_data_val(ba) + Long_val(off),
+                     Long_val(len) );
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_pushbuffer__stub(value L, value ba, value off, value len)
+{
+    CAMLparam4(L, ba, off, len);
+
+    debug(3, "lua_pushbuffer__stub(%p, %p)\n", (void*)L, (void*)ba);
+    check_slice(Caml_ba_array_val(ba)->dim[0], off, len, "Lua.pushbuffer");
+
+    lua_State *LL = lua_State_val(L);
+
+    /* The buffer keeps the bigarray alive, while Lua only reads the data
+     * pointer, which is outside the OCaml heap and never moves */
+    lua_buffer *buf = (lua_buffer*)lua_newuserdata(LL, sizeof(lua_buffer));
+    buf->data = (char*)Caml_ba_data_val(ba) + Long_val(off);
+    buf->len = Long_val(len);
+    buf->bigarray = ba;
+    caml_register_generational_global_root(&(buf->bigarray));
+
+    lua_rawgeti(LL, LUA_REGISTRYINDEX, get_ocaml_data(LL)->buffer_metatable_ref);
+    lua_setmetatable(LL, -2);
+
+    debug(4, "lua_pushbuffer__stub: RETURNS\n");
+    CAMLreturn(Val_unit);
+}
+
+/* The following functions push a table with a copy of an OCaml array (or
+ * bigarray) as a sequence. The table is presized, and the array is read again
+ * after every Lua allocation, because the Lua GC can run "__gc" metamethods
+ * calling OCaml code, and the array can be moved. */
+
+CAMLprim
+value lua_pushfloatarray__stub(value L, value arr)
+{
+    CAMLparam2(L, arr);
+
+    lua_State *LL = lua_State_val(L);
+    mlsize_t len = caml_array_length(arr);
+    mlsize_t i;
+
+    lua_createtable(LL, len, 0);
+    for (i = 0; i < len; i++)
+    {
+        if (Tag_val(arr) == Double_array_tag)
+            lua_pushnumber(LL, Double_flat_field(arr, i));
+        else
+            lua_pushnumber(LL, Double_val(Field(arr, i)));
+        lua_rawseti(LL, -2, i + 1);
+    }
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_pushintarray__stub(value L, value arr)
+{
+    CAMLparam2(L, arr);
+
+    lua_State *LL = lua_State_val(L);
+    mlsize_t len = caml_array_length(arr);
+    mlsize_t i;
+
+    lua_createtable(LL, len, 0);
+    for (i = 0; i < len; i++)
+    {
+        lua_pushinteger(LL, Long_val(Field(arr, i)));
+        lua_rawseti(LL, -2, i + 1);
+    }
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_pushstringarray__stub(value L, value arr)
+{
+    CAMLparam2(L, arr);
+
+    lua_State *LL = lua_State_val(L);
+    mlsize_t len = caml_array_length(arr);
+    mlsize_t i;
+
+    lua_createtable(LL, len, 0);
+    for (i = 0; i < len; i++)
+    {
+        lua_pushlstring(LL, String_val(Field(arr, i)), caml_string_length(Field(arr, i)));
+        lua_rawseti(LL, -2, i + 1);
+    }
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_pushfloatbigarray__stub(value L, value ba)
+{
+    CAMLparam2(L, ba);
+
+    lua_State *LL = lua_State_val(L);
+    intnat len = Caml_ba_array_val(ba)->dim[0];
+    intnat i;
+
+    lua_createtable(LL, len, 0);
+    for (i = 0; i < len; i++)
+    {
+        /* the data of the bigarray is outside the OCaml heap and never moves */
+        lua_pushnumber(LL, ((double*)Caml_ba_data_val(ba))[i]);
+        lua_rawseti(LL, -2, i + 1);
+    }
+
+    CAMLreturn(Val_unit);
+}
+
+STUB_STATE_VOID_NOALLOC(lua_pushnil)
 
-STUB_STATE_DOUBLE_VOID(lua_pushnumber, n)
+STUB_STATE_DOUBLE_VOID_NOALLOC(lua_pushnumber, n)
 
-STUB_STATE_BOOL(lua_pushthread)
+STUB_STATE_BOOL_NOALLOC(lua_pushthread)
+
+/* Two OCaml values of type state are the same thread: the coroutines are
+ * wrapped in a new block every time they reach OCaml */
+CAMLprim
+value lua_same_thread__stub(value L1, value L2)
+{
+    return Val_bool(lua_State_val(L1) == lua_State_val(L2));
+}
 
-STUB_STATE_INT_VOID(lua_pushvalue, index)
+STUB_STATE_INT_VOID_NOALLOC(lua_pushvalue, index)
 
-STUB_STATE_INT_INT_BOOL(lua_rawequal, index1, index2)
+STUB_STATE_INT_INT_BOOL_NOALLOC(lua_rawequal, index1, index2)
 
-STUB_STATE_INT_VOID(lua_rawget, index)
+STUB_STATE_INT_VOID_NOALLOC(lua_rawget, index)
 
-STUB_STATE_INT_INT_VOID(lua_rawgeti, index, n)
+STUB_STATE_INT_INT_VOID_NOALLOC(lua_rawgeti, index, n)
 
 STUB_STATE_INT_VOID(lua_rawset, index)
 
 STUB_STATE_INT_INT_VOID(lua_rawseti, index, n)
 
-STUB_STATE_INT_VOID(lua_remove, index)
+STUB_STATE_INT_VOID_NOALLOC(lua_remove, index)
 
 STUB_STATE_INT_VOID(lua_replace, index)
 
-STUB_STATE_INT_INT(lua_resume, narg)
+CAMLprim
+value lua_resume__stub(value L, value narg)
+{
+    CAMLparam2(L, narg);
+
+    lua_State *LL = lua_State_val(L);
+    ocaml_data *data = get_ocaml_data(LL);
+    int depth = save_callback_depth(data);
+    int status;
+
+    refresh_hook(LL, data);
+    if (data->release_runtime)
+    {
+        release_runtime(data);
+        status = lua_resume(LL, Int_val(narg));
+        acquire_runtime(data);
+        untrack_pending_threads(data);
+    }
+    else
+        status = lua_resume(LL, Int_val(narg));
+    restore_callback_depth(data, depth);
+
+    CAMLreturn(Val_int(status));
+}
 
 STUB_STATE_INT_BOOL(lua_setfenv, index)
 
@@ -611,11 +1397,11 @@ STUB_STATE_INT_INT(lua_setmetatable, index)
 
 STUB_STATE_INT_VOID(lua_settable, index)
 
-STUB_STATE_INT_VOID(lua_settop, index)
+STUB_STATE_INT_VOID_NOALLOC(lua_settop, index)
 
-STUB_STATE_INT(lua_status)
+STUB_STATE_INT_NOALLOC(lua_status)
 
-STUB_STATE_INT_BOOL(lua_toboolean, index)
+STUB_STATE_INT_BOOL_NOALLOC(lua_toboolean, index)
 
 CAMLprim
 value lua_tocfunction__stub(value L, value index)
@@ -659,7 +1445,7 @@ value lua_tocfunction__stub(value L, value index)
     }
 }
 
-STUB_STATE_INT_INT(lua_tointeger, index)
+STUB_STATE_INT_INT_NOALLOC(lua_tointeger, index)
 
 void raise_type_error(char *msg)
 {
@@ -691,7 +1477,230 @@ value lua_tolstring__stub(value L, value index)
   CAMLreturn(ret_val);
 }
 
-STUB_STATE_INT_DOUBLE(lua_tonumber, index)
+CAMLprim
+value lua_tobigstring__stub(value L, value index)
+{
+  size_t len = 0;
+  const char *value_from_lua;
+  CAMLparam2(L, index);
+  CAMLlocal1(ret_val);
+
+  value_from_lua = lua_tolstring( lua_State_val(L),
+                                  Int_val(index),
+                                  &len );
+  if (value_from_lua == NULL)
+    raise_type_error("lua_tobigstring: not a string value!");
+
+  /* The bigarray does not own the data: it points directly into the Lua
+   * string, which is kept alive by the Lua state as long as the value is
+   * anchored (on the stack, in a table, ...) */
+  ret_val = caml_ba_alloc_dims( CAML_BA_CHAR | CAML_BA_C_LAYOUT | CAML_BA_EXTERNAL,
+                                1, (void*)value_from_lua, (intnat)len );
+
+  CAMLreturn(ret_val);
+}
+
+CAMLprim
+value lua_tolstring_into__stub(value L, value index, value buf, value ofs)
+{
+  size_t len = 0;
+  size_t avail = 0;
+  const char *value_from_lua;
+  CAMLparam4(L, index, buf, ofs);
+
+  if (Long_val(ofs) < 0 || (mlsize_t)Long_val(ofs) > caml_string_length(buf))
+    caml_invalid_argument("Lua.tolstring_into");
+
+  /* lua_tolstring can run the Lua GC (numbers are converted in place), thus
+   * the buffer address is read only after the conversion */
+  value_from_lua = lua_tolstring( lua_State_val(L),
+                                  Int_val(index),
+                                  &len );
+  if (value_from_lua == NULL)
+    raise_type_error("lua_tolstring_into: not a string value!");
+
+  avail = caml_string_length(buf) - Long_val(ofs);
+  memcpy(Bytes_val(buf) + Long_val(ofs), value_from_lua, len < avail ? len : avail);
+
+  CAMLreturn(Val_long(len));
+}
+
+/* Converts an acceptable index into an absolute one, to be used while other
+ * values are pushed onto the stack */
+static int absolute_index(lua_State *L, int index)
+{
+  if (index < 0 && index > LUA_REGISTRYINDEX)
+    return lua_gettop(L) + index + 1;
+  return index;
+}
+
+/* The following functions read back the sequence of a Lua table (from 1 to
+ * its length, as returned by the length operator) into a new OCaml array. No
+ * Lua memory is allocated while reading, thus no OCaml code can run. They
+ * raise Type_error if the value is not a table or an element has the wrong
+ * type. */
+
+CAMLprim
+value lua_tofloatarray__stub(value L, value index)
+{
+  CAMLparam2(L, index);
+  CAMLlocal1(ret_val);
+
+  lua_State *LL = lua_State_val(L);
+  int t = absolute_index(LL, Int_val(index));
+  if (!lua_istable(LL, t))
+    raise_type_error("lua_tofloatarray: not a table!");
+
+  mlsize_t len = lua_objlen(LL, t);
+  mlsize_t i;
+#ifdef FLAT_FLOAT_ARRAY
+  ret_val = caml_alloc_float_array(len);
+#else
+  ret_val = caml_alloc(len, 0);
+#endif
+  for (i = 0; i < len; i++)
+  {
+    lua_rawgeti(LL, t, i + 1);
+    if (lua_type(LL, -1) != LUA_TNUMBER)
+    {
+      lua_pop(LL, 1);
+      raise_type_error("lua_tofloatarray: not a number!");
+    }
+#ifdef FLAT_FLOAT_ARRAY
+    Store_double_flat_field(ret_val, i, lua_tonumber(LL, -1));
+#else
+    Store_field(ret_val, i, caml_copy_double(lua_tonumber(LL, -1)));
+#endif
+    lua_pop(LL, 1);
+  }
+
+  CAMLreturn(ret_val);
+}
+
+CAMLprim
+value lua_toflatfloatarray__stub(value L, value index)
+{
+  CAMLparam2(L, index);
+  CAMLlocal1(ret_val);
+
+  lua_State *LL = lua_State_val(L);
+  int t = absolute_index(LL, Int_val(index));
+  if (!lua_istable(LL, t))
+    raise_type_error("lua_toflatfloatarray: not a table!");
+
+  mlsize_t len = lua_objlen(LL, t);
+  mlsize_t i;
+  ret_val = caml_alloc_float_array(len);
+  for (i = 0; i < len; i++)
+  {
+    lua_rawgeti(LL, t, i + 1);
+    if (lua_type(LL, -1) != LUA_TNUMBER)
+    {
+      lua_pop(LL, 1);
+      raise_type_error("lua_toflatfloatarray: not a number!");
+    }
+    Store_double_flat_field(ret_val, i, lua_tonumber(LL, -1));
+    lua_pop(LL, 1);
+  }
+
+  CAMLreturn(ret_val);
+}
+
+CAMLprim
+value lua_tointarray__stub(value L, value index)
+{
+  CAMLparam2(L, index);
+  CAMLlocal1(ret_val);
+
+  lua_State *LL = lua_State_val(L);
+  int t = absolute_index(LL, Int_val(index));
+  if (!lua_istable(LL, t))
+    raise_type_error("lua_tointarray: not a table!");
+
+  mlsize_t len = lua_objlen(LL, t);
+  mlsize_t i;
+  ret_val = caml_alloc(len, 0);
+  for (i = 0; i < len; i++)
+  {
+    lua_rawgeti(LL, t, i + 1);
+    if (lua_type(LL, -1) != LUA_TNUMBER)
+    {
+      lua_pop(LL, 1);
+      raise_type_error("lua_tointarray: not a number!");
+    }
+    Store_field(ret_val, i, Val_long(lua_tointeger(LL, -1)));
+    lua_pop(LL, 1);
+  }
+
+  CAMLreturn(ret_val);
+}
+
+CAMLprim
+value lua_tostringarray__stub(value L, value index)
+{
+  size_t len_s = 0;
+  const char *s;
+  CAMLparam2(L, index);
+  CAMLlocal2(ret_val, str);
+
+  lua_State *LL = lua_State_val(L);
+  int t = absolute_index(LL, Int_val(index));
+  if (!lua_istable(LL, t))
+    raise_type_error("lua_tostringarray: not a table!");
+
+  mlsize_t len = lua_objlen(LL, t);
+  mlsize_t i;
+  ret_val = caml_alloc(len, 0);
+  for (i = 0; i < len; i++)
+  {
+    lua_rawgeti(LL, t, i + 1);
+    if (lua_type(LL, -1) != LUA_TSTRING)
+    {
+      lua_pop(LL, 1);
+      raise_type_error("lua_tostringarray: not a string!");
+    }
+    /* the Lua string stays on the stack while the OCaml one is allocated */
+    s = lua_tolstring(LL, -1, &len_s);
+    str = caml_alloc_string(len_s);
+    memcpy(Bytes_val(str), s, len_s);
+    Store_field(ret_val, i, str);
+    lua_pop(LL, 1);
+  }
+
+  CAMLreturn(ret_val);
+}
+
+CAMLprim
+value lua_tofloatbigarray__stub(value L, value index)
+{
+  CAMLparam2(L, index);
+  CAMLlocal1(ret_val);
+
+  lua_State *LL = lua_State_val(L);
+  int t = absolute_index(LL, Int_val(index));
+  if (!lua_istable(LL, t))
+    raise_type_error("lua_tofloatbigarray: not a table!");
+
+  intnat len = lua_objlen(LL, t);
+  intnat i;
+  ret_val = caml_ba_alloc_dims(CAML_BA_FLOAT64 | CAML_BA_C_LAYOUT, 1, NULL, len);
+  double *data = (double*)Caml_ba_data_val(ret_val);
+  for (i = 0; i < len; i++)
+  {
+    lua_rawgeti(LL, t, i + 1);
+    if (lua_type(LL, -1) != LUA_TNUMBER)
+    {
+      lua_pop(LL, 1);
+      raise_type_error("lua_tofloatbigarray: not a number!");
+    }
+    data[i] = lua_tonumber(LL, -1);
+    lua_pop(LL, 1);
+  }
+
+  CAMLreturn(ret_val);
+}
+
+STUB_STATE_INT_DOUBLE_NOALLOC(lua_tonumber, index)
 
 CAMLprim
 value lua_tothread__stub(value L, value index)
@@ -705,14 +1714,7 @@ value lua_tothread__stub(value L, value index)
     lua_State *thread = lua_tothread(LL, int_index);
     if (thread != NULL)
     {
-        push_threads_array(LL);
-        lua_pushvalue(LL, int_index);
-
-        int n = lua_objlen(LL, -2);
-        lua_pushinteger(LL, n + 1);
-        lua_insert(LL, -2);
-        lua_settable(LL, -3); /* a copy of the thread inserted in our registry */
-        lua_pop(LL, 1);
+        track_thread(LL, int_index);
 
         thread_value = caml_alloc_custom(&thread_lua_State_ops, sizeof(lua_State *), 1, 10);
         lua_State_val(thread_value) = thread;
@@ -739,13 +1741,34 @@ value lua_touserdata__stub(value L, value index)
     value *lua_ud = (value*)lua_touserdata(LL, int_index);
     debug(5, "lua_touserdata__stub: calling lua_touserdata(%p, %d) -> %p\n",
              (void*)LL, int_index, (void*)lua_ud);
+    if (lua_islightuserdata(LL, int_index))
+    {
+        /* a released handle or a pointer unknown to the binding */
+        lua_ud = lud_resolve(get_ocaml_data(LL), (void*)lua_ud);
+        if (lua_ud == NULL)
+            caml_raise_not_found();
+    }
     ret_val = *lua_ud;
 
     debug(4, "lua_touserdata__stub: RETURN %p\n", (void*)ret_val);
     CAMLreturn(ret_val);
 }
 
-STUB_STATE_INT_INT(lua_type, index)
+STUB_STATE_INT_INT_NOALLOC(lua_type, index)
+
+/* Lua_api_lib.type_ returns the constructor of lua_type directly: they are
+ * in the same order as the codes of lua.h, starting from LUA_TNONE (-1) */
+CAMLprim
+value lua_type_variant__unboxed(value L, intnat index)
+{
+    return Val_int(lua_type(lua_State_val(L), index) + 1);
+}
+
+CAMLprim
+value lua_type_variant__stub(value L, value index)
+{
+    return lua_type_variant__unboxed(L, Long_val(index));
+}
 
 CAMLprim
 value lua_xmove__stub(value from, value to, value n)
@@ -757,3 +1780,1051 @@ value lua_xmove__stub(value from, value to, value n)
 
 STUB_STATE_INT_INT(lua_yield, nresults)
 
+
+/******************************************************************************/
+/*****                          DEEP CONVERSION                           *****/
+/******************************************************************************/
+/* lua_to_value__stub converts a Lua value into a Lua_api_lib.lua_value in one
+ * traversal, and lua_push_value__stub pushes back such a value. The tables
+ * being visited are kept in a stack to detect cycles (a table shared by two
+ * fields is converted twice). On error the Lua stack is restored and
+ * Conversion_error is raised.
+ *
+ * Lua memory is allocated only while pushing, hence only lua_push_value__stub
+ * can run OCaml code (a __gc metamethod calling an OCaml function): the
+ * value being pushed is a local root and it is read again after every call
+ * to Lua. */
+
+/* Constructors of Lua_api_lib.lua_value */
+#define LUA_VALUE_NIL       Val_int(0)
+#define LUA_VALUE_BOOLEAN   0
+#define LUA_VALUE_NUMBER    1
+#define LUA_VALUE_STRING    2
+#define LUA_VALUE_TABLE     3
+#define LUA_VALUE_OPAQUE    4
+
+typedef struct conversion_ctx
+{
+    lua_State *L;
+    int base;                                 /* stack top to restore */
+    int max_depth;
+    const void **path;                        /* tables being converted */
+    int path_num;
+    int path_size;
+} conversion_ctx;
+
+static void conversion_fail(conversion_ctx *c, const char *msg)
+{
+    lua_settop(c->L, c->base);
+    free(c->path);
+    c->path = NULL;
+    caml_raise_with_string(*caml_named_value("Lua_conversion_error"), msg);
+}
+
+static value to_value(conversion_ctx *c, int index)
+{
+    CAMLparam0();
+    CAMLlocal5(ret_val, field, list, pair, tmp);
+
+    lua_State *L = c->L;
+    size_t len;
+    const char *s;
+    const void *p;
+    int i;
+
+    switch (lua_type(L, index))
+    {
+        case LUA_TNIL:
+            ret_val = LUA_VALUE_NIL;
+            break;
+
+        case LUA_TBOOLEAN:
+            ret_val = caml_alloc_small(1, LUA_VALUE_BOOLEAN);
+            Field(ret_val, 0) = Val_bool(lua_toboolean(L, index));
+            break;
+
+        case LUA_TNUMBER:
+            field = caml_copy_double(lua_tonumber(L, index));
+            ret_val = caml_alloc_small(1, LUA_VALUE_NUMBER);
+            Field(ret_val, 0) = field;
+            break;
+
+        case LUA_TSTRING:
+            s = lua_tolstring(L, index, &len);
+            field = caml_alloc_string(len);
+            memcpy((char *)String_val(field), s, len);
+            ret_val = caml_alloc_small(1, LUA_VALUE_STRING);
+            Field(ret_val, 0) = field;
+            break;
+
+        case LUA_TTABLE:
+            p = lua_topointer(L, index);
+            for (i = 0; i < c->path_num; i++)
+                if (c->path[i] == p)
+                    conversion_fail(c, "to_value: cycle detected");
+            if (c->path_num >= c->max_depth)
+                conversion_fail(c, "to_value: maximum depth exceeded");
+            if (!lua_checkstack(L, 2))
+                conversion_fail(c, "to_value: stack overflow");
+            if (c->path_num == c->path_size)
+            {
+                int new_size = c->path_size == 0 ? 16 : 2 * c->path_size;
+                const void **new_path =
+                    (const void **)realloc(c->path, new_size * sizeof(const void *));
+                if (new_path == NULL)
+                    conversion_fail(c, "to_value: out of memory");
+                c->path = new_path;
+                c->path_size = new_size;
+            }
+            c->path[c->path_num++] = p;
+
+            /* lua_next returns the sequence first, in ascending order: the
+             * pairs are consed and the list is reversed at the end */
+            list = Val_emptylist;
+            lua_pushnil(L);
+            while (lua_next(L, index) != 0)
+            {
+                int top = lua_gettop(L);
+                field = to_value(c, top - 1);
+                tmp = to_value(c, top);
+                pair = caml_alloc_small(2, 0);
+                Field(pair, 0) = field;
+                Field(pair, 1) = tmp;
+                tmp = caml_alloc_small(2, 0);
+                Field(tmp, 0) = pair;
+                Field(tmp, 1) = list;
+                list = tmp;
+                lua_pop(L, 1);
+            }
+            c->path_num--;
+
+            field = Val_emptylist;
+            while (list != Val_emptylist)
+            {
+                tmp = caml_alloc_small(2, 0);
+                Field(tmp, 0) = Field(list, 0);
+                Field(tmp, 1) = field;
+                field = tmp;
+                list = Field(list, 1);
+            }
+            ret_val = caml_alloc_small(1, LUA_VALUE_TABLE);
+            Field(ret_val, 0) = field;
+            break;
+
+        default:
+            /* the constant constructors of lua_type start from LUA_TNONE */
+            ret_val = caml_alloc_small(1, LUA_VALUE_OPAQUE);
+            Field(ret_val, 0) = Val_int(lua_type(L, index) + 1);
+            break;
+    }
+
+    CAMLreturn(ret_val);
+}
+
+CAMLprim
+value lua_to_value__stub(value L, value max_depth, value index)
+{
+    CAMLparam3(L, max_depth, index);
+    CAMLlocal1(ret_val);
+
+    conversion_ctx c;
+    c.L = lua_State_val(L);
+    c.base = lua_gettop(c.L);
+    c.max_depth = Int_val(max_depth);
+    c.path = NULL;
+    c.path_num = 0;
+    c.path_size = 0;
+
+    ret_val = to_value(&c, absolute_index(c.L, Int_val(index)));
+    free(c.path);
+
+    CAMLreturn(ret_val);
+}
+
+static void push_value(conversion_ctx *c, value v)
+{
+    CAMLparam1(v);
+    CAMLlocal2(list, pair);
+
+    lua_State *L = c->L;
+    int narr, nrec;
+
+    if (!lua_checkstack(L, 3))
+        conversion_fail(c, "push_value: stack overflow");
+
+    if (Is_long(v))
+    {
+        lua_pushnil(L);
+        CAMLreturn0;
+    }
+
+    switch (Tag_val(v))
+    {
+        case LUA_VALUE_BOOLEAN:
+            lua_pushboolean(L, Bool_val(Field(v, 0)));
+            break;
+
+        case LUA_VALUE_NUMBER:
+            lua_pushnumber(L, Double_val(Field(v, 0)));
+            break;
+
+        case LUA_VALUE_STRING:
+            lua_pushlstring(L, String_val(Field(v, 0)),
+                            caml_string_length(Field(v, 0)));
+            break;
+
+        case LUA_VALUE_TABLE:
+            /* presize the table: the keys 1, 2, ... n in the list are
+             * counted as the sequence, the other keys as the hash part */
+            narr = 0;
+            nrec = 0;
+            for (list = Field(v, 0); list != Val_emptylist; list = Field(list, 1))
+            {
+                value key = Field(Field(list, 0), 0);
+                if (Is_block(key) && Tag_val(key) == LUA_VALUE_NUMBER &&
+                    Double_val(Field(key, 0)) == (double)(narr + 1))
+                    narr++;
+                else
+                    nrec++;
+            }
+            lua_createtable(L, narr, nrec);
+
+            for (list = Field(v, 0); list != Val_emptylist; list = Field(list, 1))
+            {
+                pair = Field(list, 0);
+                value key = Field(pair, 0);
+                if (Is_long(key))
+                    conversion_fail(c, "push_value: table index is nil");
+                if (Tag_val(key) == LUA_VALUE_NUMBER &&
+                    Double_val(Field(key, 0)) != Double_val(Field(key, 0)))
+                    conversion_fail(c, "push_value: table index is NaN");
+                push_value(c, Field(pair, 0));
+                push_value(c, Field(pair, 1));
+                lua_rawset(L, -3);
+            }
+            break;
+
+        default:
+            conversion_fail(c, "push_value: cannot push an opaque value");
+            break;
+    }
+
+    CAMLreturn0;
+}
+
+CAMLprim
+value lua_push_value__stub(value L, value v)
+{
+    CAMLparam2(L, v);
+
+    conversion_ctx c;
+    c.L = lua_State_val(L);
+    c.base = lua_gettop(c.L);
+    c.max_depth = 0;
+    c.path = NULL;
+    c.path_num = 0;
+    c.path_size = 0;
+
+    push_value(&c, v);
+
+    CAMLreturn(Val_unit);
+}
+
+/******************************************************************************/
+/*****                        BATCHED OPERATIONS                          *****/
+/******************************************************************************/
+/* lua_batch_run__stub executes a Lua_api_lib.Batch.program. The opcodes are
+ * the indexes of the constructors of Lua_api_lib.Batch.op, followed in the
+ * code by their integer operands, and BATCH_CHECKSTACK, emitted by compile
+ * with the growth of the stack in the following operations. A pcall can run
+ * OCaml code, hence the program, the arguments and the results are read
+ * through their roots and no pointer into the OCaml heap is kept across the
+ * operations. */
+
+enum batch_opcode
+{
+    BATCH_GETGLOBAL, BATCH_SETGLOBAL, BATCH_GETFIELD, BATCH_SETFIELD,
+    BATCH_GETTABLE, BATCH_SETTABLE, BATCH_RAWGETI, BATCH_PUSHNIL,
+    BATCH_PUSHBOOLEAN, BATCH_PUSHINTEGER, BATCH_PUSHNUMBER, BATCH_PUSHSTRING,
+    BATCH_PUSHVALUE, BATCH_PUSHARG, BATCH_PCALL, BATCH_POP, BATCH_SETTOP,
+    BATCH_TOBOOLEAN, BATCH_TONUMBER, BATCH_TOSTRING, BATCH_CHECKSTACK
+};
+
+/* Fields of Lua_api_lib.Batch.program */
+#define Batch_code(p)       Field(p, 0)
+#define Batch_strings(p)    Field(p, 1)
+#define Batch_numbers(p)    Field(p, 2)
+
+CAMLprim
+value lua_batch_run__stub(value L, value program, value args, value results)
+{
+    CAMLparam4(L, program, args, results);
+    CAMLlocal2(field, result);
+
+    lua_State *LL = lua_State_val(L);
+    ocaml_data *data = get_ocaml_data(LL);
+    mlsize_t code_len = Wosize_val(Batch_code(program));
+    mlsize_t pc = 0;
+    mlsize_t next_string = 0, next_number = 0, next_result = 0;
+    int status = 0;
+    int a, b, c, depth;
+    size_t len;
+    const char *s;
+    conversion_ctx ctx;
+
+#define OPERAND() Long_val(Field(Batch_code(program), pc++))
+#define STRING() String_val(Field(Batch_strings(program), next_string++))
+
+    while (pc < code_len && status == 0)
+    {
+        switch (OPERAND())
+        {
+            case BATCH_GETGLOBAL:
+                lua_getglobal(LL, STRING());
+                break;
+
+            case BATCH_SETGLOBAL:
+                lua_setglobal(LL, STRING());
+                break;
+
+            case BATCH_GETFIELD:
+                a = OPERAND();
+                lua_getfield(LL, a, STRING());
+                break;
+
+            case BATCH_SETFIELD:
+                a = OPERAND();
+                lua_setfield(LL, a, STRING());
+                break;
+
+            case BATCH_GETTABLE:
+                lua_gettable(LL, OPERAND());
+                break;
+
+            case BATCH_SETTABLE:
+                lua_settable(LL, OPERAND());
+                break;
+
+            case BATCH_RAWGETI:
+                a = OPERAND();
+                b = OPERAND();
+                lua_rawgeti(LL, a, b);
+                break;
+
+            case BATCH_PUSHNIL:
+                lua_pushnil(LL);
+                break;
+
+            case BATCH_PUSHBOOLEAN:
+                lua_pushboolean(LL, OPERAND());
+                break;
+
+            case BATCH_PUSHINTEGER:
+                lua_pushinteger(LL, OPERAND());
+                break;
+
+            case BATCH_PUSHNUMBER:
+                field = Batch_numbers(program);
+                if (Tag_val(field) == Double_array_tag)
+                    lua_pushnumber(LL, Double_flat_field(field, next_number));
+                else
+                    lua_pushnumber(LL, Double_val(Field(field, next_number)));
+                next_number++;
+                break;
+
+            case BATCH_PUSHSTRING:
+                field = Field(Batch_strings(program), next_string++);
+                lua_pushlstring(LL, String_val(field), caml_string_length(field));
+                break;
+
+            case BATCH_PUSHVALUE:
+                lua_pushvalue(LL, OPERAND());
+                break;
+
+            case BATCH_PUSHARG:
+                a = OPERAND();
+                ctx.L = LL;
+                ctx.base = lua_gettop(LL);
+                ctx.max_depth = 0;
+                ctx.path = NULL;
+                ctx.path_num = 0;
+                ctx.path_size = 0;
+                push_value(&ctx, Field(args, a));
+                break;
+
+            case BATCH_PCALL:
+                a = OPERAND();
+                b = OPERAND();
+                c = OPERAND();
+                depth = save_callback_depth(data);
+                refresh_hook(LL, data);
+                if (data->release_runtime)
+                {
+                    release_runtime(data);
+                    status = lua_pcall(LL, a, b, c);
+                    acquire_runtime(data);
+                    untrack_pending_threads(data);
+                }
+                else
+                    status = lua_pcall(LL, a, b, c);
+                restore_callback_depth(data, depth);
+                break;
+
+            case BATCH_POP:
+                lua_pop(LL, OPERAND());
+                break;
+
+            case BATCH_SETTOP:
+                a = OPERAND();
+                if (a > lua_gettop(LL) && !lua_checkstack(LL, a - lua_gettop(LL)))
+                    caml_failwith("Lua_api_lib.Batch.run: stack overflow");
+                lua_settop(LL, a);
+                break;
+
+            case BATCH_TOBOOLEAN:
+                result = caml_alloc_small(1, LUA_VALUE_BOOLEAN);
+                Field(result, 0) = Val_bool(lua_toboolean(LL, OPERAND()));
+                Store_field(results, next_result++, result);
+                break;
+
+            case BATCH_TONUMBER:
+                field = caml_copy_double(lua_tonumber(LL, OPERAND()));
+                result = caml_alloc_small(1, LUA_VALUE_NUMBER);
+                Field(result, 0) = field;
+                Store_field(results, next_result++, result);
+                break;
+
+            case BATCH_TOSTRING:
+                s = lua_tolstring(LL, OPERAND(), &len);
+                if (s == NULL)
+                    result = LUA_VALUE_NIL;
+                else
+                {
+                    field = caml_alloc_string(len);
+                    memcpy((char *)String_val(field), s, len);
+                    result = caml_alloc_small(1, LUA_VALUE_STRING);
+                    Field(result, 0) = field;
+                }
+                Store_field(results, next_result++, result);
+                break;
+
+            case BATCH_CHECKSTACK:
+                if (!lua_checkstack(LL, OPERAND()))
+                    caml_failwith("Lua_api_lib.Batch.run: stack overflow");
+                break;
+        }
+    }
+
+#undef OPERAND
+#undef STRING
+
+    CAMLreturn(Val_int(status));
+}
+
+/******************************************************************************/
+/*****                              PROFILER                              *****/
+/******************************************************************************/
+/* The profiler samples the Lua call stack from the count hook, every "period"
+ * instructions or, in timer mode, at the first hook (checked every 1000
+ * instructions) after "interval" seconds. Each sample is formatted as a
+ * collapsed stack, "frame;frame;...", from the outermost function, and
+ * counted in a hash table. The hook can run without the OCaml runtime lock,
+ * hence the profiler only uses memory allocated with malloc. */
+
+#define PROFILER_FRAME_SIZE (LUA_IDSIZE + 64)
+
+static uint32_t profiler_hash(const char *s)
+{
+    uint32_t h = 2166136261u;                 /* FNV-1a */
+    while (*s != '\0')
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void profiler_clear(profiler *p)
+{
+    size_t i;
+    for (i = 0; i < p->buckets_num; i++)
+    {
+        profile_entry *e = p->buckets[i];
+        while (e != NULL)
+        {
+            profile_entry *next = e->next;
+            free(e);
+            e = next;
+        }
+        p->buckets[i] = NULL;
+    }
+    p->entries_num = 0;
+    p->samples = 0;
+    p->instructions = 0;
+    p->callback_depth = 0;
+    p->callbacks = 0;
+    p->callback_time = 0.0;
+}
+
+void free_profiler(profiler *p)
+{
+    if (p == NULL)
+        return;
+    profiler_clear(p);
+    free(p->buckets);
+    free(p->key);
+    free(p);
+}
+
+static void profiler_grow(profiler *p)
+{
+    size_t new_num = 2 * p->buckets_num;
+    profile_entry **new_buckets = (profile_entry **)calloc(new_num, sizeof(profile_entry *));
+    size_t i;
+
+    if (new_buckets == NULL)
+        return;                               /* keep the longer chains */
+    for (i = 0; i < p->buckets_num; i++)
+    {
+        profile_entry *e = p->buckets[i];
+        while (e != NULL)
+        {
+            profile_entry *next = e->next;
+            e->next = new_buckets[e->hash & (new_num - 1)];
+            new_buckets[e->hash & (new_num - 1)] = e;
+            e = next;
+        }
+    }
+    free(p->buckets);
+    p->buckets = new_buckets;
+    p->buckets_num = new_num;
+}
+
+/* Writes the description of a frame, without ';' that separates the frames */
+static void format_frame(char *buf, lua_Debug *ar)
+{
+    char *c;
+
+    if (*ar->namewhat != '\0')
+        snprintf(buf, PROFILER_FRAME_SIZE, "%s %s:%d", ar->name, ar->short_src, ar->currentline);
+    else if (*ar->what == 'm')
+        snprintf(buf, PROFILER_FRAME_SIZE, "main chunk %s:%d", ar->short_src, ar->currentline);
+    else if (*ar->what == 'C')
+        snprintf(buf, PROFILER_FRAME_SIZE, "? %s", ar->short_src);
+    else
+        snprintf(buf, PROFILER_FRAME_SIZE, "function <%s:%d> %s:%d", ar->short_src,
+                 ar->linedefined, ar->short_src, ar->currentline);
+
+    for (c = buf; *c != '\0'; c++)
+        if (*c == ';')
+            *c = ',';
+}
+
+static void profiler_sample(lua_State *L, profiler *p)
+{
+    lua_Debug ar;
+    char frame[PROFILER_FRAME_SIZE];
+    size_t len, frame_len;
+    int level;
+
+    /* the frames are found from the innermost one: the key is filled from its
+     * end, the outermost frame is at key + len */
+    len = p->key_size - 1;
+    p->key[len] = '\0';
+    for (level = 0; level < p->max_depth && lua_getstack(L, level, &ar); level++)
+    {
+        lua_getinfo(L, "Snl", &ar);
+        format_frame(frame, &ar);
+        frame_len = strlen(frame);
+        if (frame_len + 1 > len)
+            break;
+        if (level > 0)
+            p->key[--len] = ';';
+        len -= frame_len;
+        memcpy(p->key + len, frame, frame_len);
+    }
+    if (level == 0)
+        return;
+
+    const char *key = p->key + len;
+    uint32_t hash = profiler_hash(key);
+    profile_entry *e = p->buckets[hash & (p->buckets_num - 1)];
+    while (e != NULL && (e->hash != hash || strcmp(e->stack, key) != 0))
+        e = e->next;
+
+    if (e == NULL)
+    {
+        size_t key_len = strlen(key);
+        e = (profile_entry *)malloc(sizeof(profile_entry) + key_len + 1);
+        if (e == NULL)
+            return;                           /* the sample is lost */
+        memcpy(e->stack, key, key_len + 1);
+        e->hash = hash;
+        e->samples = 0;
+        e->next = p->buckets[hash & (p->buckets_num - 1)];
+        p->buckets[hash & (p->buckets_num - 1)] = e;
+        if (++p->entries_num > 2 * p->buckets_num)
+            profiler_grow(p);
+    }
+
+    e->samples++;
+    p->samples++;
+}
+
+static void profiler_hook(lua_State *L, profiler *p, int count)
+{
+    if (p->timer)
+    {
+        double now = monotonic_time();
+        if (now < p->next_sample)
+            return;
+        p->next_sample = now + p->interval;
+    }
+    else
+    {
+        p->instructions += count;
+        if (p->instructions < p->period)
+            return;
+        p->instructions = 0;
+    }
+    profiler_sample(L, p);
+}
+
+CAMLprim
+value lua_profiler_start__stub(value L, value timer, value period,
+                               value interval, value max_depth)
+{
+    CAMLparam5(L, timer, period, interval, max_depth);
+
+    lua_State *LL = lua_State_val(L);
+    ocaml_data *data = get_ocaml_data(LL);
+    profiler *p = data->profiler;
+
+    if (p == NULL)
+    {
+        p = (profiler *)calloc(1, sizeof(profiler));
+        if (p == NULL)
+            caml_raise_out_of_memory();
+        p->buckets_num = 256;
+        p->buckets = (profile_entry **)calloc(p->buckets_num, sizeof(profile_entry *));
+        p->key_size = 4096;
+        p->key = (char *)malloc(p->key_size);
+        if (p->buckets == NULL || p->key == NULL)
+        {
+            free_profiler(p);
+            caml_raise_out_of_memory();
+        }
+        data->profiler = p;
+    }
+    else
+        profiler_clear(p);
+
+    p->timer = Bool_val(timer);
+    p->period = Int_val(period);
+    p->interval = Double_val(interval);
+    p->next_sample = monotonic_time() + p->interval;
+    p->max_depth = Int_val(max_depth);
+    p->running = 1;
+    set_hook(LL, data);
+
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_profiler_stop__stub(value L)
+{
+    CAMLparam1(L);
+
+    lua_State *LL = lua_State_val(L);
+    ocaml_data *data = get_ocaml_data(LL);
+
+    if (data->profiler != NULL)
+    {
+        data->profiler->running = 0;
+        data->profiler->callback_depth = 0;
+        set_hook(LL, data);
+    }
+
+    CAMLreturn(Val_unit);
+}
+
+/* Returns (samples, [| (stack, samples); ... |], callbacks, callback_time) */
+CAMLprim
+value lua_profiler_report__stub(value L)
+{
+    CAMLparam1(L);
+    CAMLlocal4(ret_val, stacks, pair, s);
+
+    profiler *p = get_ocaml_data(lua_State_val(L))->profiler;
+    size_t i, j = 0;
+
+    if (p == NULL)
+        stacks = caml_alloc(0, 0);
+    else
+    {
+        stacks = caml_alloc(p->entries_num, 0);
+        for (i = 0; i < p->buckets_num; i++)
+        {
+            profile_entry *e;
+            for (e = p->buckets[i]; e != NULL; e = e->next)
+            {
+                s = caml_copy_string(e->stack);
+                pair = caml_alloc_small(2, 0);
+                Field(pair, 0) = s;
+                Field(pair, 1) = Val_long(e->samples);
+                Store_field(stacks, j++, pair);
+            }
+        }
+    }
+
+    s = caml_copy_double(p == NULL ? 0.0 : p->callback_time);
+    ret_val = caml_alloc_small(4, 0);
+    Field(ret_val, 0) = Val_long(p == NULL ? 0 : p->samples);
+    Field(ret_val, 1) = stacks;
+    Field(ret_val, 2) = Val_long(p == NULL ? 0 : p->callbacks);
+    Field(ret_val, 3) = s;
+
+    CAMLreturn(ret_val);
+}
+
+/******************************************************************************/
+/*****                          LIMITED CALLS                             *****/
+/******************************************************************************/
+/* lua_pcall_limited__stub runs lua_pcall with a limit on the number of
+ * instructions and a deadline, checked by the count hook at least every 1000
+ * instructions and when the instruction budget is exhausted. When a limit is
+ * reached the hook raises a Lua error and, in case the script catches it,
+ * raises it again before every instruction that follows, until the call
+ * returns. The coroutines get the hook when they are resumed (see
+ * refresh_hook), so the limits hold also for the coroutines created before
+ * the call. */
+
+static void limits_hook(lua_State *L, ocaml_data *data, call_limits *l, int count)
+{
+    if (l->reached == LIMIT_NONE)
+    {
+        l->instructions += count;
+        if (l->max_instructions >= 0 && l->instructions >= l->max_instructions)
+            l->reached = LIMIT_INSTRUCTIONS;
+        else if (l->deadline >= 0.0 && monotonic_time() >= l->deadline)
+            l->reached = LIMIT_DEADLINE;
+        else
+        {
+            if (l->max_instructions >= 0)
+                set_hook(L, data);          /* the budget left is smaller */
+            return;
+        }
+        set_hook(L, data);
+    }
+
+    if (l->reached == LIMIT_INSTRUCTIONS)
+        lua_pushliteral(L, "instruction limit reached");
+    else
+        lua_pushliteral(L, "deadline reached");
+    lua_error(L);
+}
+
+/* The limits of an inner call can't go beyond the ones left to the outer */
+static void narrow_limits(call_limits *l, const call_limits *outer)
+{
+    long remaining = outer->max_instructions - outer->instructions;
+
+    l->reached = outer->reached;
+    if (outer->max_instructions >= 0 &&
+        (l->max_instructions < 0 || remaining < l->max_instructions))
+        l->max_instructions = remaining > 0 ? remaining : 0;
+    if (outer->deadline >= 0.0 && (l->deadline < 0.0 || outer->deadline < l->deadline))
+        l->deadline = outer->deadline;
+}
+
+/* Charges the instructions of an inner call to the outer one */
+static void charge_limits(call_limits *outer, const call_limits *l)
+{
+    outer->instructions += l->instructions;
+    if (outer->reached == LIMIT_NONE)
+    {
+        if (outer->max_instructions >= 0 && outer->instructions >= outer->max_instructions)
+            outer->reached = LIMIT_INSTRUCTIONS;
+        else if (outer->deadline >= 0.0 && monotonic_time() >= outer->deadline)
+            outer->reached = LIMIT_DEADLINE;
+    }
+}
+
+/* Returns the status of lua_pcall, or the opposite of the limit reached */
+CAMLprim
+value lua_pcall_limited__stub(value L, value nargs, value nresults, value errfunc,
+                              value limits)
+{
+    CAMLparam5(L, nargs, nresults, errfunc, limits);
+
+    lua_State *LL = lua_State_val(L);
+    ocaml_data *data = get_ocaml_data(LL);
+    call_limits saved = data->limits;          /* for nested calls */
+    int depth = save_callback_depth(data);
+    double timeout = Double_val(Field(limits, 1));
+    int status, reached;
+
+    data->limits.active = 1;
+    data->limits.reached = LIMIT_NONE;
+    data->limits.max_instructions = Long_val(Field(limits, 0));
+    data->limits.instructions = 0;
+    data->limits.deadline = timeout >= 0.0 ? monotonic_time() + timeout : -1.0;
+    if (saved.active)
+        narrow_limits(&(data->limits), &saved);
+    set_hook(LL, data);
+
+    if (data->release_runtime)
+    {
+        release_runtime(data);
+        status = lua_pcall(LL, Int_val(nargs), Int_val(nresults), Int_val(errfunc));
+        acquire_runtime(data);
+        untrack_pending_threads(data);
+    }
+    else
+        status = lua_pcall(LL, Int_val(nargs), Int_val(nresults), Int_val(errfunc));
+    restore_callback_depth(data, depth);
+
+    reached = data->limits.reached;
+    if (saved.active)
+        charge_limits(&saved, &(data->limits));
+    data->limits = saved;
+    set_hook(LL, data);
+
+    if (status != 0 && reached != LIMIT_NONE)
+        CAMLreturn(Val_int(-reached));
+    CAMLreturn(Val_int(status));
+}
+
+/******************************************************************************/
+/*****                             PINNED KEYS                            *****/
+/******************************************************************************/
+/* A Lua_api_lib.Key.t is a string interned once in a state and kept alive by
+ * a reference in the registry: pushing it is a lua_rawgeti, with no strlen,
+ * hashing or lookup in the string table. A key used with another state falls
+ * back to its name. */
+
+/* Fields of Lua_api_lib.Key.t */
+#define Key_name(k)     Field(k, 0)
+#define Key_ref(k)      Field(k, 1)
+#define Key_state(k)    Field(k, 2)
+
+CAMLprim
+value lua_key_create__stub(value L, value name)
+{
+    CAMLparam2(L, name);
+
+    lua_State *LL = lua_State_val(L);
+    lua_pushlstring(LL, String_val(name), caml_string_length(name));
+    int ref = luaL_ref(LL, LUA_REGISTRYINDEX);
+
+    CAMLreturn(Val_int(ref));
+}
+
+static void push_key(lua_State *L, value key)
+{
+    if (get_ocaml_data(L) == get_ocaml_data(lua_State_val(Key_state(key))))
+        lua_rawgeti(L, LUA_REGISTRYINDEX, Int_val(Key_ref(key)));
+    else
+        lua_pushlstring(L, String_val(Key_name(key)), caml_string_length(Key_name(key)));
+}
+
+CAMLprim
+value lua_getfield_key__stub(value L, value index, value key)
+{
+    CAMLparam3(L, index, key);
+    lua_State *LL = lua_State_val(L);
+    int t = absolute_index(LL, Int_val(index));
+    push_key(LL, key);
+    lua_gettable(LL, t);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_setfield_key__stub(value L, value index, value key)
+{
+    CAMLparam3(L, index, key);
+    lua_State *LL = lua_State_val(L);
+    int t = absolute_index(LL, Int_val(index));
+    push_key(LL, key);
+    lua_insert(LL, -2);
+    lua_settable(LL, t);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_rawget_key__stub(value L, value index, value key)
+{
+    CAMLparam3(L, index, key);
+    lua_State *LL = lua_State_val(L);
+    int t = absolute_index(LL, Int_val(index));
+    push_key(LL, key);
+    lua_rawget(LL, t);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_rawset_key__stub(value L, value index, value key)
+{
+    CAMLparam3(L, index, key);
+    lua_State *LL = lua_State_val(L);
+    int t = absolute_index(LL, Int_val(index));
+    push_key(LL, key);
+    lua_insert(LL, -2);
+    lua_rawset(LL, t);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value lua_pushkey__stub(value L, value key)
+{
+    CAMLparam2(L, key);
+    push_key(lua_State_val(L), key);
+    CAMLreturn(Val_unit);
+}
+
+/******************************************************************************/
+/*****                          FUNCTION HANDLES                          *****/
+/******************************************************************************/
+/* lua_fn_call__stub calls the Lua function of a Lua_api_lib.Fn.t, pinned in
+ * the registry, with the optional message handler of the handle. The types of
+ * the arguments and of the result are encoded as the index of the
+ * corresponding constructor of Lua_api_lib.Fn.ty. On error the stack is
+ * restored and Call_error is raised with the error message. */
+
+/* Fields of Lua_api_lib.Fn.t */
+#define Fn_state(h)         Field(h, 0)
+#define Fn_ref(h)           Field(h, 1)
+#define Fn_handler_ref(h)   Field(h, 2)
+#define Fn_arg_types(h)     Field(h, 3)
+#define Fn_result_type(h)   Field(h, 4)
+
+enum fn_type { FN_UNIT, FN_BOOL, FN_INT, FN_FLOAT, FN_STRING, FN_VALUE };
+
+static void fn_fail(lua_State *L, int base, const char *msg, size_t len)
+{
+    CAMLparam0();
+    CAMLlocal1(exn_msg);
+    exn_msg = caml_alloc_string(len);
+    memcpy((char *)String_val(exn_msg), msg, len);
+    lua_settop(L, base);
+    caml_raise_with_arg(*caml_named_value("Lua_call_error"), exn_msg);
+    CAMLnoreturn;
+}
+
+#define fn_fail_literal(L, base, msg) fn_fail(L, base, msg, sizeof(msg) - 1)
+
+CAMLprim
+value lua_fn_call__stub(value handle, value args)
+{
+    CAMLparam2(handle, args);
+    CAMLlocal2(ret_val, field);
+
+    lua_State *LL = lua_State_val(Fn_state(handle));
+    ocaml_data *data = get_ocaml_data(LL);
+    mlsize_t nargs = Wosize_val(args);
+    int base = lua_gettop(LL);
+    int errfunc = 0;
+    int status, depth;
+    mlsize_t i;
+    size_t len;
+    const char *s;
+    conversion_ctx ctx;
+
+    if (!lua_checkstack(LL, nargs + 2))
+        fn_fail_literal(LL, base, "stack overflow");
+
+    if (Int_val(Fn_handler_ref(handle)) != LUA_NOREF)
+    {
+        lua_rawgeti(LL, LUA_REGISTRYINDEX, Int_val(Fn_handler_ref(handle)));
+        errfunc = base + 1;
+    }
+    lua_rawgeti(LL, LUA_REGISTRYINDEX, Int_val(Fn_ref(handle)));
+
+    ctx.L = LL;
+    ctx.base = base;
+    ctx.max_depth = 100;
+    ctx.path = NULL;
+    ctx.path_num = 0;
+    ctx.path_size = 0;
+
+    for (i = 0; i < nargs; i++)
+    {
+        field = Field(args, i);
+        switch (Int_val(Field(Fn_arg_types(handle), i)))
+        {
+            case FN_UNIT:
+                lua_pushnil(LL);
+                break;
+            case FN_BOOL:
+                lua_pushboolean(LL, Bool_val(field));
+                break;
+            case FN_INT:
+                lua_pushinteger(LL, Long_val(field));
+                break;
+            case FN_FLOAT:
+                lua_pushnumber(LL, Double_val(field));
+                break;
+            case FN_STRING:
+                lua_pushlstring(LL, String_val(field), caml_string_length(field));
+                break;
+            case FN_VALUE:
+                push_value(&ctx, field);
+                break;
+        }
+    }
+
+    depth = save_callback_depth(data);
+    refresh_hook(LL, data);
+    if (data->release_runtime)
+    {
+        release_runtime(data);
+        status = lua_pcall(LL, nargs, 1, errfunc);
+        acquire_runtime(data);
+        untrack_pending_threads(data);
+    }
+    else
+        status = lua_pcall(LL, nargs, 1, errfunc);
+    restore_callback_depth(data, depth);
+
+    if (status != 0)
+    {
+        s = lua_tolstring(LL, -1, &len);
+        if (s == NULL)
+            fn_fail_literal(LL, base, "error object is not a string");
+        fn_fail(LL, base, s, len);
+    }
+
+    switch (Int_val(Fn_result_type(handle)))
+    {
+        case FN_UNIT:
+            ret_val = Val_unit;
+            break;
+        case FN_BOOL:
+            ret_val = Val_bool(lua_toboolean(LL, -1));
+            break;
+        case FN_INT:
+            if (!lua_isnumber(LL, -1))
+                fn_fail_literal(LL, base, "bad result (number expected)");
+            ret_val = Val_long(lua_tointeger(LL, -1));
+            break;
+        case FN_FLOAT:
+            if (!lua_isnumber(LL, -1))
+                fn_fail_literal(LL, base, "bad result (number expected)");
+            ret_val = caml_copy_double(lua_tonumber(LL, -1));
+            break;
+        case FN_STRING:
+            s = lua_tolstring(LL, -1, &len);
+            if (s == NULL)
+                fn_fail_literal(LL, base, "bad result (string expected)");
+            ret_val = caml_alloc_string(len);
+            memcpy((char *)String_val(ret_val), s, len);
+            break;
+        case FN_VALUE:
+            ret_val = to_value(&ctx, lua_gettop(LL));
+            free(ctx.path);
+            break;
+    }
+    lua_settop(LL, base);
+
+    CAMLreturn(ret_val);
+}
@@ -8,6 +8,30 @@ type buffer =
 
 type reg = string * oCamlFunction
 
+type chunk_cache_stats =
+  {
+    hits : int;
+    misses : int;
+    evictions : int;
+    entries : int;
+    bytes : int;
+    max_entries : int;
+    max_bytes : int;
+  }
+
+type memory_stats =
+  {
+    used : int;
+    peak : int;
+    limit : int;
+    allocs : int;
+    frees : int;
+    reallocs : int;
+    bytes_allocated : int;
+    refused : int;
+    histogram : int array;
+  }
+
 let refnil = -1;;
 
 let noref = -2;;
@@ -59,6 +83,17 @@ let checklstring ls narg =
   | None -> tag_error ls narg LUA_TSTRING
 ;;
 
+let checkbigstring ls narg =
+  match tobigstring ls narg with
+  | Some s -> s
+  | None -> tag_error ls narg LUA_TSTRING
+;;
+
+let checklstring_into ls narg buf ofs =
+  try tolstring_into ls narg buf ofs
+  with Type_error _ -> tag_error ls narg LUA_TSTRING
+;;
+
 let checknumber ls narg =
   let d = tonumber ls narg in
   if d = 0.0 && not (isnumber ls narg)
@@ -150,6 +185,38 @@ let loadstring ls s =
   loadbuffer ls s s
 ;;
 
+external luaL_loadbuffer_cached__wrapper :
+  state -> string -> string -> int = "luaL_loadbuffer_cached__stub"
+
+let loadbuffer_cached ls buff name =
+  luaL_loadbuffer_cached__wrapper ls buff name |> thread_status_of_int
+;;
+
+external chunk_cache_stats : unit -> chunk_cache_stats = "luaL_chunk_cache_stats__stub"
+
+external chunk_cache_set_limits__wrapper : int -> int -> unit
+  = "luaL_chunk_cache_set_limits__stub"
+
+let chunk_cache_set_limits ?(max_entries = -1) ?(max_bytes = -1) () =
+  chunk_cache_set_limits__wrapper max_entries max_bytes
+;;
+
+external chunk_cache_clear : unit -> unit = "luaL_chunk_cache_clear__stub"
+
+external luaL_loadbigstring__wrapper :
+  state -> bigstring -> int -> int -> string -> int = "luaL_loadbigstring__stub"
+
+let loadbigstring ls ?(off=0) ?len buff name =
+  let len = match len with Some l -> l | None -> Bigarray.Array1.dim buff - off in
+  luaL_loadbigstring__wrapper ls buff off len name |> thread_status_of_int
+;;
+
+external luaL_loadfd__wrapper : state -> Unix.file_descr -> string -> int = "luaL_loadfd__stub"
+
+let loadfd ls fd name =
+  luaL_loadfd__wrapper ls fd name |> thread_status_of_int
+;;
+
 let dostring ls str =
   match loadstring ls str with
   | LUA_OK -> begin
@@ -168,14 +235,18 @@ external gsub : state -> string -> string -> string -> string = "luaL_gsub__stub
 
 external newmetatable : state -> string -> bool = "luaL_newmetatable__stub"
 
-external newstate__wrapper : int -> unit -> state = "luaL_newstate__stub"
+external newstate__wrapper : int -> bool -> unit -> state = "luaL_newstate__stub"
 
-let newstate ?(max_memory_size) () =
+let newstate ?(max_memory_size) ?(release_runtime=false) () =
   let () = Lazy.force (Lua_api_lib.init) in
   let m = match max_memory_size with | Some i -> i | None -> 0 in
-  newstate__wrapper m ()
+  newstate__wrapper m release_runtime ()
 ;;
 
+external memory_stats : state -> memory_stats = "luaL_memory_stats__stub"
+
+external reset_memory_stats : state -> unit = "luaL_reset_memory_stats__stub"
+
 external openlibs : state -> unit = "luaL_openlibs__stub"
 
 external optinteger : state -> int -> int -> int = "luaL_optinteger__stub"
@@ -237,3 +308,90 @@ let typename ls index =
 external unref : state -> int -> int -> unit = "luaL_unref__stub"
 
 external where : state -> int -> unit = "luaL_where__stub"
+
+external copy_state : state -> state = "luaL_copy_state__stub"
+
+type snapshot =
+  {
+    template : state;
+    template_lock : Mutex.t;
+  }
+
+let snapshot ls =
+  { template = copy_state ls; template_lock = Mutex.create () }
+;;
+
+let fork snap =
+  Mutex.lock snap.template_lock;
+  match copy_state snap.template with
+  | ls -> Mutex.unlock snap.template_lock; ls
+  | exception e -> Mutex.unlock snap.template_lock; raise e
+;;
+
+external save_globals : state -> unit = "luaL_save_globals__stub"
+
+external reset_state : state -> unit = "luaL_reset_state__stub"
+
+module Pool =
+struct
+  type t =
+    {
+      init : state -> unit;
+      max_memory_size : int option;
+      release_runtime : bool;
+      capacity : int;
+      states : state Queue.t;
+      lock : Mutex.t;
+    }
+
+  let new_state pool =
+    let ls =
+      newstate ?max_memory_size:pool.max_memory_size
+               ~release_runtime:pool.release_runtime () in
+    pool.init ls;
+    save_globals ls;
+    ls
+  ;;
+
+  let create ?(size=8) ?max_memory_size ?(release_runtime=false) init =
+    let pool =
+      { init; max_memory_size; release_runtime; capacity = size;
+        states = Queue.create (); lock = Mutex.create () } in
+    for _i = 1 to size do Queue.push (new_state pool) pool.states done;
+    pool
+  ;;
+
+  let available pool =
+    Mutex.lock pool.lock;
+    let n = Queue.length pool.states in
+    Mutex.unlock pool.lock;
+    n
+  ;;
+
+  let checkout pool =
+    Mutex.lock pool.lock;
+    let ls =
+      if Queue.is_empty pool.states
+      then None
+      else Some (Queue.pop pool.states) in
+    Mutex.unlock pool.lock;
+    match ls with
+    | Some ls -> ls
+    | None -> new_state pool
+  ;;
+
+  let checkin pool ls =
+    reset_state ls;
+    Mutex.lock pool.lock;
+    if Queue.length pool.states < pool.capacity
+    then Queue.push ls pool.states;
+    Mutex.unlock pool.lock
+  ;;
+
+  let with_state pool f =
+    let ls = checkout pool in
+    match f ls with
+    | result -> checkin pool ls; result
+    | exception e -> checkin pool ls; raise e
+  ;;
+end
@@ -26,6 +26,36 @@ type reg = string * oCamlFunction
 (** See {{:http://www.lua.org/manual/5.1/manual.html#luaL_reg}luaL_reg}
     documentation. *)
 
+(** Statistics of the process-wide cache used by {!loadbuffer_cached}. This
+    type is not present in the original Lua Auxiliary Library. *)
+type chunk_cache_stats =
+  {
+    hits : int;         (** Loads served by the cache *)
+    misses : int;       (** Loads that parsed the source code *)
+    evictions : int;    (** Entries removed to respect the limits *)
+    entries : int;      (** Chunks currently in the cache *)
+    bytes : int;        (** Memory used by the cached chunks *)
+    max_entries : int;  (** Maximum number of chunks *)
+    max_bytes : int;    (** Maximum memory, in bytes *)
+  }
+
+(** Memory statistics of a state, returned by {!memory_stats}. This type is
+    not present in the original Lua Auxiliary Library. *)
+type memory_stats =
+  {
+    used : int;             (** Bytes currently allocated by Lua *)
+    peak : int;             (** Maximum of [used] since the last reset *)
+    limit : int;            (** [max_memory_size] of the state, 0 if none *)
+    allocs : int;           (** Number of allocations *)
+    frees : int;            (** Number of deallocations *)
+    reallocs : int;         (** Number of reallocations *)
+    bytes_allocated : int;  (** Sum of the sizes of allocations and reallocations *)
+    refused : int;          (** Allocations refused because of [limit] *)
+    histogram : int array;
+    (** Allocations and reallocations by size: the element [i] counts the
+        sizes up to [16 lsl i] bytes, the last one all the bigger sizes *)
+  }
+
 
 (************************)
 (** {2 Constant values} *)
@@ -124,6 +154,19 @@ val checklstring : state -> int -> string
     {b NOTE}: this function is {b not} a binding of the original luaL_checklstring,
     it's rather an OCaml function with the same semantics. *)
 
+val checkbigstring : state -> int -> bigstring
+(** Like {!Lua_aux_lib.checklstring}, but returns a view of the Lua string
+    without copying it. See {!Lua_api_lib.tobigstring} for the lifetime of the
+    returned value.
+
+    {b NOTE}: this function is not present in the official API. *)
+
+val checklstring_into : state -> int -> Bytes.t -> int -> int
+(** Like {!Lua_aux_lib.checklstring}, but copies the string into a buffer
+    provided by the caller. See {!Lua_api_lib.tolstring_into}.
+
+    {b NOTE}: this function is not present in the official API. *)
+
 val checkstring : state -> int -> string
 (** See {{:http://www.lua.org/manual/5.1/manual.html#luaL_checkstring}luaL_checkstring}
     documentation.
@@ -220,6 +263,61 @@ val loadbuffer : Lua_api_lib.state -> string -> string -> thread_status
     {{:http://www.lua.org/manual/5.1/manual.html#luaL_loadbuffer}luaL_loadbuffer}
     documentation. *)
 
+val loadbigstring :
+  state -> ?off:int -> ?len:int -> bigstring -> string -> thread_status
+(** Same as {!loadbuffer}, but the chunk is read in place from the bigarray (or
+    from its slice of [len] bytes starting at [off]), without copying it into
+    an OCaml string. This is the way to load a file mapped in memory with
+    [Unix.map_file]. Raises [Invalid_argument] if [off] and [len] do not
+    designate a valid slice.
+
+    {b NOTE}: this function is not present in the original Lua Auxiliary
+    Library. *)
+
+val loadfd : state -> Unix.file_descr -> string -> thread_status
+(** Loads a chunk reading it from the file descriptor until the end of file,
+    with no OCaml code involved while reading. The last argument is the chunk
+    name, as in {!loadbuffer}. If a read fails the result is [LUA_ERRFILE],
+    with an error message on the stack, like in {!loadfile}. The descriptor is
+    not closed.
+
+    {b NOTE}: this function is not present in the original Lua Auxiliary
+    Library. *)
+
+val loadbuffer_cached : state -> string -> string -> thread_status
+(** Same as {!loadbuffer}, but the compiled chunk is kept in a cache shared by
+    all the states of the process, keyed by the source code and the chunk name.
+    When the same source is loaded again, in any state and from any thread,
+    the precompiled binary chunk is loaded instead, skipping the lexer and the
+    parser. Only successfully compiled chunks are cached. When the cache
+    exceeds its limits (see {!chunk_cache_set_limits}) the least recently used
+    chunks are evicted.
+
+    {b NOTE}: this function is not present in the original Lua Auxiliary
+    Library. *)
+
+val chunk_cache_stats : unit -> chunk_cache_stats
+(** Returns the statistics of the cache used by {!loadbuffer_cached}.
+
+    {b NOTE}: this function is not present in the original Lua Auxiliary
+    Library. *)
+
+val chunk_cache_set_limits : ?max_entries:int -> ?max_bytes:int -> unit -> unit
+(** Sets the maximum number of chunks and the maximum memory (in bytes) of the
+    cache used by {!loadbuffer_cached}, evicting the least recently used chunks
+    if needed. A missing argument leaves the current limit unchanged; defaults
+    are 1024 chunks and 64 MB. A limit of 0 disables the cache.
+
+    {b NOTE}: this function is not present in the original Lua Auxiliary
+    Library. *)
+
+val chunk_cache_clear : unit -> unit
+(** Removes all the chunks from the cache used by {!loadbuffer_cached}. The
+    counters of hits, misses and evictions are not reset.
+
+    {b NOTE}: this function is not present in the original Lua Auxiliary
+    Library. *)
+
 val loadfile : state -> string -> thread_status
 (** See {{:http://www.lua.org/manual/5.1/manual.html#luaL_loadfile}luaL_loadfile}
     documentation. *)
@@ -232,7 +330,7 @@ external newmetatable : state -> string -> bool = "luaL_newmetatable__stub"
 (** See {{:http://www.lua.org/manual/5.1/manual.html#luaL_newmetatable}luaL_newmetatable}
     documentation. *)
 
-val newstate : ?max_memory_size:int -> unit -> state
+val newstate : ?max_memory_size:int -> ?release_runtime:bool -> unit -> state
 (** See {{:http://www.lua.org/manual/5.1/manual.html#luaL_newstate}luaL_newstate}
     documentation.
 
@@ -241,11 +339,46 @@ val newstate : ?max_memory_size:int -> unit -> state
 
     An optional parameter, not available in the original luaL_newstate, provide
     the user the chance to specify the maximum memory (in byte) that Lua is allowed to
-    allocate for this state. *)
+    allocate for this state.
+
+    If [release_runtime] is [true] (default is [false]) the functions executing
+    Lua code ({!Lua_api_lib.call}, {!Lua_api_lib.pcall}, {!Lua_api_lib.resume},
+    {!loadbuffer}, {!loadbigstring}, {!loadfd} and {!loadfile}) release the
+    OCaml runtime lock while Lua runs, and re-acquire it only when Lua calls
+    back into OCaml (OCaml functions, panic function and "__gc" metamethods).
+    This way several system threads, each one with its own state, can run Lua
+    code in parallel. The state itself must still be used by one thread at a
+    time. An OCaml function raising a Lua error (e.g. with {!error} or
+    {!checkstring}) keeps the runtime lock until the Lua function returns.
+
+    The protocol assumes the single runtime lock of the OCaml 4 systhreads:
+    the states created this way must not be used from several OCaml 5
+    domains. *)
+
+val memory_stats : state -> memory_stats
+(** Returns the memory statistics of the state, collected by the allocator
+    since the state creation or the last call to {!reset_memory_stats}. The
+    counters are 64 bits wide.
+
+    {b NOTE}: this function is not present in the original Lua Auxiliary
+    Library. *)
+
+external reset_memory_stats : state -> unit = "luaL_reset_memory_stats__stub"
+(** Resets the counters of the memory statistics of the state; the peak
+    becomes the memory currently in use.
+
+    {b NOTE}: this function is not present in the original Lua Auxiliary
+    Library. *)
 
 external openlibs : Lua_api_lib.state -> unit = "luaL_openlibs__stub"
 (** See {{:http://www.lua.org/manual/5.1/manual.html#luaL_openlibs}luaL_openlibs}
-    documentation. *)
+    documentation.
+
+    {b NOTE}: [coroutine.resume] and [coroutine.wrap] are replaced by
+    functions calling the original ones, which also give to the resumed
+    coroutine the hook of the state, used by {!Lua_api_lib.Profiler} and
+    {!Lua_api_lib.pcall_limited}. [debug.sethook] is replaced by a function
+    raising an error during a {!Lua_api_lib.pcall_limited}. *)
 
 val optint : state -> int -> int -> int
 (** See {{:http://www.lua.org/manual/5.1/manual.html#luaL_optint}luaL_optint}
@@ -327,3 +460,94 @@ external unref : state -> int -> int -> unit = "luaL_unref__stub"
 external where : state -> int -> unit = "luaL_where__stub"
 (** See {{:http://www.lua.org/manual/5.1/manual.html#luaL_where}luaL_where}
     documentation. *)
+
+(***********************************)
+(** {2 State snapshots and forks} *)
+(***********************************)
+
+(** A frozen copy of a state, used as a template to create new states. This
+    type is not present in the original Lua Auxiliary Library. *)
+type snapshot
+
+val snapshot : state -> snapshot
+(** Takes a snapshot of a fully initialized state: the globals, the registry
+    (hence the loaded modules and the metatables created with
+    {!newmetatable}), the metatables of the basic types (e.g. the one of the
+    strings), the OCaml functions and userdata. The state is not modified, and
+    later changes to it do not affect the snapshot.
+
+    The copy is deep and preserves the sharing between values, including the
+    cycles. Lua functions are copied with their upvalues and environment, but
+    two functions sharing an upvalue get separate copies of it. Userdata
+    created by C libraries are copied byte by byte only when this is safe:
+    userdata without a metatable, and the standard (or closed) files of the
+    [io] library. Raises [Failure] if the state contains a thread (a
+    coroutine) or any other userdata of a C library, e.g. a file opened with
+    [io.open], because both states would release the same resource, or if
+    the copy runs out of memory (e.g. because of [max_memory_size]): the state
+    is left as it was.
+
+    {b NOTE}: this function is not present in the original Lua Auxiliary
+    Library. *)
+
+val fork : snapshot -> state
+(** Creates a new state, a copy of the snapshot, with the same
+    [max_memory_size] and [release_runtime] of the original state. Creating a
+    state this way is usually much faster than running again the bootstrap
+    code. This function can be called by several threads on the same snapshot.
+    Raises [Failure] if the copy runs out of memory.
+
+    {b NOTE}: this function is not present in the original Lua Auxiliary
+    Library. *)
+
+(********************)
+(** {2 State pools} *)
+(********************)
+
+(** A pool of initialized states, ready to be used as short-lived sandboxes
+    without paying the creation of a new state, the loading of the standard
+    libraries and the execution of bootstrap code every time.
+
+    When a state enters the pool its global environment is saved: the globals
+    table, its metatable and the content of every table stored in a global
+    variable (the libraries). When it is given back, the environment is
+    restored, the stack is emptied, the garbage collector is restarted with
+    the default parameters and a full collection is performed. Tables nested
+    deeper (e.g. [package.loaded]), the registry and the metatables other than
+    the one of the globals are not restored.
+
+    A pool can be used by several threads; a state checked out of a pool must
+    still be used by one thread at a time. To avoid any contention, create a
+    pool per thread.
+
+    {b NOTE}: this module is not present in the original Lua Auxiliary
+    Library. *)
+module Pool :
+sig
+  type t
+
+  val create :
+    ?size:int -> ?max_memory_size:int -> ?release_runtime:bool ->
+    (state -> unit) -> t
+  (** [create ?size ?max_memory_size ?release_runtime init] creates a pool of
+      [size] states (default is 8). Each state is created with {!newstate},
+      with the given optional arguments, and then initialized with [init]
+      (e.g. loading the libraries, registering functions, running bootstrap
+      scripts). *)
+
+  val available : t -> int
+  (** Number of states ready in the pool. *)
+
+  val checkout : t -> state
+  (** Takes a state from the pool. If the pool is empty a new state is
+      created and initialized. *)
+
+  val checkin : t -> state -> unit
+  (** Resets the state and gives it back to the pool. If the pool already
+      contains [size] states, the state is discarded. The state must have been
+      obtained from a pool; raises [Invalid_argument] otherwise. *)
+
+  val with_state : t -> (state -> 'a) -> 'a
+  (** [with_state pool f] applies [f] to a state checked out of the pool, and
+      checks it in when [f] returns or raises. *)
+end
@@ -1,5 +1,10 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #include <lua.h>
@@ -13,6 +18,7 @@
 #include <caml/fail.h>
 #include <caml/callback.h>
 #include <caml/signals.h>
+#include <caml/bigarray.h>
 
 #include "stub.h"
 
@@ -41,15 +47,29 @@ static struct custom_operations default_lua_State_ops =
   custom_deserialize_default
 };
 
-/******************************************************************************/
-/*****                           GLOBAL LOCKS                             *****/
-/******************************************************************************/
-static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
-
-
 /******************************************************************************/
 /*****                         UTILITY FUNCTIONS                          *****/
 /******************************************************************************/
+/*
+ * The allocator of every Lua state created by this binding. The accounting
+ * lives in the allocator_data of the state and, since a lua_State (together
+ * with all its threads) can be used by only one system thread at a time, it
+ * doesn't need any lock: states running in different threads never share
+ * anything here. For the same reason we use the plain C allocator instead of
+ * the OCaml runtime one.
+ */
+static int size_class(size_t size)
+{
+    int c = 0;
+    size_t limit = 16;
+    while (size > limit && c < MEMORY_SIZE_CLASSES - 1)
+    {
+        limit <<= 1;
+        c++;
+    }
+    return c;
+}
+
 static void *custom_alloc ( void *ud,
                             void *ptr,
                             size_t osize,
@@ -58,10 +78,8 @@ static void *custom_alloc ( void *ud,
     void *realloc_result = NULL;
 
     allocator_data *ad = (allocator_data *)ud;
-    debug(6, "custom_alloc: max_memory = %d\n", ad->max_memory);
-    debug(6, "custom_alloc: used_memory = %d\n", ad->used_memory);
-
-    pthread_mutex_lock(&alloc_lock);
+    debug(6, "custom_alloc: max_memory = %lld\n", (long long)ad->max_memory);
+    debug(6, "custom_alloc: used_memory = %lld\n", (long long)ad->used_memory);
 
     debug(5, "custom_alloc(%p, %p, %d, %d)\n", ud, ptr, osize, nsize);
 
@@ -69,36 +87,42 @@ static void *custom_alloc ( void *ud,
     {
         debug(6, "custom_alloc: calling free(%p)\n", ptr);
         free(ptr);
-        debug(7, "custom_alloc: OLD value of used_memory = %d\n", ad->used_memory);
+        if (ptr != NULL)
+            ad->frees++;
+        debug(7, "custom_alloc: OLD value of used_memory = %lld\n", (long long)ad->used_memory);
         ad->used_memory -= osize;    /* substract old size from used memory */
-        debug(7, "custom_alloc: NEW value of used_memory = %d\n", ad->used_memory);
+        debug(7, "custom_alloc: NEW value of used_memory = %lld\n", (long long)ad->used_memory);
         debug(6, "custom_alloc: returning NULL\n");
-
-        pthread_mutex_unlock(&alloc_lock);
         return NULL;
     }
     else
     {
         if (ad->max_memory > 0 &&
-            ad->used_memory + (nsize - osize) > ad->max_memory)
+            ad->used_memory + ((int64_t)nsize - (int64_t)osize) > ad->max_memory)
         {
             /* too much memory in use */
             debug(6, "custom_alloc: TOO MUCH MEMORY ALLOCATED, returning NULL\n");
-            pthread_mutex_unlock(&alloc_lock);
+            ad->refused++;
             return NULL;
         }
-        debug(6, "custom_alloc: calling caml_stat_resize(%p, %d)\n", ptr, nsize);
-        realloc_result = caml_stat_resize(ptr, nsize);
+        debug(6, "custom_alloc: calling realloc(%p, %d)\n", ptr, nsize);
+        realloc_result = realloc(ptr, nsize);
         if (realloc_result)
         {
             /* reallocation successful? */
-            debug(7, "custom_alloc: OLD value of used_memory = %d\n", ad->used_memory);
-            ad->used_memory += (nsize - osize);
-            debug(7, "custom_alloc: NEW value of used_memory = %d\n", ad->used_memory);
+            debug(7, "custom_alloc: OLD value of used_memory = %lld\n", (long long)ad->used_memory);
+            ad->used_memory += ((int64_t)nsize - (int64_t)osize);
+            debug(7, "custom_alloc: NEW value of used_memory = %lld\n", (long long)ad->used_memory);
+            if (ad->used_memory > ad->peak_memory)
+                ad->peak_memory = ad->used_memory;
+            if (ptr == NULL)
+                ad->allocs++;
+            else
+                ad->reallocs++;
+            ad->bytes_allocated += nsize;
+            ad->histogram[size_class(nsize)]++;
         }
         debug(6, "custom_alloc: returning %p\n", realloc_result);
-
-        pthread_mutex_unlock(&alloc_lock);
         return realloc_result;
     }
 }
@@ -113,7 +137,10 @@ static int closure_data_gc(lua_State *L)
     debug(3, "closure_data_gc(%p)\n", (void*)L);
     value *ocaml_closure = (value*)lua_touserdata(L, 1);
     debug(5, "closure_data_gc: ocaml_closure == %p\n", (void*)ocaml_closure);
-    caml_remove_global_root(ocaml_closure);
+    ocaml_data *data = get_ocaml_data(L);
+    int acquired = begin_callback(data);
+    caml_remove_generational_global_root(ocaml_closure);
+    end_callback(data, acquired);
     debug(4, "closure_data_gc: RETURN 0\n");
     return 0;
 }
@@ -123,11 +150,83 @@ static int default_gc(lua_State *L)
     debug(3, "default_gc(%p)\n", (void*)L);
     value *lua_ud = (value*)lua_touserdata(L, 1);
     debug(5, "default_gc: lua_ud == %p\n", (void*)lua_ud);
-    caml_remove_global_root(lua_ud);
+    ocaml_data *data = get_ocaml_data(L);
+    int acquired = begin_callback(data);
+    caml_remove_generational_global_root(lua_ud);
+    end_callback(data, acquired);
     debug(4, "default_gc: RETURN 0\n");
     return 0;
 }
 
+/* Checks that the argument narg is a "buffer" userdata, comparing its
+ * metatable with the one created by create_private_data */
+static lua_buffer *check_buffer(lua_State *L, int narg)
+{
+    lua_buffer *buf = (lua_buffer*)lua_touserdata(L, narg);
+    if (buf != NULL && lua_getmetatable(L, narg))
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, get_ocaml_data(L)->buffer_metatable_ref);
+        int is_buffer = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+        if (is_buffer)
+            return buf;
+    }
+    luaL_typerror(L, narg, "buffer");
+    return NULL;
+}
+
+/* Translates a relative string position: negative means back from the end.
+ * Taken from Lua source (lstrlib.c) */
+static ptrdiff_t buffer_posrelat(ptrdiff_t pos, size_t len)
+{
+    if (pos < 0) pos += (ptrdiff_t)len + 1;
+    return (pos >= 0) ? pos : 0;
+}
+
+/* buf[i] returns the i-th byte of the buffer as a number, nil when out of
+ * range; any other key is looked up in the methods table (upvalue 1) */
+static int buffer_index(lua_State *L)
+{
+    lua_buffer *buf = check_buffer(L, 1);
+    if (lua_type(L, 2) == LUA_TNUMBER)
+    {
+        lua_Integer i = lua_tointeger(L, 2);
+        if (i >= 1 && (size_t)i <= buf->len)
+            lua_pushinteger(L, (unsigned char)buf->data[i - 1]);
+        else
+            lua_pushnil(L);
+    }
+    else
+    {
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(1));
+    }
+    return 1;
+}
+
+static int buffer_len(lua_State *L)
+{
+    lua_buffer *buf = check_buffer(L, 1);
+    lua_pushinteger(L, buf->len);
+    return 1;
+}
+
+/* buf:sub(i [, j]) has the same semantics of string.sub, and it is the only
+ * way to get (a part of) the buffer content as a Lua string */
+static int buffer_sub(lua_State *L)
+{
+    lua_buffer *buf = check_buffer(L, 1);
+    ptrdiff_t start = buffer_posrelat(luaL_optinteger(L, 2, 1), buf->len);
+    ptrdiff_t end = buffer_posrelat(luaL_optinteger(L, 3, -1), buf->len);
+    if (start < 1) start = 1;
+    if (end > (ptrdiff_t)buf->len) end = (ptrdiff_t)buf->len;
+    if (start <= end)
+        lua_pushlstring(L, buf->data + start - 1, end - start + 1);
+    else
+        lua_pushliteral(L, "");
+    return 1;
+}
+
 CAMLprim
 value default_gc__stub(value L)
 {
@@ -149,6 +248,8 @@ static void create_private_data(lua_State *L, ocaml_data* data)
     lua_pushstring(L, "__gc");
     lua_pushcfunction(L, closure_data_gc);
     lua_settable(L, -3);
+    lua_pushvalue(L, -1);
+    data->closure_metatable_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
     lua_pushstring(L, "closure_metatable");
     lua_insert(L, -2);
@@ -156,15 +257,11 @@ static void create_private_data(lua_State *L, ocaml_data* data)
 
     /* Here the stack contains only 1 element, at index -1, the table t */
 
-    lua_pushstring(L, "threads_array");
-    lua_newtable(L);                          /* a table for copies of threads */
-    lua_settable(L, -3);                      /* t["threads_array"] = table_for_threads */
-
-    /* Here the stack contains only 1 element, at index -1, the table t */
-
-    lua_pushstring(L, "light_userdata_array");
-    lua_newtable(L);                          /* a table for copies of all light userdata */
-    lua_settable(L, -3);                      /* t["light_userdata_array"] = table_for_l_ud */
+    lua_pushstring(L, "threads_table");
+    lua_newtable(L);                          /* a table counting the OCaml copies of threads */
+    lua_pushvalue(L, -1);
+    data->threads_table_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_settable(L, -3);                      /* t["threads_table"] = table_for_threads */
 
     /* Here the stack contains only 1 element, at index -1, the table t */
 
@@ -172,12 +269,36 @@ static void create_private_data(lua_State *L, ocaml_data* data)
     lua_pushstring(L, "__gc");
     lua_pushcfunction(L, default_gc);
     lua_settable(L, -3);
+    lua_pushvalue(L, -1);
+    data->userdata_metatable_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     lua_pushstring(L, "userdata_metatable");
     lua_insert(L, -2);
     lua_settable(L, -3);                      /* t["userdata_metatable"] = metatable_for_userdata */
 
     /* Here the stack contains only 1 element, at index -1, the table t */
 
+    lua_newtable(L);                          /* metatable for the buffers pushed by lua_pushbuffer__stub */
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, default_gc);
+    lua_settable(L, -3);
+    lua_pushstring(L, "__len");
+    lua_pushcfunction(L, buffer_len);
+    lua_settable(L, -3);
+    lua_pushstring(L, "__index");
+    lua_newtable(L);                          /* methods of the buffers */
+    lua_pushstring(L, "sub");
+    lua_pushcfunction(L, buffer_sub);
+    lua_settable(L, -3);
+    lua_pushcclosure(L, buffer_index, 1);
+    lua_settable(L, -3);
+    lua_pushvalue(L, -1);
+    data->buffer_metatable_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushstring(L, "buffer_metatable");
+    lua_insert(L, -2);
+    lua_settable(L, -3);                      /* t["buffer_metatable"] = metatable_for_buffers */
+
+    /* Here the stack contains only 1 element, at index -1, the table t */
+
     lua_pushstring(L, UUID);
     lua_insert(L, -2);
     lua_settable(L, LUA_REGISTRYINDEX);       /* registry[UUID] = t */
@@ -189,23 +310,15 @@ static void finalize_lua_State(value L)
 
     lua_State *state = lua_State_val(L);
 
-    push_lud_array(state);
-    int table_pos = lua_gettop(state);
-    lua_pushnil(state);  /* first key */
-    while (lua_next(state, table_pos) != 0)
-    {
-        /* key at -2, value (light userdata) at -1 */
-        value *ocaml_lud_value = (value*)lua_touserdata(state, -1);
-        caml_remove_global_root(ocaml_lud_value);
-        debug(5, "finalize_lua_State: caml_stat_free(%p)\n", (void*)ocaml_lud_value);
-        caml_stat_free(ocaml_lud_value);
-        lua_pop(state, 1);
-    }
-
     ocaml_data *data = get_ocaml_data(state);
+    lud_free_all(data);
+
     lua_close(state);
-    caml_remove_global_root(&(data->panic_callback));
-    caml_remove_global_root(&(data->state_value));
+    free_profiler(data->profiler);
+    caml_remove_generational_global_root(&(data->panic_callback));
+    caml_remove_generational_global_root(&(data->state_value));
+    caml_stat_free(data->pending_threads);
+    caml_stat_free(data->scratch);
     caml_stat_free(data);
     debug(4, "finalize_lua_State: RETURN\n");
 }
@@ -214,6 +327,7 @@ static int default_panic(lua_State *L)
 {
     value *default_panic_v = caml_named_value("default_panic");
     ocaml_data *data = get_ocaml_data(L);
+    begin_callback(data);   /* a panic function never returns to Lua */
     return Int_val(caml_callback(*default_panic_v, data->state_value));
 }
 
@@ -265,9 +379,9 @@ value luaL_checklong__stub(value L, value narg)
 }
 
 CAMLprim
-value luaL_newstate__stub (value max_memory_size, value unit)
+value luaL_newstate__stub (value max_memory_size, value release_runtime, value unit)
 {
-    CAMLparam2(max_memory_size, unit);
+    CAMLparam3(max_memory_size, release_runtime, unit);
     CAMLlocal2(v_L, v_L_mirror);
 
     debug(3, "luaL_newstate__stub: BEGIN\n");
@@ -278,15 +392,37 @@ value luaL_newstate__stub (value max_memory_size, value unit)
     ocaml_data *data = (ocaml_data*)caml_stat_alloc(sizeof(ocaml_data));
 
     /* protect the panic_callback portion and assign with the default value */
-    caml_register_global_root(&(data->panic_callback));
     data->panic_callback = *default_panic_v;
+    caml_register_generational_global_root(&(data->panic_callback));
 
     /* create a fresh new Lua state */
-    int max_memory = Int_val(max_memory_size);
+    int64_t max_memory = Long_val(max_memory_size);
 
     /* init the allocator data */
+    memset(&(data->ad), 0, sizeof(allocator_data));
     data->ad.max_memory = max_memory;
-    data->ad.used_memory = 0;
+
+    /* init the runtime lock management */
+    data->release_runtime = Bool_val(release_runtime);
+    data->runtime_released = 0;
+    data->pending_threads = NULL;
+    data->pending_threads_num = 0;
+    data->pending_threads_size = 0;
+
+    /* no light userdata pushed yet */
+    data->lud_pages = NULL;
+    data->lud_pages_num = 0;
+    data->lud_slots_num = 0;
+    data->lud_free = -1;
+    data->globals_snapshot_ref = LUA_NOREF;
+
+    /* no hook installed */
+    data->profiler = NULL;
+    data->limits.active = 0;
+    data->hook_count = 0;
+
+    data->scratch = NULL;
+    data->scratch_size = 0;
 
     lua_State *L = lua_newstate(custom_alloc, (void*)&(data->ad));
     debug(5, "luaL_newstate__stub: lua_newstate returned %p\n", (void*)L);
@@ -301,8 +437,8 @@ value luaL_newstate__stub (value max_memory_size, value unit)
     /* another value wrapping L for internal purposes */
     v_L_mirror = caml_alloc_custom(&default_lua_State_ops, sizeof(lua_State *), 1, 10);
     lua_State_val(v_L_mirror) = L;
-    caml_register_global_root(&(data->state_value));
     data->state_value = v_L_mirror;
+    caml_register_generational_global_root(&(data->state_value));
 
     /* create a new Lua table for binding informations */
     create_private_data(L, data);
@@ -312,17 +448,83 @@ value luaL_newstate__stub (value max_memory_size, value unit)
     CAMLreturn(v_L);
 }
 
+/* Returns the fields of Lua_aux_lib.memory_stats, in the same order */
+CAMLprim
+value luaL_memory_stats__stub(value L)
+{
+    CAMLparam1(L);
+    CAMLlocal2(ret_val, histogram);
+
+    allocator_data *ad = &(get_ocaml_data(lua_State_val(L))->ad);
+    int i;
+
+    histogram = caml_alloc(MEMORY_SIZE_CLASSES, 0);
+    for (i = 0; i < MEMORY_SIZE_CLASSES; i++)
+        Store_field(histogram, i, Val_long(ad->histogram[i]));
+
+    ret_val = caml_alloc(9, 0);
+    Store_field(ret_val, 0, Val_long(ad->used_memory));
+    Store_field(ret_val, 1, Val_long(ad->peak_memory));
+    Store_field(ret_val, 2, Val_long(ad->max_memory));
+    Store_field(ret_val, 3, Val_long(ad->allocs));
+    Store_field(ret_val, 4, Val_long(ad->frees));
+    Store_field(ret_val, 5, Val_long(ad->reallocs));
+    Store_field(ret_val, 6, Val_long(ad->bytes_allocated));
+    Store_field(ret_val, 7, Val_long(ad->refused));
+    Store_field(ret_val, 8, histogram);
+
+    CAMLreturn(ret_val);
+}
+
+/* Resets the counters; the peak becomes the memory in use */
+CAMLprim
+value luaL_reset_memory_stats__stub(value L)
+{
+    CAMLparam1(L);
+
+    allocator_data *ad = &(get_ocaml_data(lua_State_val(L))->ad);
+
+    ad->peak_memory = ad->used_memory;
+    ad->allocs = 0;
+    ad->frees = 0;
+    ad->reallocs = 0;
+    ad->bytes_allocated = 0;
+    ad->refused = 0;
+    memset(ad->histogram, 0, sizeof(ad->histogram));
+
+    CAMLreturn(Val_unit);
+}
+
 CAMLprim
 value luaL_loadbuffer__stub(value L, value buff, value sz, value name)
 {
   CAMLparam4(L, buff, sz, name);
-  CAMLlocal1(status);
 
-  status = Val_int(luaL_loadbuffer( lua_State_val(L),
-                                    String_val(buff),
-                                    Int_val(sz),
-                                    String_val(name)) );
-  CAMLreturn(status);
+  lua_State *LL = lua_State_val(L);
+  ocaml_data *data = get_ocaml_data(LL);
+  int status;
+
+  if (data->release_runtime)
+  {
+    /* The GC of another thread could move the OCaml strings while the runtime
+       is released, so Lua reads private copies of them */
+    size_t len = Int_val(sz);
+    char *buff_copy = (char*)caml_stat_alloc(len);
+    char *name_copy = caml_stat_strdup(String_val(name));
+    memcpy(buff_copy, String_val(buff), len);
+
+    release_runtime(data);
+    status = luaL_loadbuffer(LL, buff_copy, len, name_copy);
+    acquire_runtime(data);
+    untrack_pending_threads(data);
+
+    caml_stat_free(name_copy);
+    caml_stat_free(buff_copy);
+  }
+  else
+    status = luaL_loadbuffer(LL, String_val(buff), Int_val(sz), String_val(name));
+
+  CAMLreturn(Val_int(status));
 }
 
 
@@ -330,11 +532,131 @@ CAMLprim
 value luaL_loadfile__stub(value L, value filename)
 {
   CAMLparam2(L, filename);
-  CAMLlocal1(status);
 
-  status = Val_int(luaL_loadfile( lua_State_val(L),
-                                  String_val(filename) ));
-  CAMLreturn(status);
+  lua_State *LL = lua_State_val(L);
+  ocaml_data *data = get_ocaml_data(LL);
+  int status;
+
+  if (data->release_runtime)
+  {
+    char *filename_copy = caml_stat_strdup(String_val(filename));
+
+    release_runtime(data);
+    status = luaL_loadfile(LL, filename_copy);
+    acquire_runtime(data);
+    untrack_pending_threads(data);
+
+    caml_stat_free(filename_copy);
+  }
+  else
+    status = luaL_loadfile(LL, String_val(filename));
+
+  CAMLreturn(Val_int(status));
+}
+
+
+CAMLprim
+value luaL_loadbigstring__stub(value L, value ba, value off, value len, value name)
+{
+  CAMLparam5(L, ba, off, len, name);
+
+  lua_State *LL = lua_State_val(L);
+  ocaml_data *data = get_ocaml_data(LL);
+  int status;
+
+  check_slice(Caml_ba_array_val(ba)->dim[0], off, len, "LuaL.loadbigstring");
+  /* the bigarray data is outside the OCaml heap: Lua reads it in place */
+  const char *buff = (char*)Caml_ba_data_val(ba) + Long_val(off);
+
+  if (data->release_runtime)
+  {
+    char *name_copy = caml_stat_strdup(String_val(name));
+
+    release_runtime(data);
+    status = luaL_loadbuffer(LL, buff, Long_val(len), name_copy);
+    acquire_runtime(data);
+    untrack_pending_threads(data);
+
+    caml_stat_free(name_copy);
+  }
+  else
+    status = luaL_loadbuffer(LL, buff, Long_val(len), String_val(name));
+
+  CAMLreturn(Val_int(status));
+}
+
+#define FD_READER_BUFFER_SIZE 65536
+
+typedef struct fd_reader_data
+{
+  int fd;
+  int error;    /* errno of the failed read, 0 if none */
+  char buff[FD_READER_BUFFER_SIZE];
+} fd_reader_data;
+
+static const char *fd_reader(lua_State *L, void *ud, size_t *size)
+{
+  fd_reader_data *rd = (fd_reader_data*)ud;
+  ssize_t n;
+  (void)L;
+
+  do
+    n = read(rd->fd, rd->buff, FD_READER_BUFFER_SIZE);
+  while (n < 0 && errno == EINTR);
+
+  if (n <= 0)
+  {
+    if (n < 0) rd->error = errno;
+    *size = 0;
+    return NULL;
+  }
+  *size = (size_t)n;
+  return rd->buff;
+}
+
+/* Loads a chunk reading it with read(2) from the file descriptor, the result
+ * of a failed read is LUA_ERRFILE, like in luaL_loadfile */
+static int load_fd(lua_State *L, fd_reader_data *rd, const char *chunkname)
+{
+  int status = lua_load(L, fd_reader, rd, chunkname);
+  if (rd->error != 0)
+  {
+    lua_pop(L, 1);  /* remove the result of lua_load */
+    lua_pushfstring(L, "cannot read %s: %s", chunkname, strerror(rd->error));
+    status = LUA_ERRFILE;
+  }
+  return status;
+}
+
+CAMLprim
+value luaL_loadfd__stub(value L, value fd, value name)
+{
+  CAMLparam3(L, fd, name);
+
+  lua_State *LL = lua_State_val(L);
+  ocaml_data *data = get_ocaml_data(LL);
+  int status;
+
+  fd_reader_data *rd = (fd_reader_data*)caml_stat_alloc(sizeof(fd_reader_data));
+  rd->fd = Int_val(fd);
+  rd->error = 0;
+
+  if (data->release_runtime)
+  {
+    char *name_copy = caml_stat_strdup(String_val(name));
+
+    release_runtime(data);
+    status = load_fd(LL, rd, name_copy);
+    acquire_runtime(data);
+    untrack_pending_threads(data);
+
+    caml_stat_free(name_copy);
+  }
+  else
+    status = load_fd(LL, rd, String_val(name));
+
+  caml_stat_free(rd);
+  CAMLreturn(Val_int(status));
 }
 
 
@@ -343,6 +665,8 @@ value luaL_openlibs__stub(value L)
 {
   CAMLparam1(L);
   luaL_openlibs(lua_State_val(L));
+  hook_coroutine_lib(lua_State_val(L));
+  hook_debug_lib(lua_State_val(L));
   CAMLreturn(Val_unit);
 }
 
@@ -405,8 +729,7 @@ value luaL_checkstring__stub(value L, value narg)
   CAMLparam2(L, narg);
   CAMLlocal1(ret_val);
 
-  value_from_lua = luaL_checkstring(lua_State_val(L), Int_val(narg));
-  len = strlen(value_from_lua);
+  value_from_lua = luaL_checklstring(lua_State_val(L), Int_val(narg), &len);
   ret_val = caml_alloc_string(len);
   char *s = String_val(ret_val);
   memcpy(s, value_from_lua, len);
@@ -479,3 +802,1052 @@ value luaL_findtable__stub(value L, value idx, value fname, value szhint)
 STUB_STATE_INT_INT_VOID(luaL_unref, t, ref)
 
 STUB_STATE_INT_VOID(luaL_where, lvl)
+
+
+/******************************************************************************/
+/*****                          GLOBALS SNAPSHOT                          *****/
+/******************************************************************************/
+/* Support for LuaL.Pool: luaL_save_globals__stub takes a snapshot of the
+ * global environment, luaL_reset_state__stub brings the state back to it.
+ * The snapshot is a table with:
+ *   [1] a copy of the globals table
+ *   [2] a table mapping every table found in the globals (the libraries) to a
+ *       copy of its content
+ *   [3] the metatable of the globals table, if any
+ * Deeper tables are not copied: a script modifying them leaks the changes to
+ * the next user of the state. */
+
+/* Pushes a shallow copy of the table at index t */
+static void copy_table(lua_State *L, int t)
+{
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, t) != 0)
+    {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -4);                    /* copy[k] = v */
+    }
+}
+
+/* Makes the table at index t equal to the copy at index copy */
+static void restore_table(lua_State *L, int t, int copy)
+{
+    /* clearing existing fields during a traversal is allowed */
+    lua_pushnil(L);
+    while (lua_next(L, t) != 0)
+    {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, copy);
+        int in_copy = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (!in_copy)
+        {
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, t);                 /* t[k] = nil */
+        }
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, copy) != 0)
+    {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, t);                     /* t[k] = copy[k] */
+    }
+}
+
+CAMLprim
+value luaL_save_globals__stub(value L)
+{
+    CAMLparam1(L);
+
+    lua_State *LL = lua_State_val(L);
+    ocaml_data *data = get_ocaml_data(LL);
+    int top = lua_gettop(LL);
+
+    luaL_checkstack(LL, 8, "luaL_save_globals");
+    lua_createtable(LL, 3, 0);                /* the snapshot s */
+    int snapshot = lua_gettop(LL);
+
+    copy_table(LL, LUA_GLOBALSINDEX);
+    lua_rawseti(LL, snapshot, 1);             /* s[1] = copy of globals */
+
+    lua_newtable(LL);
+    int libs = lua_gettop(LL);
+    lua_pushnil(LL);
+    while (lua_next(LL, LUA_GLOBALSINDEX) != 0)
+    {
+        if (lua_istable(LL, -1))
+        {
+            int lib = lua_gettop(LL);
+            lua_pushvalue(LL, lib);
+            copy_table(LL, lib);
+            lua_rawset(LL, libs);             /* libs[lib] = copy of lib */
+        }
+        lua_pop(LL, 1);
+    }
+    lua_rawseti(LL, snapshot, 2);             /* s[2] = libs */
+
+    if (lua_getmetatable(LL, LUA_GLOBALSINDEX))
+        lua_rawseti(LL, snapshot, 3);         /* s[3] = metatable of globals */
+
+    luaL_unref(LL, LUA_REGISTRYINDEX, data->globals_snapshot_ref);
+    data->globals_snapshot_ref = luaL_ref(LL, LUA_REGISTRYINDEX);
+
+    lua_settop(LL, top);
+    CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value luaL_reset_state__stub(value L)
+{
+    CAMLparam1(L);
+
+    lua_State *LL = lua_State_val(L);
+    ocaml_data *data = get_ocaml_data(LL);
+
+    if (data->globals_snapshot_ref == LUA_NOREF)
+        caml_invalid_argument("LuaL.Pool.checkin: the state has no snapshot");
+
+    lua_settop(LL, 0);
+    luaL_checkstack(LL, 8, "luaL_reset_state");
+    lua_rawgeti(LL, LUA_REGISTRYINDEX, data->globals_snapshot_ref);
+
+    lua_rawgeti(LL, 1, 1);
+    restore_table(LL, LUA_GLOBALSINDEX, 2);
+    lua_pop(LL, 1);
+
+    lua_rawgeti(LL, 1, 2);
+    lua_pushnil(LL);
+    while (lua_next(LL, 2) != 0)              /* lib at 3, its copy at 4 */
+    {
+        restore_table(LL, 3, 4);
+        lua_pop(LL, 1);
+    }
+    lua_pop(LL, 1);
+
+    lua_rawgeti(LL, 1, 3);
+    lua_setmetatable(LL, LUA_GLOBALSINDEX);
+
+    lua_settop(LL, 0);
+
+    /* default GC parameters, and collect the garbage of the last user */
+    lua_gc(LL, LUA_GCRESTART, 0);
+    lua_gc(LL, LUA_GCSETPAUSE, LUAI_GCPAUSE);
+    lua_gc(LL, LUA_GCSETSTEPMUL, LUAI_GCMUL);
+    lua_gc(LL, LUA_GCCOLLECT, 0);
+
+    CAMLreturn(Val_unit);
+}
+
+/******************************************************************************/
+/*****                             STATE FORK                             *****/
+/******************************************************************************/
+/* luaL_copy_state__stub creates a new state and deep copies into it the
+ * globals, the registry and the metatables of the basic types of another
+ * state. A memo table in the source state maps every copied object to an
+ * integer id, and a memo table in the destination state maps the id to the
+ * copy, to preserve sharing and cycles. The private objects of the binding
+ * (created in the same order by create_private_data, hence with the same
+ * references in both states) are mapped to their counterparts and not copied.
+ *
+ * Lua functions are copied with dump_function and luaL_loadbuffer, then their
+ * upvalues and environment are copied. C functions are recreated with copies
+ * of their upvalues, and the OCaml values held by the binding userdata and
+ * light userdata get a new global root in the destination state. Userdata
+ * created by C libraries are copied byte by byte. Threads can't be copied.
+ *
+ * The copy allocates in both states, hence it runs in a lua_cpcall of the
+ * destination state, itself run by a lua_cpcall of the source state: a memory
+ * error in either state stops the copy, the source state is restored and the
+ * destination state is thrown away. */
+
+typedef struct fork_ctx
+{
+    lua_State *src;
+    lua_State *dst;
+    ocaml_data *src_data;
+    ocaml_data *dst_data;
+    int src_memo;                             /* object -> id, in src */
+    int dst_memo;                             /* id -> copy, in dst */
+    int next_id;
+    const char *error;
+    int ok;
+} fork_ctx;
+
+static int fork_fail(fork_ctx *c, const char *error)
+{
+    if (c->error == NULL)
+        c->error = error;
+    return 0;
+}
+
+/* If the value at index idx of src has already been copied, pushes its copy
+ * onto dst and returns 1. Returns -1 if the copy is still in progress. */
+static int fork_memo_lookup(fork_ctx *c, int idx)
+{
+    lua_pushvalue(c->src, idx);
+    lua_rawget(c->src, c->src_memo);
+    if (lua_isnil(c->src, -1))
+    {
+        lua_pop(c->src, 1);
+        return 0;
+    }
+    int id = lua_tointeger(c->src, -1);
+    lua_pop(c->src, 1);
+    lua_rawgeti(c->dst, c->dst_memo, id);
+    if (lua_isnil(c->dst, -1))
+    {
+        lua_pop(c->dst, 1);
+        return -1;
+    }
+    return 1;
+}
+
+/* Reserves an id for the value at index idx of src */
+static int fork_memo_reserve(fork_ctx *c, int idx)
+{
+    int id = ++(c->next_id);
+    lua_pushvalue(c->src, idx);
+    lua_pushinteger(c->src, id);
+    lua_rawset(c->src, c->src_memo);
+    return id;
+}
+
+/* The value at the top of dst is the copy of the value with the given id */
+static void fork_memo_set(fork_ctx *c, int id)
+{
+    lua_pushvalue(c->dst, -1);
+    lua_rawseti(c->dst, c->dst_memo, id);
+}
+
+/* Maps the value at the top of src to the value at the top of dst, and pops
+ * both */
+static void fork_memo_seed(fork_ctx *c)
+{
+    int id = fork_memo_reserve(c, lua_gettop(c->src));
+    fork_memo_set(c, id);
+    lua_pop(c->src, 1);
+    lua_pop(c->dst, 1);
+}
+
+static int fork_copy_value(fork_ctx *c, int idx);
+
+/* Copies all the pairs of the table at index src_t of src into the table at
+ * index dst_t of dst. Both indices must be absolute (or pseudo-indices). */
+static int fork_copy_pairs(fork_ctx *c, int src_t, int dst_t)
+{
+    lua_pushnil(c->src);
+    while (lua_next(c->src, src_t) != 0)
+    {
+        int top = lua_gettop(c->src);
+        if (!fork_copy_value(c, top - 1) || !fork_copy_value(c, top))
+        {
+            lua_pop(c->src, 2);
+            return 0;
+        }
+        lua_rawset(c->dst, dst_t);
+        lua_pop(c->src, 1);
+    }
+    return 1;
+}
+
+/* Copies the metatable of the value at index idx of src to the value at the
+ * top of dst */
+static int fork_copy_metatable(fork_ctx *c, int idx)
+{
+    if (lua_getmetatable(c->src, idx))
+    {
+        int ok = fork_copy_value(c, lua_gettop(c->src));
+        lua_pop(c->src, 1);
+        if (!ok)
+            return 0;
+        lua_setmetatable(c->dst, -2);
+    }
+    return 1;
+}
+
+/* Copies the environment of the function or userdata at index idx of src to
+ * the value at the top of dst */
+static int fork_copy_env(fork_ctx *c, int idx)
+{
+    lua_getfenv(c->src, idx);
+    if (lua_istable(c->src, -1))
+    {
+        int ok = fork_copy_value(c, lua_gettop(c->src));
+        lua_pop(c->src, 1);
+        if (!ok)
+            return 0;
+        lua_setfenv(c->dst, -2);
+    }
+    else
+        lua_pop(c->src, 1);
+    return 1;
+}
+
+static int fork_copy_lightuserdata(fork_ctx *c, int idx)
+{
+    void *p = lua_touserdata(c->src, idx);
+    value *v = lud_resolve(c->src_data, p);
+
+    if (v == NULL)
+    {
+        /* a pointer unknown to the binding or a released value: copied as it
+         * is, it is not resolved by the slots of dst either */
+        lua_pushlightuserdata(c->dst, p);
+        return 1;
+    }
+
+    int id = fork_memo_reserve(c, idx);
+    lua_pushlightuserdata(c->dst, lud_new(c->dst_data, *v));
+    fork_memo_set(c, id);
+    return 1;
+}
+
+/* Returns the registry reference of the binding metatable of the userdata at
+ * index idx of src, or LUA_NOREF if it is not a userdata of the binding */
+static int fork_userdata_kind(fork_ctx *c, int idx)
+{
+    int refs[3];
+    int i, kind = LUA_NOREF;
+
+    if (!lua_getmetatable(c->src, idx))
+        return LUA_NOREF;
+
+    refs[0] = c->src_data->userdata_metatable_ref;
+    refs[1] = c->src_data->closure_metatable_ref;
+    refs[2] = c->src_data->buffer_metatable_ref;
+    for (i = 0; i < 3 && kind == LUA_NOREF; i++)
+    {
+        lua_rawgeti(c->src, LUA_REGISTRYINDEX, refs[i]);
+        if (lua_rawequal(c->src, -1, -2))
+            kind = refs[i];
+        lua_pop(c->src, 1);
+    }
+    lua_pop(c->src, 1);
+    return kind;
+}
+
+/* Returns true if the userdata at index idx of src, not owned by the binding,
+ * can be copied byte by byte: either it has no metatable, hence no "__gc"
+ * releasing a resource, or it is a standard file of the io library (or a
+ * closed file), that is never closed by its "__gc" */
+static int fork_userdata_is_plain(fork_ctx *c, int idx)
+{
+    if (!lua_getmetatable(c->src, idx))
+        return 1;
+
+    luaL_getmetatable(c->src, LUA_FILEHANDLE);
+    int is_file = lua_rawequal(c->src, -1, -2);
+    lua_pop(c->src, 2);
+    if (!is_file)
+        return 0;
+
+    FILE *f = *((FILE**)lua_touserdata(c->src, idx));
+    return f == NULL || f == stdin || f == stdout || f == stderr;
+}
+
+static int fork_copy_userdata(fork_ctx *c, int idx)
+{
+    int kind = fork_userdata_kind(c, idx);
+    if (kind == LUA_NOREF && !fork_userdata_is_plain(c, idx))
+        return fork_fail(c, "cannot copy a userdata owning a resource (created by a C library)");
+    int id = fork_memo_reserve(c, idx);
+    void *src_ud = lua_touserdata(c->src, idx);
+
+    if (kind == c->src_data->buffer_metatable_ref)
+    {
+        lua_buffer *buf = (lua_buffer*)lua_newuserdata(c->dst, sizeof(lua_buffer));
+        *buf = *((lua_buffer*)src_ud);
+        caml_register_generational_global_root(&(buf->bigarray));
+    }
+    else if (kind != LUA_NOREF)
+    {
+        value *ud = (value*)lua_newuserdata(c->dst, sizeof(value));
+        *ud = *((value*)src_ud);
+        caml_register_generational_global_root(ud);
+    }
+    else
+    {
+        size_t size = lua_objlen(c->src, idx);
+        void *ud = lua_newuserdata(c->dst, size);
+        memcpy(ud, src_ud, size);
+    }
+    fork_memo_set(c, id);
+
+    if (kind != LUA_NOREF)
+    {
+        /* the references of the binding are the same in both states */
+        lua_rawgeti(c->dst, LUA_REGISTRYINDEX, kind);
+        lua_setmetatable(c->dst, -2);
+        return 1;
+    }
+    return fork_copy_metatable(c, idx) && fork_copy_env(c, idx);
+}
+
+static int fork_copy_function(fork_ctx *c, int idx)
+{
+    int i, id;
+    const char *name;
+
+    if (lua_iscfunction(c->src, idx))
+    {
+        /* the closure is created after its upvalues: a cycle through the
+         * upvalues of a C function is detected by fork_memo_lookup */
+        id = fork_memo_reserve(c, idx);
+        lua_CFunction f = lua_tocfunction(c->src, idx);
+        for (i = 1; lua_getupvalue(c->src, idx, i) != NULL; i++)
+        {
+            int ok = lua_checkstack(c->dst, 4) &&
+                     fork_copy_value(c, lua_gettop(c->src));
+            lua_pop(c->src, 1);
+            if (!ok)
+                return fork_fail(c, "too many upvalues");
+        }
+        lua_pushcclosure(c->dst, f, i - 1);
+        fork_memo_set(c, id);
+        return fork_copy_env(c, idx);
+    }
+
+    id = fork_memo_reserve(c, idx);
+    dump_buffer buf = { NULL, 0, 0 };
+    lua_pushvalue(c->src, idx);
+    int status = dump_function(c->src, dump_buffer_writer, &buf, 0);
+    lua_pop(c->src, 1);
+    if (status == 0)
+        status = luaL_loadbuffer(c->dst, buf.data, buf.len, "=fork");
+    free(buf.data);
+    if (status != 0)
+        return fork_fail(c, "cannot copy a Lua function");
+    fork_memo_set(c, id);
+
+    int f = lua_gettop(c->dst);
+    for (i = 1; (name = lua_getupvalue(c->src, idx, i)) != NULL; i++)
+    {
+        int ok = fork_copy_value(c, lua_gettop(c->src));
+        lua_pop(c->src, 1);
+        if (!ok)
+            return 0;
+        lua_setupvalue(c->dst, f, i);
+    }
+    return fork_copy_env(c, idx);
+}
+
+/* Pushes onto dst a copy of the value at the absolute index idx of src */
+static int fork_copy_value(fork_ctx *c, int idx)
+{
+    if (!lua_checkstack(c->src, 8) || !lua_checkstack(c->dst, 8))
+        return fork_fail(c, "too many nested values");
+
+    switch (lua_type(c->src, idx))
+    {
+        case LUA_TNIL:
+            lua_pushnil(c->dst);
+            return 1;
+
+        case LUA_TBOOLEAN:
+            lua_pushboolean(c->dst, lua_toboolean(c->src, idx));
+            return 1;
+
+        case LUA_TNUMBER:
+            lua_pushnumber(c->dst, lua_tonumber(c->src, idx));
+            return 1;
+
+        case LUA_TSTRING:
+        {
+            size_t len;
+            const char *s = lua_tolstring(c->src, idx, &len);
+            lua_pushlstring(c->dst, s, len);
+            return 1;
+        }
+
+        case LUA_TTHREAD:
+            return fork_fail(c, "cannot copy a thread");
+
+        default:
+            break;
+    }
+
+    switch (fork_memo_lookup(c, idx))
+    {
+        case 1:
+            return 1;
+        case -1:
+            return fork_fail(c, "cannot copy a cycle through the upvalues of a C function");
+        default:
+            break;
+    }
+
+    switch (lua_type(c->src, idx))
+    {
+        case LUA_TLIGHTUSERDATA:
+            return fork_copy_lightuserdata(c, idx);
+
+        case LUA_TUSERDATA:
+            return fork_copy_userdata(c, idx);
+
+        case LUA_TFUNCTION:
+            return fork_copy_function(c, idx);
+
+        case LUA_TTABLE:
+        {
+            int id = fork_memo_reserve(c, idx);
+            lua_createtable(c->dst, lua_objlen(c->src, idx), 0);
+            fork_memo_set(c, id);
+            return fork_copy_pairs(c, idx, lua_gettop(c->dst)) &&
+                   fork_copy_metatable(c, idx);
+        }
+    }
+    return fork_fail(c, "unknown type");
+}
+
+/* Pushes onto both states the same object of the binding, given its
+ * reference, and maps one to the other */
+static void fork_seed_ref(fork_ctx *c, int ref)
+{
+    lua_rawgeti(c->src, LUA_REGISTRYINDEX, ref);
+    lua_rawgeti(c->dst, LUA_REGISTRYINDEX, ref);
+    fork_memo_seed(c);
+}
+
+static int fork_is_binding_key(fork_ctx *c, int idx)
+{
+    if (lua_type(c->src, idx) == LUA_TSTRING)
+        return strcmp(lua_tostring(c->src, idx), UUID) == 0;
+
+    if (lua_type(c->src, idx) == LUA_TNUMBER)
+    {
+        lua_Integer ref = lua_tointeger(c->src, idx);
+        return ref == c->src_data->closure_metatable_ref ||
+               ref == c->src_data->userdata_metatable_ref ||
+               ref == c->src_data->threads_table_ref ||
+               ref == c->src_data->buffer_metatable_ref ||
+               ref == c->src_data->globals_snapshot_ref;
+    }
+    return 0;
+}
+
+static int fork_copy_registry(fork_ctx *c)
+{
+    lua_pushnil(c->src);
+    while (lua_next(c->src, LUA_REGISTRYINDEX) != 0)
+    {
+        int top = lua_gettop(c->src);
+        if (!fork_is_binding_key(c, top - 1))
+        {
+            if (!fork_copy_value(c, top - 1) || !fork_copy_value(c, top))
+            {
+                lua_pop(c->src, 2);
+                return 0;
+            }
+            lua_rawset(c->dst, LUA_REGISTRYINDEX);
+        }
+        lua_pop(c->src, 1);
+    }
+    return 1;
+}
+
+/* The metatables of the basic types are shared by all the values of the type:
+ * a sample value is used to read and write them */
+static void fork_push_sample(lua_State *L, int type)
+{
+    switch (type)
+    {
+        case LUA_TBOOLEAN:       lua_pushboolean(L, 0); break;
+        case LUA_TLIGHTUSERDATA: lua_pushlightuserdata(L, NULL); break;
+        case LUA_TNUMBER:        lua_pushnumber(L, 0); break;
+        case LUA_TSTRING:        lua_pushliteral(L, ""); break;
+        case LUA_TFUNCTION:      lua_pushcfunction(L, default_gc); break;
+        case LUA_TTHREAD:        lua_pushthread(L); break;
+        default:                 lua_pushnil(L); break;
+    }
+}
+
+static int fork_copy_type_metatables(fork_ctx *c)
+{
+    static const int types[] = { LUA_TNIL, LUA_TBOOLEAN, LUA_TLIGHTUSERDATA,
+                                 LUA_TNUMBER, LUA_TSTRING, LUA_TFUNCTION,
+                                 LUA_TTHREAD };
+    size_t i;
+
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        int ok;
+        fork_push_sample(c->src, types[i]);
+        fork_push_sample(c->dst, types[i]);
+        ok = fork_copy_metatable(c, lua_gettop(c->src));
+        lua_pop(c->src, 1);
+        lua_pop(c->dst, 1);
+        if (!ok)
+            return 0;
+    }
+    return 1;
+}
+
+/* Runs in a lua_cpcall of dst: the memo tables are left on the stacks of
+ * both states, and dropped when the calls return */
+static int fork_state_dst(lua_State *dst)
+{
+    fork_ctx *c = (fork_ctx*)lua_touserdata(dst, 1);
+    lua_State *src = c->src;
+
+    if (!lua_checkstack(src, 16) || !lua_checkstack(dst, 16))
+        return fork_fail(c, "too many nested values");
+
+    lua_newtable(src);
+    c->src_memo = lua_gettop(src);
+    lua_newtable(dst);
+    c->dst_memo = lua_gettop(dst);
+
+    /* the objects that are not copied, but mapped to their counterparts */
+    lua_pushvalue(src, LUA_REGISTRYINDEX);
+    lua_pushvalue(dst, LUA_REGISTRYINDEX);
+    fork_memo_seed(c);
+    lua_pushvalue(src, LUA_GLOBALSINDEX);
+    lua_pushvalue(dst, LUA_GLOBALSINDEX);
+    fork_memo_seed(c);
+    lua_getfield(src, LUA_REGISTRYINDEX, UUID);
+    lua_getfield(dst, LUA_REGISTRYINDEX, UUID);
+    fork_memo_seed(c);
+    fork_seed_ref(c, c->src_data->closure_metatable_ref);
+    fork_seed_ref(c, c->src_data->userdata_metatable_ref);
+    fork_seed_ref(c, c->src_data->threads_table_ref);
+    fork_seed_ref(c, c->src_data->buffer_metatable_ref);
+
+    c->ok = fork_copy_registry(c) &&
+            fork_copy_pairs(c, LUA_GLOBALSINDEX, LUA_GLOBALSINDEX) &&
+            fork_copy_type_metatables(c);
+
+    if (c->ok)
+    {
+        lua_pushvalue(src, LUA_GLOBALSINDEX);
+        lua_pushvalue(dst, LUA_GLOBALSINDEX);
+        c->ok = fork_copy_metatable(c, lua_gettop(src));
+    }
+    return 0;
+}
+
+/* Runs in a lua_cpcall of src */
+static int fork_state_src(lua_State *src)
+{
+    fork_ctx *c = (fork_ctx*)lua_touserdata(src, 1);
+    int status = lua_cpcall(c->dst, fork_state_dst, c);
+    if (status != 0)
+    {
+        c->ok = 0;
+        fork_fail(c, status == LUA_ERRMEM ? "not enough memory" : "cannot copy the state");
+    }
+    return 0;
+}
+
+CAMLprim
+value luaL_copy_state__stub(value L)
+{
+    CAMLparam1(L);
+    CAMLlocal1(v_dst);
+
+    lua_State *src = lua_State_val(L);
+    ocaml_data *src_data = get_ocaml_data(src);
+
+    v_dst = luaL_newstate__stub( Val_long(src_data->ad.max_memory),
+                                 Val_bool(src_data->release_runtime),
+                                 Val_unit );
+    lua_State *dst = lua_State_val(v_dst);
+    ocaml_data *dst_data = get_ocaml_data(dst);
+    caml_modify_generational_global_root( &(dst_data->panic_callback),
+                                          src_data->panic_callback );
+
+    int src_top = lua_gettop(src);
+
+    fork_ctx c;
+    c.src = src;
+    c.dst = dst;
+    c.src_data = src_data;
+    c.dst_data = dst_data;
+    c.next_id = 0;
+    c.error = NULL;
+    c.ok = 0;
+
+    int status = lua_cpcall(src, fork_state_src, &c);
+    lua_settop(src, src_top);
+    if (status != 0)
+    {
+        /* the error jumped over the lua_cpcall of dst, which can't be used
+         * anymore: only lua_close, in its finalizer, resets it */
+        c.ok = 0;
+        fork_fail(&c, status == LUA_ERRMEM ? "not enough memory" : "cannot copy the state");
+    }
+    else
+        lua_settop(dst, 0);
+
+    /* the new state is closed by its finalizer */
+    if (!c.ok)
+        caml_failwith(c.error);
+
+    CAMLreturn(v_dst);
+}
+
+/******************************************************************************/
+/*****                         SHARED CHUNK CACHE                         *****/
+/******************************************************************************/
+/* Process-wide cache of the chunks loaded with luaL_loadbuffer_cached__stub:
+ * the key is the source code together with the chunkname, the value is the
+ * binary chunk produced by dump_function, so that a hit costs an undump
+ * instead of a full parse. Prototypes can't be shared, because they are
+ * collectable objects of the state that created them.
+ *
+ * The entries are both in a hash table and in a doubly-linked LRU list, all
+ * protected by chunk_cache_lock. The memory is allocated with malloc, and the
+ * OCaml runtime is never used while the lock is held. */
+
+typedef struct chunk_cache_entry
+{
+    uint64_t hash;
+    char *source;
+    size_t source_len;
+    char *name;
+    char *chunk;
+    size_t chunk_len;
+    size_t size;                              /* accounted bytes */
+    struct chunk_cache_entry *bucket_next;
+    struct chunk_cache_entry *lru_prev;       /* toward the most recently used */
+    struct chunk_cache_entry *lru_next;
+} chunk_cache_entry;
+
+typedef struct chunk_cache
+{
+    chunk_cache_entry **buckets;
+    size_t buckets_num;
+    chunk_cache_entry *lru_head;              /* most recently used */
+    chunk_cache_entry *lru_tail;              /* least recently used */
+    size_t entries;
+    size_t bytes;
+    size_t max_entries;
+    size_t max_bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} chunk_cache;
+
+#define CHUNK_CACHE_DEFAULT_MAX_ENTRIES 1024
+#define CHUNK_CACHE_DEFAULT_MAX_BYTES   (64 * 1024 * 1024)
+#define CHUNK_CACHE_MIN_BUCKETS         256
+
+static pthread_mutex_t chunk_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static chunk_cache cache =
+{
+    NULL, 0, NULL, NULL, 0, 0,
+    CHUNK_CACHE_DEFAULT_MAX_ENTRIES, CHUNK_CACHE_DEFAULT_MAX_BYTES,
+    0, 0, 0
+};
+
+/* FNV-1a 64 bit of the source followed by the chunkname */
+static uint64_t chunk_cache_hash(const char *source, size_t len, const char *name)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)source[i];
+        h *= 1099511628211ULL;
+    }
+    for (; *name != '\0'; name++)
+    {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static chunk_cache_entry *chunk_cache_find( uint64_t hash, const char *source,
+                                            size_t len, const char *name )
+{
+    chunk_cache_entry *e;
+
+    if (cache.buckets == NULL)
+        return NULL;
+
+    for (e = cache.buckets[hash % cache.buckets_num]; e != NULL; e = e->bucket_next)
+        if (e->hash == hash && e->source_len == len &&
+            strcmp(e->name, name) == 0 && memcmp(e->source, source, len) == 0)
+            return e;
+
+    return NULL;
+}
+
+static void chunk_cache_lru_unlink(chunk_cache_entry *e)
+{
+    if (e->lru_prev != NULL) e->lru_prev->lru_next = e->lru_next;
+    else cache.lru_head = e->lru_next;
+    if (e->lru_next != NULL) e->lru_next->lru_prev = e->lru_prev;
+    else cache.lru_tail = e->lru_prev;
+}
+
+static void chunk_cache_lru_push_front(chunk_cache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = cache.lru_head;
+    if (cache.lru_head != NULL) cache.lru_head->lru_prev = e;
+    cache.lru_head = e;
+    if (cache.lru_tail == NULL) cache.lru_tail = e;
+}
+
+static void chunk_cache_free_entry(chunk_cache_entry *e)
+{
+    free(e->source);
+    free(e->name);
+    free(e->chunk);
+    free(e);
+}
+
+static void chunk_cache_remove(chunk_cache_entry *e)
+{
+    chunk_cache_entry **p = &(cache.buckets[e->hash % cache.buckets_num]);
+
+    while (*p != e)
+        p = &((*p)->bucket_next);
+    *p = e->bucket_next;
+
+    chunk_cache_lru_unlink(e);
+    cache.entries--;
+    cache.bytes -= e->size;
+    chunk_cache_free_entry(e);
+}
+
+/* Removes the least recently used entries until the cache fits its limits */
+static void chunk_cache_evict(void)
+{
+    while ( cache.lru_tail != NULL &&
+            (cache.entries > cache.max_entries || cache.bytes > cache.max_bytes) )
+    {
+        chunk_cache_remove(cache.lru_tail);
+        cache.evictions++;
+    }
+}
+
+/* Doubles the number of buckets when the average chain is longer than 2. If
+ * the allocation fails the table keeps working with longer chains. */
+static void chunk_cache_grow(void)
+{
+    size_t new_num, i;
+    chunk_cache_entry **new_buckets;
+
+    if (cache.buckets != NULL && cache.entries < 2 * cache.buckets_num)
+        return;
+
+    new_num = (cache.buckets == NULL) ? CHUNK_CACHE_MIN_BUCKETS : 2 * cache.buckets_num;
+    new_buckets = (chunk_cache_entry**)calloc(new_num, sizeof(chunk_cache_entry*));
+    if (new_buckets == NULL)
+        return;
+
+    for (i = 0; i < cache.buckets_num; i++)
+    {
+        chunk_cache_entry *e = cache.buckets[i];
+        while (e != NULL)
+        {
+            chunk_cache_entry *next = e->bucket_next;
+            e->bucket_next = new_buckets[e->hash % new_num];
+            new_buckets[e->hash % new_num] = e;
+            e = next;
+        }
+    }
+    free(cache.buckets);
+    cache.buckets = new_buckets;
+    cache.buckets_num = new_num;
+}
+
+/* Adds a new entry, taking the ownership of source and chunk. Returns 0 if
+ * the entry has not been added (and source and chunk must be freed). */
+static int chunk_cache_add( uint64_t hash, char *source, size_t len,
+                            const char *name, char *chunk, size_t chunk_len )
+{
+    size_t name_len = strlen(name);
+    size_t size = sizeof(chunk_cache_entry) + len + name_len + 1 + chunk_len;
+
+    if (size > cache.max_bytes || cache.max_entries == 0)
+        return 0;
+    /* another thread could have loaded the same chunk in the meantime */
+    if (chunk_cache_find(hash, source, len, name) != NULL)
+        return 0;
+
+    chunk_cache_grow();
+    if (cache.buckets == NULL)
+        return 0;
+
+    chunk_cache_entry *e = (chunk_cache_entry*)malloc(sizeof(chunk_cache_entry));
+    char *name_copy = (char*)malloc(name_len + 1);
+    if (e == NULL || name_copy == NULL)
+    {
+        free(e);
+        free(name_copy);
+        return 0;
+    }
+    memcpy(name_copy, name, name_len + 1);
+
+    e->hash = hash;
+    e->source = source;
+    e->source_len = len;
+    e->name = name_copy;
+    e->chunk = chunk;
+    e->chunk_len = chunk_len;
+    e->size = size;
+    e->bucket_next = cache.buckets[hash % cache.buckets_num];
+    cache.buckets[hash % cache.buckets_num] = e;
+    chunk_cache_lru_push_front(e);
+    cache.entries++;
+    cache.bytes += size;
+
+    chunk_cache_evict();
+    return 1;
+}
+
+/* luaL_loadbuffer on memory outside the OCaml heap, releasing the runtime if
+ * requested by the state */
+static int load_chunk( lua_State *L, ocaml_data *data, const char *buff,
+                       size_t len, const char *name )
+{
+    int status;
+
+    if (data->release_runtime)
+    {
+        release_runtime(data);
+        status = luaL_loadbuffer(L, buff, len, name);
+        acquire_runtime(data);
+        untrack_pending_threads(data);
+    }
+    else
+        status = luaL_loadbuffer(L, buff, len, name);
+
+    return status;
+}
+
+CAMLprim
+value luaL_loadbuffer_cached__stub(value L, value buff, value name)
+{
+  CAMLparam3(L, buff, name);
+
+  lua_State *LL = lua_State_val(L);
+  ocaml_data *data = get_ocaml_data(LL);
+  size_t len = caml_string_length(buff);
+  uint64_t hash = chunk_cache_hash(String_val(buff), len, String_val(name));
+  chunk_cache_entry *e;
+  char *chunk = NULL;
+  size_t chunk_len = 0;
+  int status;
+
+  pthread_mutex_lock(&chunk_cache_lock);
+  e = chunk_cache_find(hash, String_val(buff), len, String_val(name));
+  if (e != NULL)
+  {
+    /* a private copy, the entry could be evicted while Lua reads it */
+    chunk = (char*)malloc(e->chunk_len);
+    if (chunk != NULL)
+    {
+      memcpy(chunk, e->chunk, e->chunk_len);
+      chunk_len = e->chunk_len;
+      chunk_cache_lru_unlink(e);
+      chunk_cache_lru_push_front(e);
+      cache.hits++;
+    }
+  }
+  if (chunk == NULL)
+    cache.misses++;
+  pthread_mutex_unlock(&chunk_cache_lock);
+
+  char *name_copy = caml_stat_strdup(String_val(name));
+
+  if (chunk != NULL)
+  {
+    debug(5, "luaL_loadbuffer_cached__stub: cache hit for \"%s\"\n", name_copy);
+    status = load_chunk(LL, data, chunk, chunk_len, name_copy);
+    free(chunk);
+  }
+  else
+  {
+    debug(5, "luaL_loadbuffer_cached__stub: cache miss for \"%s\"\n", name_copy);
+    char *source = (char*)malloc(len > 0 ? len : 1);
+    if (source == NULL)
+    {
+      caml_stat_free(name_copy);
+      caml_raise_out_of_memory();
+    }
+    memcpy(source, String_val(buff), len);
+
+    status = load_chunk(LL, data, source, len, name_copy);
+
+    dump_buffer buf = { NULL, 0, 0 };
+    int added = 0;
+    if (status == 0 && dump_function(LL, dump_buffer_writer, &buf, 0) == 0)
+    {
+      pthread_mutex_lock(&chunk_cache_lock);
+      added = chunk_cache_add(hash, source, len, name_copy, buf.data, buf.len);
+      pthread_mutex_unlock(&chunk_cache_lock);
+    }
+    if (!added)
+    {
+      free(source);
+      free(buf.data);
+    }
+  }
+
+  caml_stat_free(name_copy);
+  CAMLreturn(Val_int(status));
+}
+
+CAMLprim
+value luaL_chunk_cache_stats__stub(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(ret_val);
+  chunk_cache c;
+
+  pthread_mutex_lock(&chunk_cache_lock);
+  c = cache;
+  pthread_mutex_unlock(&chunk_cache_lock);
+
+  ret_val = caml_alloc_tuple(7);
+  Store_field(ret_val, 0, Val_long(c.hits));
+  Store_field(ret_val, 1, Val_long(c.misses));
+  Store_field(ret_val, 2, Val_long(c.evictions));
+  Store_field(ret_val, 3, Val_long(c.entries));
+  Store_field(ret_val, 4, Val_long(c.bytes));
+  Store_field(ret_val, 5, Val_long(c.max_entries));
+  Store_field(ret_val, 6, Val_long(c.max_bytes));
+
+  CAMLreturn(ret_val);
+}
+
+CAMLprim
+value luaL_chunk_cache_set_limits__stub(value max_entries, value max_bytes)
+{
+  CAMLparam2(max_entries, max_bytes);
+
+  pthread_mutex_lock(&chunk_cache_lock);
+  /* a negative limit leaves the current one unchanged */
+  if (Long_val(max_entries) >= 0)
+    cache.max_entries = Long_val(max_entries);
+  if (Long_val(max_bytes) >= 0)
+    cache.max_bytes = Long_val(max_bytes);
+  chunk_cache_evict();
+  pthread_mutex_unlock(&chunk_cache_lock);
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value luaL_chunk_cache_clear__stub(value unit)
+{
+  CAMLparam1(unit);
+
+  pthread_mutex_lock(&chunk_cache_lock);
+  while (cache.lru_tail != NULL)
+    chunk_cache_remove(cache.lru_tail);
+  pthread_mutex_unlock(&chunk_cache_lock);
+
+  CAMLreturn(Val_unit);
+}
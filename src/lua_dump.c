@@ -0,0 +1,181 @@
+/* Dump of precompiled chunks with optional stripping of debug information.
+ *
+ * Lua 5.1 does not export the "strip" argument of luaU_dump (lua_dump always
+ * keeps the debug information) and luaU_dump itself is hidden in liblua, so
+ * the code below is taken from Lua source (ldump.c, luaU_header in lundump.c)
+ * and must be kept in sync with the bundled Lua version.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#define LUA_CORE
+
+#include <lua.h>
+
+#include <lobject.h>
+#include <lstate.h>
+#include <lundump.h>
+
+#include <caml/mlvalues.h>
+
+#include "stub.h"
+
+typedef struct {
+ lua_State* L;
+ lua_Writer writer;
+ void* data;
+ int strip;
+ int status;
+} DumpState;
+
+#define DumpMem(b,n,size,D)	DumpBlock(b,(n)*(size),D)
+#define DumpVar(x,D)	 	DumpMem(&x,1,sizeof(x),D)
+
+static void DumpBlock(const void* b, size_t size, DumpState* D)
+{
+ if (D->status==0)
+ {
+  D->status=(*D->writer)(D->L,b,size,D->data);
+ }
+}
+
+static void DumpChar(int y, DumpState* D)
+{
+ char x=(char)y;
+ DumpVar(x,D);
+}
+
+static void DumpInt(int x, DumpState* D)
+{
+ DumpVar(x,D);
+}
+
+static void DumpNumber(lua_Number x, DumpState* D)
+{
+ DumpVar(x,D);
+}
+
+static void DumpVector(const void* b, int n, size_t size, DumpState* D)
+{
+ DumpInt(n,D);
+ DumpMem(b,n,size,D);
+}
+
+static void DumpString(const TString* s, DumpState* D)
+{
+ if (s==NULL || getstr(s)==NULL)
+ {
+  size_t size=0;
+  DumpVar(size,D);
+ }
+ else
+ {
+  size_t size=s->tsv.len+1;		/* include trailing '\0' */
+  DumpVar(size,D);
+  DumpBlock(getstr(s),size,D);
+ }
+}
+
+#define DumpCode(f,D)	 DumpVector(f->code,f->sizecode,sizeof(Instruction),D)
+
+static void DumpFunction(const Proto* f, const TString* p, DumpState* D);
+
+static void DumpConstants(const Proto* f, DumpState* D)
+{
+ int i,n=f->sizek;
+ DumpInt(n,D);
+ for (i=0; i<n; i++)
+ {
+  const TValue* o=&f->k[i];
+  DumpChar(ttype(o),D);
+  switch (ttype(o))
+  {
+   case LUA_TNIL:
+	break;
+   case LUA_TBOOLEAN:
+	DumpChar(bvalue(o),D);
+	break;
+   case LUA_TNUMBER:
+	DumpNumber(nvalue(o),D);
+	break;
+   case LUA_TSTRING:
+	DumpString(rawtsvalue(o),D);
+	break;
+   default:
+	break;
+  }
+ }
+ n=f->sizep;
+ DumpInt(n,D);
+ for (i=0; i<n; i++) DumpFunction(f->p[i],f->source,D);
+}
+
+static void DumpDebug(const Proto* f, DumpState* D)
+{
+ int i,n;
+ n= (D->strip) ? 0 : f->sizelineinfo;
+ DumpVector(f->lineinfo,n,sizeof(int),D);
+ n= (D->strip) ? 0 : f->sizelocvars;
+ DumpInt(n,D);
+ for (i=0; i<n; i++)
+ {
+  DumpString(f->locvars[i].varname,D);
+  DumpInt(f->locvars[i].startpc,D);
+  DumpInt(f->locvars[i].endpc,D);
+ }
+ n= (D->strip) ? 0 : f->sizeupvalues;
+ DumpInt(n,D);
+ for (i=0; i<n; i++) DumpString(f->upvalues[i],D);
+}
+
+static void DumpFunction(const Proto* f, const TString* p, DumpState* D)
+{
+ DumpString((f->source==p || D->strip) ? NULL : f->source,D);
+ DumpInt(f->linedefined,D);
+ DumpInt(f->lastlinedefined,D);
+ DumpChar(f->nups,D);
+ DumpChar(f->numparams,D);
+ DumpChar(f->is_vararg,D);
+ DumpChar(f->maxstacksize,D);
+ DumpCode(f,D);
+ DumpConstants(f,D);
+ DumpDebug(f,D);
+}
+
+static void DumpHeader(DumpState* D)
+{
+ char h[LUAC_HEADERSIZE];
+ char *p=h;
+ int x=1;
+ memcpy(p,LUA_SIGNATURE,sizeof(LUA_SIGNATURE)-1);
+ p+=sizeof(LUA_SIGNATURE)-1;
+ *p++=(char)LUAC_VERSION;
+ *p++=(char)LUAC_FORMAT;
+ *p++=(char)*(char*)&x;				/* endianness */
+ *p++=(char)sizeof(int);
+ *p++=(char)sizeof(size_t);
+ *p++=(char)sizeof(Instruction);
+ *p++=(char)sizeof(lua_Number);
+ *p++=(char)(((lua_Number)0.5)==0);		/* is lua_Number integral? */
+ DumpBlock(h,LUAC_HEADERSIZE,D);
+}
+
+/* Same as lua_dump, with the additional "strip" argument: dumps the Lua
+ * function at the top of the stack, returns 1 if it is not a Lua function,
+ * otherwise the error code of the last call to the writer. */
+int dump_function(lua_State *L, lua_Writer writer, void *data, int strip)
+{
+ DumpState D;
+ TValue *o = L->top - 1;
+ if (!isLfunction(o))
+  return 1;
+ D.L=L;
+ D.writer=writer;
+ D.data=data;
+ D.strip=strip;
+ D.status=0;
+ DumpHeader(&D);
+ DumpFunction(clvalue(o)->l.p,NULL,&D);
+ return D.status;
+}
@@ -0,0 +1,373 @@
+open Lua_api_lib
+
+external cpu_count : unit -> int = "lua_executor_cpu_count__stub"
+external pin_thread : int -> bool = "lua_executor_pin__stub"
+
+exception Job_error of string
+
+(* Raised by run_job when an OCaml exception escaped from the Lua code of the
+   job: Lua was left without unwinding its stack, so the state of the worker
+   can't be used anymore. *)
+exception Lost_state of exn
+
+type script =
+  | Chunk of int * string * string      (* id, name, source *)
+  | Global of string
+
+type outcome =
+  | Pending
+  | Done of lua_value list
+  | Failed of string
+
+type future =
+  {
+    mutable outcome : outcome;
+    f_lock : Mutex.t;
+    resolved : Condition.t;
+  }
+
+type job =
+  {
+    script : script;
+    args : lua_value list;
+    future : future;
+    enqueued : float;
+  }
+
+type worker =
+  {
+    jobs : job Queue.t;
+    q_lock : Mutex.t;
+    mutable thread : Thread.t option;
+  }
+
+type metrics =
+  {
+    submitted : int;
+    completed : int;
+    failed : int;
+    stolen : int;
+    queued : int;
+    max_queued : int;
+    queue_depths : int array;
+    mean_wait : float;
+    max_wait : float;
+    mean_run : float;
+    max_run : float;
+  }
+
+type t =
+  {
+    workers : worker array;
+    lock : Mutex.t;                         (* protects the fields below *)
+    work : Condition.t;
+    mutable closing : bool;
+    mutable next : int;                     (* round robin of submit *)
+    mutable n_queued : int;
+    mutable n_submitted : int;
+    mutable n_completed : int;
+    mutable n_failed : int;
+    mutable n_stolen : int;
+    mutable n_max_queued : int;
+    mutable total_wait : float;
+    mutable total_run : float;
+    mutable worst_wait : float;
+    mutable worst_run : float;
+  }
+
+let script_ids = ref 0
+let script_lock = Mutex.create ()
+
+let script ?(name="executor") source =
+  Mutex.lock script_lock;
+  incr script_ids;
+  let id = !script_ids in
+  Mutex.unlock script_lock;
+  Chunk (id, name, source)
+
+let global name = Global name
+
+let new_future () =
+  { outcome = Pending; f_lock = Mutex.create (); resolved = Condition.create () }
+
+let resolve future outcome =
+  Mutex.lock future.f_lock;
+  future.outcome <- outcome;
+  Condition.broadcast future.resolved;
+  Mutex.unlock future.f_lock
+
+let poll future =
+  Mutex.lock future.f_lock;
+  let outcome = future.outcome in
+  Mutex.unlock future.f_lock;
+  match outcome with
+  | Pending -> None
+  | Done results -> Some results
+  | Failed msg -> raise (Job_error msg)
+
+let is_ready future =
+  Mutex.lock future.f_lock;
+  let ready = future.outcome <> Pending in
+  Mutex.unlock future.f_lock;
+  ready
+
+let await future =
+  Mutex.lock future.f_lock;
+  while future.outcome = Pending do
+    Condition.wait future.resolved future.f_lock
+  done;
+  let outcome = future.outcome in
+  Mutex.unlock future.f_lock;
+  match outcome with
+  | Done results -> results
+  | Failed msg -> raise (Job_error msg)
+  | Pending -> assert false
+
+let error_message ls =
+  match tolstring ls (-1) with
+  | Some msg -> msg
+  | None -> "error object is not a string"
+
+(* The chunks compiled by a worker, kept in the registry of its state: at
+   most [capacity], the least recently used is released to make room. *)
+type chunk_cache =
+  {
+    capacity : int;
+    chunks : (int, int * int ref) Hashtbl.t;  (* id -> reference, last use *)
+    mutable clock : int;
+  }
+
+let new_cache capacity = { capacity; chunks = Hashtbl.create 16; clock = 0 }
+
+let evict_oldest ls cache =
+  let oldest =
+    Hashtbl.fold
+      (fun id (_, last_use) oldest ->
+        match oldest with
+        | Some (_, t) when t <= !last_use -> oldest
+        | _ -> Some (id, !last_use))
+      cache.chunks None in
+  match oldest with
+  | Some (id, _) ->
+      let (reference, _) = Hashtbl.find cache.chunks id in
+      Lua_aux_lib.unref ls registryindex reference;
+      Hashtbl.remove cache.chunks id
+  | None -> ()
+
+(* Pushes the function of the script, compiling a chunk the first time the
+   worker sees it. *)
+let push_script ls cache script =
+  match script with
+  | Global name ->
+      getglobal ls name;
+      if not (isfunction ls (-1))
+      then raise (Job_error (name ^ " is not a global function"))
+  | Chunk (id, name, source) ->
+      cache.clock <- cache.clock + 1;
+      match Hashtbl.find_opt cache.chunks id with
+      | Some (reference, last_use) ->
+          last_use := cache.clock;
+          rawgeti ls registryindex reference
+      | None ->
+          if Lua_aux_lib.loadbuffer ls source name <> LUA_OK
+          then raise (Job_error (error_message ls));
+          if Hashtbl.length cache.chunks >= cache.capacity
+          then evict_oldest ls cache;
+          pushvalue ls (-1);
+          let reference = Lua_aux_lib.ref_ ls registryindex in
+          Hashtbl.replace cache.chunks id (reference, ref cache.clock)
+
+let run_job ls cache job =
+  settop ls 0;
+  let outcome =
+    try
+      push_script ls cache job.script;
+      List.iter (push_value ls) job.args;
+      let status =
+        try pcall ls (List.length job.args) multret 0
+        with e -> raise (Lost_state e) in
+      match status with
+      | LUA_OK -> Done (List.init (gettop ls) (fun i -> to_value ls (i + 1)))
+      | _ -> Failed (error_message ls)
+    with
+    | Job_error msg | Conversion_error msg -> Failed msg in
+  settop ls 0;
+  outcome
+
+(* Takes a job from the queue of the worker or, if it is empty, steals the
+   oldest job of the first busy worker. *)
+let take exec i =
+  let take_from w =
+    Mutex.lock w.q_lock;
+    let job = if Queue.is_empty w.jobs then None else Some (Queue.pop w.jobs) in
+    Mutex.unlock w.q_lock;
+    job in
+  let n = Array.length exec.workers in
+  let rec steal k =
+    if k = n then None
+    else match take_from exec.workers.((i + k) mod n) with
+      | Some job -> Some (job, true)
+      | None -> steal (k + 1) in
+  match take_from exec.workers.(i) with
+  | Some job -> Some (job, false)
+  | None -> steal 1
+
+let rec next_job exec i =
+  Mutex.lock exec.lock;
+  while exec.n_queued = 0 && not exec.closing do
+    Condition.wait exec.work exec.lock
+  done;
+  let available = exec.n_queued > 0 in
+  Mutex.unlock exec.lock;
+  if not available then None
+  else match take exec i with
+    | Some (job, stolen) ->
+        Mutex.lock exec.lock;
+        exec.n_queued <- exec.n_queued - 1;
+        if stolen then exec.n_stolen <- exec.n_stolen + 1;
+        Mutex.unlock exec.lock;
+        Some job
+    | None ->
+        (* another worker took it between the count and the queues *)
+        Thread.yield ();
+        next_job exec i
+
+let record exec job started finished outcome =
+  let wait = started -. job.enqueued and run = finished -. started in
+  Mutex.lock exec.lock;
+  exec.n_completed <- exec.n_completed + 1;
+  (match outcome with Failed _ -> exec.n_failed <- exec.n_failed + 1 | _ -> ());
+  exec.total_wait <- exec.total_wait +. wait;
+  exec.total_run <- exec.total_run +. run;
+  if wait > exec.worst_wait then exec.worst_wait <- wait;
+  if run > exec.worst_run then exec.worst_run <- run;
+  Mutex.unlock exec.lock
+
+(* Any exception other than the errors of the job leaves the worker without a
+   state: a new one is created for the next job. *)
+let worker_loop (exec, i, ls, pin, cache_size, new_state) =
+  (match pin with
+   | Some cpu -> ignore (pin_thread cpu)
+   | None -> ());
+  let state = ref (Some ls) and cache = ref (new_cache cache_size) in
+  let rec run job =
+    match !state with
+    | Some ls ->
+        (match run_job ls !cache job with
+         | outcome -> outcome
+         | exception Lost_state e ->
+             state := None;
+             Failed (Printexc.to_string e)
+         | exception e ->
+             state := None;
+             Failed (Printexc.to_string e))
+    | None ->
+        match new_state () with
+        | ls ->
+            state := Some ls;
+            cache := new_cache cache_size;
+            run job
+        | exception e -> Failed (Printexc.to_string e) in
+  let rec loop () =
+    match next_job exec i with
+    | None -> ()
+    | Some job ->
+        let started = Unix.gettimeofday () in
+        let outcome = run job in
+        record exec job started (Unix.gettimeofday ()) outcome;
+        resolve job.future outcome;
+        loop () in
+  loop ()
+
+let shutdown exec =
+  Mutex.lock exec.lock;
+  exec.closing <- true;
+  Condition.broadcast exec.work;
+  Mutex.unlock exec.lock;
+  Array.iter
+    (fun w ->
+      match w.thread with
+      | Some t -> Thread.join t; w.thread <- None
+      | None -> ())
+    exec.workers
+
+let create ?workers ?(pin=false) ?max_memory_size ?(cache_size=64)
+           ?(init=Lua_aux_lib.openlibs) () =
+  let n = match workers with Some n -> n | None -> cpu_count () in
+  if n < 1 || cache_size < 1 then invalid_arg "Lua_executor.create";
+  let exec =
+    { workers =
+        Array.init n (fun _ ->
+          { jobs = Queue.create (); q_lock = Mutex.create (); thread = None });
+      lock = Mutex.create (); work = Condition.create (); closing = false;
+      next = 0; n_queued = 0; n_submitted = 0; n_completed = 0; n_failed = 0;
+      n_stolen = 0; n_max_queued = 0; total_wait = 0.; total_run = 0.;
+      worst_wait = 0.; worst_run = 0. } in
+  let cpus = cpu_count () in
+  let new_state () =
+    let ls = Lua_aux_lib.newstate ?max_memory_size ~release_runtime:true () in
+    init ls;
+    ls in
+  (try
+     Array.iteri
+       (fun i w ->
+         (* the states are warmed up here, so that a failing init raises *)
+         let ls = new_state () in
+         let pin = if pin then Some (i mod cpus) else None in
+         w.thread <-
+           Some (Thread.create worker_loop
+                   (exec, i, ls, pin, cache_size, new_state)))
+       exec.workers
+   with e ->
+     (* stops the workers already started *)
+     shutdown exec;
+     raise e);
+  exec
+
+let workers exec = Array.length exec.workers
+
+let submit ?worker exec script args =
+  let future = new_future () in
+  let job = { script; args; future; enqueued = Unix.gettimeofday () } in
+  Mutex.lock exec.lock;
+  if exec.closing then begin
+    Mutex.unlock exec.lock;
+    invalid_arg "Lua_executor.submit"
+  end;
+  let i =
+    match worker with
+    | Some i when i >= 0 && i < Array.length exec.workers -> i
+    | Some _ -> Mutex.unlock exec.lock; invalid_arg "Lua_executor.submit"
+    | None ->
+        exec.next <- (exec.next + 1) mod Array.length exec.workers;
+        exec.next in
+  let w = exec.workers.(i) in
+  Mutex.lock w.q_lock;
+  Queue.push job w.jobs;
+  Mutex.unlock w.q_lock;
+  exec.n_queued <- exec.n_queued + 1;
+  exec.n_submitted <- exec.n_submitted + 1;
+  if exec.n_queued > exec.n_max_queued then exec.n_max_queued <- exec.n_queued;
+  Condition.signal exec.work;
+  Mutex.unlock exec.lock;
+  future
+
+let metrics exec =
+  let depths =
+    Array.map
+      (fun w ->
+        Mutex.lock w.q_lock;
+        let n = Queue.length w.jobs in
+        Mutex.unlock w.q_lock;
+        n)
+      exec.workers in
+  Mutex.lock exec.lock;
+  let mean total = if exec.n_completed = 0 then 0. else total /. float exec.n_completed in
+  let m =
+    { submitted = exec.n_submitted; completed = exec.n_completed;
+      failed = exec.n_failed; stolen = exec.n_stolen; queued = exec.n_queued;
+      max_queued = exec.n_max_queued; queue_depths = depths;
+      mean_wait = mean exec.total_wait; max_wait = exec.worst_wait;
+      mean_run = mean exec.total_run; max_run = exec.worst_run } in
+  Mutex.unlock exec.lock;
+  m
@@ -0,0 +1,126 @@
+(*************************************************************)
+(** {1 A multi-core executor of Lua jobs (OCaml extension)} *)
+(*************************************************************)
+
+(** This module is not part of the Lua API: it runs Lua jobs on a fixed set of
+    worker threads, each one owning a warm state, created and initialized
+    once when the executor is created. A job is a script and its arguments,
+    its results are delivered through a {!future}.
+
+    Every worker has its own queue: {!submit} distributes the jobs round
+    robin (or to a chosen worker) and an idle worker steals the oldest job of
+    the first busy worker, so that long jobs do not delay the others. The
+    states are created with [~release_runtime:true] (see
+    {!Lua_aux_lib.newstate}), so the Lua code of different workers runs in
+    parallel, while the conversion of arguments and results holds the OCaml
+    runtime lock.
+    {[
+let exec = Lua_executor.create ~workers:4 () in
+let square = Lua_executor.script "local n = ... return n * n" in
+let futures =
+  List.init 100 (fun i ->
+    Lua_executor.submit exec square [Lua.Number (float_of_int i)]) in
+let results = List.map Lua_executor.await futures in
+Lua_executor.shutdown exec
+    ]}
+
+    Arguments and results are exchanged as {!Lua_api_lib.lua_value}, so they
+    are not bound to any state: tables are copied, functions and userdata are
+    returned as [Opaque]. *)
+
+type t
+
+type script
+
+type future
+
+exception Job_error of string
+(** Raised by {!await} and {!poll} when the job failed: the script could not
+    be compiled, raised an error or had arguments or results that could not be
+    converted. The argument is the error message. *)
+
+type metrics =
+  {
+    submitted : int;            (** Jobs submitted *)
+    completed : int;            (** Jobs completed, successfully or not *)
+    failed : int;               (** Jobs completed with an error *)
+    stolen : int;               (** Jobs run by a worker other than the one
+                                    they were submitted to *)
+    queued : int;               (** Jobs waiting in the queues *)
+    max_queued : int;           (** Highest value reached by [queued] *)
+    queue_depths : int array;   (** Jobs waiting in the queue of each worker *)
+    mean_wait : float;          (** Mean time in the queue, in seconds *)
+    max_wait : float;           (** Maximum time in the queue, in seconds *)
+    mean_run : float;           (** Mean execution time, in seconds *)
+    max_run : float;            (** Maximum execution time, in seconds *)
+  }
+
+val create :
+  ?workers:int -> ?pin:bool -> ?max_memory_size:int -> ?cache_size:int ->
+  ?init:(Lua_api_lib.state -> unit) -> unit -> t
+(** [create ?workers ?pin ?max_memory_size ?cache_size ?init ()] starts an
+    executor with [workers] threads (default is {!cpu_count}). The state of
+    each worker is created with {!Lua_aux_lib.newstate} and initialized with
+    [init] (default is {!Lua_aux_lib.openlibs}), e.g. loading libraries,
+    registering functions or defining the global functions used by the jobs;
+    [init] runs in the calling thread, so its exceptions are raised by
+    [create], after stopping the workers already started.
+
+    When an OCaml exception escapes from the Lua code of a job (e.g. raised by
+    an OCaml function registered by [init]) Lua can't unwind its stack, so the
+    state of the worker is thrown away and a new one is created and
+    initialized with [init], in the worker thread, before the next job.
+
+    If [pin] is [true] (default is [false]) the worker [i] is bound to the CPU
+    [i mod cpu_count ()]. Pinning is only supported on Linux and silently
+    ignored elsewhere.
+
+    Every worker keeps at most [cache_size] compiled scripts (default is [64]),
+    releasing the least recently used one to make room (see {!script}).
+
+    Raises [Invalid_argument] if [workers] or [cache_size] is less than [1]. *)
+
+val script : ?name:string -> string -> script
+(** [script ?name source] is a Lua chunk, called with the arguments of the job
+    as [...]. Each worker compiles it the first time it runs it and keeps it
+    in the registry of its state, up to the [cache_size] of the executor: a
+    script should be created once and submitted many times, since creating a
+    new one for every job recompiles it every time. [name] is the chunk name
+    used in the error messages. *)
+
+val global : string -> script
+(** [global name] is the global function [name] of the worker states, usually
+    defined by [init]. *)
+
+val submit : ?worker:int -> t -> script -> Lua_api_lib.lua_value list -> future
+(** [submit ?worker exec script args] queues the job and returns immediately.
+    The job is queued to the given worker (between [0] and [workers exec - 1])
+    if any, otherwise round robin; it can still be stolen by an idle worker.
+    Raises [Invalid_argument] if [worker] is out of range or the executor is
+    shut down. *)
+
+val await : future -> Lua_api_lib.lua_value list
+(** Waits for the completion of the job and returns its results. Raises
+    {!Job_error} if the job failed, including when an OCaml exception escaped
+    from a function called by the job (see {!create}): the argument is then
+    the printed exception. *)
+
+val poll : future -> Lua_api_lib.lua_value list option
+(** Returns the results of the job, or [None] if it is not completed yet.
+    Raises {!Job_error} if the job failed. *)
+
+val is_ready : future -> bool
+(** [true] if the job is completed, successfully or not. *)
+
+val workers : t -> int
+(** The number of workers of the executor. *)
+
+val metrics : t -> metrics
+(** A snapshot of the counters of the executor. *)
+
+val shutdown : t -> unit
+(** Stops accepting jobs, waits for the completion of the jobs already queued
+    and for the termination of the workers. *)
+
+val cpu_count : unit -> int
+(** The number of online CPUs. *)
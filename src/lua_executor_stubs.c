@@ -0,0 +1,39 @@
+/* CPU count and thread pinning for Lua_executor.
+ *
+ * Pinning is only implemented on Linux: elsewhere lua_executor_pin__stub
+ * does nothing and returns false.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include <unistd.h>
+
+#include <caml/mlvalues.h>
+
+CAMLprim
+value lua_executor_cpu_count__stub(value unit)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    (void)unit;
+    return Val_int(n > 0 ? n : 1);
+}
+
+
+/* Binds the calling thread to the given CPU. Returns false if the binding is
+ * not supported or fails (e.g. the CPU is not in the allowed set). */
+CAMLprim
+value lua_executor_pin__stub(value cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(Int_val(cpu), &set);
+    return Val_bool(sched_setaffinity(0, sizeof(set), &set) == 0);
+#else
+    (void)cpu;
+    return Val_false;
+#endif
+}
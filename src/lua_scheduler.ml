@@ -0,0 +1,117 @@
+open Lua_api_lib
+
+type status =
+  | Ready
+  | Suspended
+  | Finished
+  | Failed of string
+
+type task =
+  {
+    thread : state;
+    mutable status : status;
+    mutable started : bool;
+    mutable nargs : int;                    (* arguments of the first resume *)
+    mutable wake_push : state -> int;       (* pushes the results of suspend *)
+    mutable suspending : bool;              (* the yield comes from suspend *)
+  }
+
+type t =
+  {
+    ls : state;
+    ready : task Queue.t;
+    mutable current : task option;
+    mutable alive : int;
+    mutable suspended : int;
+  }
+
+let no_results (_ : state) = 0
+
+let create ls =
+  { ls; ready = Queue.create (); current = None; alive = 0; suspended = 0 }
+
+let spawn sched nargs =
+  let thread = newthread sched.ls in
+  pop sched.ls 1;
+  xmove sched.ls thread (nargs + 1);
+  let task =
+    { thread; status = Ready; started = false; nargs; wake_push = no_results;
+      suspending = false } in
+  Queue.push task sched.ready;
+  sched.alive <- sched.alive + 1;
+  task
+
+let thread task = task.thread
+
+let status task = task.status
+
+let alive sched = sched.alive
+
+let suspended sched = sched.suspended
+
+let suspend sched ls register =
+  let task =
+    match sched.current with
+    | Some task when same_thread ls task.thread -> task
+    | _ -> invalid_arg "Lua_scheduler.suspend" in
+  (* yields first: under a pcall, a metamethod or a C function lua_yield
+     raises a Lua error, and the scheduler must be left untouched *)
+  let result = yield ls 0 in
+  task.status <- Suspended;
+  task.suspending <- true;
+  sched.suspended <- sched.suspended + 1;
+  register
+    (fun push ->
+      if task.status = Suspended then begin
+        task.status <- Ready;
+        task.wake_push <- push;
+        sched.suspended <- sched.suspended - 1;
+        Queue.push task sched.ready
+      end);
+  result
+
+let step sched task =
+  let nargs =
+    if task.started then begin
+      (* drop the values yielded by the coroutine, then push the results *)
+      settop task.thread 0;
+      let push = task.wake_push in
+      task.wake_push <- no_results;
+      push task.thread
+    end else begin
+      task.started <- true;
+      task.nargs
+    end in
+  sched.current <- Some task;
+  let result =
+    try resume task.thread nargs
+    with e ->
+      (* an OCaml exception left the coroutine: it can't be resumed again *)
+      sched.current <- None;
+      task.status <- Failed (Printexc.to_string e);
+      sched.alive <- sched.alive - 1;
+      raise e in
+  sched.current <- None;
+  match result with
+  | LUA_YIELD ->
+      if task.suspending then task.suspending <- false
+      else Queue.push task sched.ready      (* coroutine.yield: run it later *)
+  | LUA_OK ->
+      task.status <- Finished;
+      sched.alive <- sched.alive - 1
+  | _ ->
+      let msg = match tolstring task.thread (-1) with Some m -> m | None -> "" in
+      task.status <- Failed msg;
+      sched.alive <- sched.alive - 1
+
+let run_ready sched =
+  while not (Queue.is_empty sched.ready) do
+    step sched (Queue.pop sched.ready)
+  done
+
+let run sched ~wait =
+  run_ready sched;
+  while sched.alive > 0 do
+    wait ();
+    run_ready sched
+  done
@@ -0,0 +1,99 @@
+(********************************************************)
+(** {1 A scheduler of Lua coroutines (OCaml extension)} *)
+(********************************************************)
+
+(** This module is not part of the Lua API: it runs many Lua coroutines inside
+    a single state, letting the OCaml functions called by Lua suspend the
+    calling coroutine until an asynchronous operation completes (an Lwt
+    promise, a fiber, a reply read by an event loop...). While a coroutine is
+    suspended the others run, so the Lua code doing many I/O-bound operations
+    overlaps them instead of serializing them.
+
+    The scheduler is independent from the event loop: {!suspend} gives to the
+    OCaml code a [wake] function, to be called when the operation completes,
+    and {!run} calls [wait] (one iteration of the event loop) whenever no
+    coroutine is ready to run. For example, with a function [lookup_async]
+    calling its continuation when the result is ready:
+    {[
+let sched = Lua_scheduler.create ls
+
+let lookup ls =
+  let key = LuaL.checkstring ls 1 in
+  Lua_scheduler.suspend sched ls (fun wake ->
+    lookup_async key (fun v -> wake (fun co -> Lua.pushstring co v; 1)))
+;;
+
+Lua.register ls "lookup" lookup;
+for i = 1 to 1000 do
+  Lua.getglobal ls "handle_request";
+  Lua.pushinteger ls i;
+  ignore (Lua_scheduler.spawn sched 1)
+done;
+Lua_scheduler.run sched ~wait:event_loop_iteration
+    ]}
+
+    A scheduler and its state must be used by a single system thread, and the
+    [wake] functions must be called by that thread. *)
+
+type t
+
+type task
+
+type status =
+  | Ready               (** Waiting to be resumed by the scheduler *)
+  | Suspended           (** Waiting for the [wake] of {!suspend} *)
+  | Finished            (** Returned: its results are on the stack of {!thread} *)
+  | Failed of string    (** Raised an error, with this message *)
+
+val create : Lua_api_lib.state -> t
+(** Creates a scheduler for the coroutines of the given state. *)
+
+val spawn : t -> int -> task
+(** [spawn sched nargs] creates a coroutine running the function below the
+    [nargs] arguments at the top of the stack of the state, popping them. The
+    coroutine starts at the next {!run} or {!run_ready}. *)
+
+val suspend :
+  t -> Lua_api_lib.state -> (((Lua_api_lib.state -> int) -> unit) -> unit) -> int
+(** [suspend sched ls register] suspends the running coroutine: it must be
+    the result of an OCaml function called by a coroutine of the scheduler,
+    with [ls] the state it received. [register] is called immediately with
+    the [wake] function of the coroutine: [wake push] makes the coroutine
+    ready again and, when it is resumed, [push] pushes the results onto its
+    stack and returns their number. Calling [wake] more than once has no
+    effect. Raises [Invalid_argument] if no coroutine of the scheduler is
+    running, or if [ls] is not that coroutine (e.g. a coroutine created by
+    its Lua code with [coroutine.wrap]). [register] must not raise.
+
+    Lua 5.1 can't yield across a C function: [suspend] fails if the OCaml
+    function is called through [pcall], a metamethod or a C function calling
+    Lua code (e.g. the comparator of [table.sort], the function given to
+    [string.gsub]). It then raises the Lua error "attempt to yield across
+    metamethod/C-call boundary" without calling [register], and the
+    coroutine goes on as if the OCaml function had raised it.
+
+    A coroutine can also give way to the others with [coroutine.yield()]: it
+    is resumed later, without results. *)
+
+val run_ready : t -> unit
+(** Runs the ready coroutines until all of them are finished or suspended.
+    An OCaml exception raised by a function called by a coroutine is raised
+    again by [run_ready] (and {!run}), after marking the coroutine as
+    [Failed] with the printed exception. *)
+
+val run : t -> wait:(unit -> unit) -> unit
+(** Runs the coroutines until all of them are finished, calling [wait] when
+    all of them are suspended. [wait] is expected to block until some
+    operation completes and to call the corresponding [wake] functions. *)
+
+val thread : task -> Lua_api_lib.state
+(** The coroutine of the task. *)
+
+val status : task -> status
+(** The status of the task. *)
+
+val alive : t -> int
+(** Number of coroutines not yet finished. *)
+
+val suspended : t -> int
+(** Number of coroutines waiting for their [wake]. *)
@@ -1,6 +1,8 @@
 #ifndef __STUB_H
 #define __STUB_H
 
+#include <stdint.h>
+
 /******************************************************************************/
 /*****                           DEBUG FUNCTION                           *****/
 /******************************************************************************/
@@ -25,32 +27,117 @@ void debug(int level, char *format, ...);
 /* Access the lua_State inside an OCaml custom block */
 #define lua_State_val(L) (*((lua_State **) Data_custom_val(L))) /* also l-value */
 
-/* This macro is taken from the Lua source code, file ltablib.c line 19 */
-#define aux_getn(L,n)	(luaL_checktype(L, n, LUA_TTABLE), luaL_getn(L, n))
-
 
 /******************************************************************************/
 /*****                          DATA STRUCTURES                           *****/
 /******************************************************************************/
+typedef struct profiler profiler;  /* defined in lua_api_lib_stubs.c */
+
+/* Number of size classes of the allocation histogram: the class i counts the
+ * allocations up to 16 << i bytes, the last one all the bigger allocations */
+#define MEMORY_SIZE_CLASSES 16
+
 typedef struct allocator_data
 {
-    int max_memory;
-    int used_memory;
+    int64_t max_memory;
+    int64_t used_memory;
+    int64_t peak_memory;
+    int64_t allocs;
+    int64_t frees;
+    int64_t reallocs;
+    int64_t bytes_allocated;        /* new size of every allocation/reallocation */
+    int64_t refused;                /* allocations refused by max_memory */
+    int64_t histogram[MEMORY_SIZE_CLASSES];
 } allocator_data;
 
+/* The limits of a call to lua_pcall_limited__stub */
+typedef struct call_limits
+{
+    int active;
+    int reached;                    /* one of the LIMIT_* values */
+    long max_instructions;          /* negative if there is no limit */
+    long instructions;
+    double deadline;                /* negative if there is no limit */
+} call_limits;
+
+#define LIMIT_NONE          0
+#define LIMIT_INSTRUCTIONS  1
+#define LIMIT_DEADLINE      2
+
+/* A slot holding an OCaml value pushed as a light userdata: Lua only sees a
+ * handle made of the index of the slot and its generation (see lud_new) */
+typedef struct lud_slot
+{
+    value v;                        /* global root, unit if the slot is free */
+    uintptr_t generation;
+    int next_free;                  /* next free slot, if this one is free */
+} lud_slot;
+
 typedef struct ocaml_data
 {
     value state_value;
     value panic_callback;
     allocator_data ad;
+    int release_runtime;            /* release the OCaml runtime while Lua runs */
+    int runtime_released;           /* the runtime is released right now */
+    lua_State **pending_threads;    /* threads finalized while Lua was running */
+    int pending_threads_num;
+    int pending_threads_size;
+    int closure_metatable_ref;      /* registry references to the objects */
+    int userdata_metatable_ref;     /* stored in registry[UUID], to reach  */
+    int threads_table_ref;          /* them with a single lua_rawgeti      */
+    int buffer_metatable_ref;
+    int globals_snapshot_ref;       /* saved by luaL_save_globals__stub */
+    lud_slot **lud_pages;           /* slots of the light userdata */
+    int lud_pages_num;
+    int lud_slots_num;              /* slots used at least once */
+    int lud_free;                   /* first free slot, -1 if none */
+    profiler *profiler;             /* sampling profiler, NULL if never started */
+    call_limits limits;             /* limits of the running pcall_limited */
+    int hook_count;                 /* instructions between two count hooks */
+    char *scratch;                  /* results of the typed OCaml functions, */
+    size_t scratch_size;            /* copied before leaving the runtime     */
 } ocaml_data;
 
+/* A growing buffer of bytes filled by dump_buffer_writer. It is allocated
+ * with malloc, to be handed over to a managed bigarray */
+typedef struct dump_buffer
+{
+    char *data;
+    size_t len;
+    size_t size;
+} dump_buffer;
+
+/* The content of the "buffer" userdata: the OCaml bigarray must be the first
+ * field, so that the generic userdata functions (lua_touserdata__stub,
+ * default_gc) can handle it as any other OCaml userdata */
+typedef struct lua_buffer
+{
+    value bigarray;
+    const char *data;               /* slice of the bigarray data */
+    size_t len;
+} lua_buffer;
+
 
 /******************************************************************************/
 /*****                    COMMON FUNCTIONS DECLARATION                    *****/
 /******************************************************************************/
-void push_lud_array(lua_State *L);
+void *lud_new(ocaml_data *data, value v);
+value *lud_resolve(ocaml_data *data, void *handle);
+void lud_free_all(ocaml_data *data);
 ocaml_data * get_ocaml_data(lua_State *L);
+void release_runtime(ocaml_data *data);
+void acquire_runtime(ocaml_data *data);
+int begin_callback(ocaml_data *data);
+void end_callback(ocaml_data *data, int acquired);
+void untrack_pending_threads(ocaml_data *data);
+void raise_type_error(char *msg);
+void check_slice(size_t total_len, value off, value len, const char *fname);
+int dump_function(lua_State *L, lua_Writer writer, void *data, int strip);
+int dump_buffer_writer(lua_State *L, const void *p, size_t sz, void *ud);
+void free_profiler(profiler *p);
+void hook_coroutine_lib(lua_State *L);
+void hook_debug_lib(lua_State *L);
 
 
 /******************************************************************************/
@@ -196,5 +283,162 @@ value lua_function##__stub(value L, value int1_name, value int2_name) \
     CAMLreturn(Val_true); \
 }
 
+
+/******************************************************************************/
+/*****                  MACROS FOR NOALLOC/UNBOXED STUBS                  *****/
+/******************************************************************************/
+/* The following macros are for Lua functions that can't raise an error, can't
+ * allocate memory (hence can't run the Lua GC and its "__gc" metamethods) and
+ * can't call metamethods: they never call back OCaml, and they don't allocate
+ * in the OCaml heap, so they are declared [@@noalloc] on the OCaml side.
+ * Every macro generates two functions: "xxx__unboxed", called by native code
+ * with untagged integers and unboxed floats, and "xxx__stub", called by the
+ * bytecode interpreter with OCaml values. The external declaration is like:
+ *
+ *   external gettop : state -> (int [@untagged])
+ *     = "lua_gettop__stub" "lua_gettop__unboxed" [@@noalloc]
+ */
+
+/* For Lua function with signature : lua_State -> void */
+#define STUB_STATE_VOID_NOALLOC(lua_function) \
+CAMLprim \
+value lua_function##__stub(value L) \
+{ \
+    lua_function(lua_State_val(L)); \
+    return Val_unit; \
+}
+
+/* For Lua function with signature : lua_State -> int */
+#define STUB_STATE_INT_NOALLOC(lua_function) \
+CAMLprim \
+intnat lua_function##__unboxed(value L) \
+{ \
+    return lua_function(lua_State_val(L)); \
+} \
+\
+CAMLprim \
+value lua_function##__stub(value L) \
+{ \
+    return Val_long(lua_function##__unboxed(L)); \
+}
+
+/* For Lua function with signature : lua_State -> bool */
+#define STUB_STATE_BOOL_NOALLOC(lua_function) \
+CAMLprim \
+value lua_function##__stub(value L) \
+{ \
+    return Val_bool(lua_function(lua_State_val(L))); \
+}
+
+/* For Lua function with signature : lua_State -> int -> void */
+#define STUB_STATE_INT_VOID_NOALLOC(lua_function, int_name) \
+CAMLprim \
+value lua_function##__unboxed(value L, intnat int_name) \
+{ \
+    lua_function(lua_State_val(L), int_name); \
+    return Val_unit; \
+} \
+\
+CAMLprim \
+value lua_function##__stub(value L, value int_name) \
+{ \
+    return lua_function##__unboxed(L, Long_val(int_name)); \
+}
+
+/* For Lua function with signature : lua_State -> int -> int */
+#define STUB_STATE_INT_INT_NOALLOC(lua_function, int_name) \
+CAMLprim \
+intnat lua_function##__unboxed(value L, intnat int_name) \
+{ \
+    return lua_function(lua_State_val(L), int_name); \
+} \
+\
+CAMLprim \
+value lua_function##__stub(value L, value int_name) \
+{ \
+    return Val_long(lua_function##__unboxed(L, Long_val(int_name))); \
+}
+
+/* For Lua function with signature : lua_State -> int -> bool */
+#define STUB_STATE_INT_BOOL_NOALLOC(lua_function, int_name) \
+CAMLprim \
+value lua_function##__unboxed(value L, intnat int_name) \
+{ \
+    return Val_bool(lua_function(lua_State_val(L), int_name)); \
+} \
+\
+CAMLprim \
+value lua_function##__stub(value L, value int_name) \
+{ \
+    return lua_function##__unboxed(L, Long_val(int_name)); \
+}
+
+/* For Lua function with signature : lua_State -> int -> double */
+#define STUB_STATE_INT_DOUBLE_NOALLOC(lua_function, int_name) \
+CAMLprim \
+double lua_function##__unboxed(value L, intnat int_name) \
+{ \
+    return lua_function(lua_State_val(L), int_name); \
+} \
+\
+CAMLprim \
+value lua_function##__stub(value L, value int_name) \
+{ \
+    return caml_copy_double(lua_function##__unboxed(L, Long_val(int_name))); \
+}
+
+/* For Lua function with signature : lua_State -> double -> void */
+#define STUB_STATE_DOUBLE_VOID_NOALLOC(lua_function, double_name) \
+CAMLprim \
+value lua_function##__unboxed(value L, double double_name) \
+{ \
+    lua_function(lua_State_val(L), double_name); \
+    return Val_unit; \
+} \
+\
+CAMLprim \
+value lua_function##__stub(value L, value double_name) \
+{ \
+    return lua_function##__unboxed(L, Double_val(double_name)); \
+}
+
+/* For Lua function with signature : lua_State -> bool -> void */
+#define STUB_STATE_BOOL_VOID_NOALLOC(lua_function, bool_name) \
+CAMLprim \
+value lua_function##__stub(value L, value bool_name) \
+{ \
+    lua_function(lua_State_val(L), Bool_val(bool_name)); \
+    return Val_unit; \
+}
+
+/* For Lua function with signature : lua_State -> int -> int -> void */
+#define STUB_STATE_INT_INT_VOID_NOALLOC(lua_function, int1_name, int2_name) \
+CAMLprim \
+value lua_function##__unboxed(value L, intnat int1_name, intnat int2_name) \
+{ \
+    lua_function(lua_State_val(L), int1_name, int2_name); \
+    return Val_unit; \
+} \
+\
+CAMLprim \
+value lua_function##__stub(value L, value int1_name, value int2_name) \
+{ \
+    return lua_function##__unboxed(L, Long_val(int1_name), Long_val(int2_name)); \
+}
+
+/* For Lua function with signature : lua_State -> int -> int -> bool */
+#define STUB_STATE_INT_INT_BOOL_NOALLOC(lua_function, int1_name, int2_name) \
+CAMLprim \
+value lua_function##__unboxed(value L, intnat int1_name, intnat int2_name) \
+{ \
+    return Val_bool(lua_function(lua_State_val(L), int1_name, int2_name)); \
+} \
+\
+CAMLprim \
+value lua_function##__stub(value L, value int1_name, value int2_name) \
+{ \
+    return lua_function##__unboxed(L, Long_val(int1_name), Long_val(int2_name)); \
+}
+
 #endif  /* __STUB_H */
 
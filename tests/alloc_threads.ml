@@ -0,0 +1,59 @@
+open Lua_api
+
+(* Allocation-heavy Lua program: every iteration creates a small table and a
+   few strings, so that the Lua allocator is called many times per second. *)
+let lua_program = "
+local rows = {}
+for i = 1, iterations do
+  local row = {}
+  for j = 1, 16 do
+    row[j] = tostring(i * j)
+  end
+  rows[i % 64 + 1] = row
+end"
+
+let pf = Printf.printf;;
+let (|>) x f = f x;;
+
+let worker release_runtime iterations () =
+  let state = LuaL.newstate ~release_runtime () in
+  LuaL.openlibs state;
+  Lua.pushinteger state iterations;
+  Lua.setglobal state "iterations";
+  LuaL.loadbuffer state lua_program "alloc_threads" |> ignore;
+  match Lua.pcall state 0 0 0 with
+  | Lua.LUA_OK -> ()
+  | err -> raise (Lua.Error err)
+;;
+
+(* Runs [thread_num] threads, each one with its own state, and returns the
+   number of Lua iterations per second executed by the whole process. *)
+let throughput release_runtime thread_num iterations =
+  let start = Unix.gettimeofday () in
+  let th_list =
+    List.init thread_num
+      (fun _ -> Thread.create (worker release_runtime iterations) ()) in
+  List.iter Thread.join th_list;
+  let elapsed = Unix.gettimeofday () -. start in
+  float_of_int (thread_num * iterations) /. elapsed
+;;
+
+let main max_threads iterations release_runtime =
+  let max_threads = int_of_string max_threads in
+  let iterations = int_of_string iterations in
+  let base = throughput release_runtime 1 iterations in
+  for thread_num = 1 to max_threads do
+    let rate = throughput release_runtime thread_num iterations in
+    pf "%3d threads: %12.0f iterations/sec (%.2fx)\n%!"
+      thread_num rate (rate /. base)
+  done
+;;
+
+let release_runtime =
+  Array.length Sys.argv > 3 && Sys.argv.(3) = "release_runtime";;
+
+try main Sys.argv.(1) Sys.argv.(2) release_runtime
+with Invalid_argument _ -> begin
+  Printf.eprintf "Usage: %s <max_threads> <iterations> [release_runtime]\n%!" (Sys.argv.(0));
+  exit 1;
+end
@@ -0,0 +1,88 @@
+open Lua_api
+
+(* Runs every operation of Lua.Batch at least once, checking the results
+   vector, the stop at the first failing Pcall and programs growing the stack
+   beyond the space guaranteed by Lua. *)
+
+let pf = Printf.printf;;
+
+let fail name =
+  pf "%s: unexpected result\n%!" name;
+  exit 1
+;;
+
+let expect name expected actual =
+  if actual <> expected then fail name
+;;
+
+let prelude = "
+t = {10, 20, k = 'v'}
+function add(x, y) return x + y end
+function fail() error('boom') end
+function many() local r = {} for i = 1, 200 do r[i] = i end return unpack(r) end
+";;
+
+let every_op =
+  let open Lua.Batch in
+  [
+    Pushinteger 7; Setglobal "a";
+    Getglobal "a"; Tonumber (-1); Pop 1;
+    Pushnumber 2.5; Tonumber (-1); Pop 1;
+    Pushstring "x"; Tostring (-1); Pop 1;
+    Pushboolean true; Toboolean (-1); Pop 1;
+    Pushnil; Tostring (-1); Pop 1;
+    Getglobal "t";
+    Getfield (-1, "k"); Tostring (-1); Pop 1;
+    Rawgeti (-1, 2); Tonumber (-1); Pop 1;
+    Pushstring "k2"; Pusharg 0; Settable (-3);
+    Pushstring "k2"; Gettable (-2); Tostring (-1); Pop 1;
+    Pusharg 1; Setfield (-2, "n");
+    Pushvalue (-1); Getfield (-1, "n"); Tonumber (-1); Settop (-3);
+    Getglobal "add"; Pushinteger 1; Pushinteger 2; Pcall (2, 1, 0);
+    Tonumber (-1); Pop 1;
+    Settop 0;
+    Getglobal "fail"; Pcall (0, 0, 0);
+    Pushinteger 99; Tonumber (-1);
+  ]
+;;
+
+let () =
+  let ls = LuaL.newstate () in
+  LuaL.openlibs ls;
+  if not (LuaL.dostring ls prelude) then fail "prelude";
+
+  let p = Lua.Batch.compile every_op in
+  expect "nargs" 2 (Lua.Batch.nargs p);
+  expect "nresults" 11 (Lua.Batch.nresults p);
+  let results = Lua.Batch.results p in
+  let status = Lua.Batch.run ls p [| Lua.String "w"; Lua.Number 3. |] results in
+  expect "pcall status" Lua.LUA_ERRRUN status;
+  (match Lua.tostring ls (-1) with
+   | Some msg when String.length msg >= 4
+                   && String.sub msg (String.length msg - 4) 4 = "boom" -> ()
+   | _ -> fail "error message");
+  expect "results"
+    [| Lua.Number 7.; Lua.Number 2.5; Lua.String "x"; Lua.Boolean true; Lua.Nil;
+       Lua.String "v"; Lua.Number 20.; Lua.String "w"; Lua.Number 3.;
+       Lua.Number 3.; Lua.Nil |]
+    results;
+  Lua.settop ls 0;
+
+  (* more results than LUA_MINSTACK, then more pushes *)
+  let p =
+    Lua.Batch.(compile ([Getglobal "many"; Pcall (0, Lua.multret, 0); Tonumber (-1)]
+                        @ List.init 100 (fun i -> Pushinteger i)
+                        @ [Tonumber (-1); Settop 0])) in
+  let results = Lua.Batch.results p in
+  expect "multret status" Lua.LUA_OK (Lua.Batch.run ls p [||] results);
+  expect "multret results" [| Lua.Number 200.; Lua.Number 99. |] results;
+
+  (* a Settop growing the stack *)
+  let p = Lua.Batch.(compile [Settop 500; Pushinteger 1; Tonumber (-1); Settop 0]) in
+  let results = Lua.Batch.results p in
+  expect "settop status" Lua.LUA_OK (Lua.Batch.run ls p [||] results);
+  expect "settop results" [| Lua.Number 1. |] results;
+  expect "final top" 0 (Lua.gettop ls);
+
+  print_endline "OK"
+;;
@@ -0,0 +1,54 @@
+open Lua_api
+
+(* Cost of a call from Lua to OCaml: the same functions are registered as
+   generic OCaml functions, which read their arguments and push their result
+   through the stack API, and as typed functions (Lua.register_float1 and the
+   like), whose arguments and result are converted by the C trampoline. *)
+
+let calls = 5_000_000;;
+
+let pf = Printf.printf;;
+
+(* Returns the cost of a call to the global function [name], in ns *)
+let run ls name args =
+  let script =
+    Printf.sprintf
+      "local f = %s\nlocal x = 0\nfor i = 1, %d do x = f(%s) end" name calls args in
+  (match LuaL.loadbuffer ls script name with
+   | Lua.LUA_OK -> ()
+   | err -> raise (Lua.Error err));
+  let start = Unix.gettimeofday () in
+  (match Lua.pcall ls 0 0 0 with
+   | Lua.LUA_OK -> ()
+   | err -> raise (Lua.Error err));
+  let stop = Unix.gettimeofday () in
+  (stop -. start) *. 1e9 /. float_of_int calls
+;;
+
+let bench ls name generic typed args =
+  let before = run ls generic args in
+  let after = run ls typed args in
+  pf "%-8s generic %7.2f ns/call   typed %7.2f ns/call   (x%.1f)\n%!"
+    name before after (before /. after)
+;;
+
+let () =
+  let ls = LuaL.newstate () in
+  LuaL.openlibs ls;
+  Lua.register ls "sqrt" (fun ls ->
+    Lua.pushnumber ls (sqrt (LuaL.checknumber ls 1)); 1);
+  Lua.register_float1 ls "sqrt_typed" sqrt;
+  Lua.register ls "add" (fun ls ->
+    Lua.pushnumber ls (LuaL.checknumber ls 1 +. LuaL.checknumber ls 2); 1);
+  Lua.register_float2 ls "add_typed" (+.);
+  Lua.register ls "succ" (fun ls ->
+    Lua.pushinteger ls (LuaL.checkinteger ls 1 + 1); 1);
+  Lua.register_int1 ls "succ_typed" succ;
+  Lua.register ls "upper" (fun ls ->
+    Lua.pushstring ls (String.uppercase_ascii (LuaL.checkstring ls 1)); 1);
+  Lua.register_string1 ls "upper_typed" String.uppercase_ascii;
+  bench ls "float1" "sqrt" "sqrt_typed" "i";
+  bench ls "float2" "add" "add_typed" "i, 1";
+  bench ls "int1" "succ" "succ_typed" "i";
+  bench ls "string1" "upper" "upper_typed" "'abc'"
+;;
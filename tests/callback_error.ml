@@ -0,0 +1,67 @@
+open Lua_api
+
+(* OCaml functions raising Lua errors on states releasing the runtime lock:
+   the error longjmps past the end of the callback, so the runtime must not be
+   re-acquired twice when the Lua function returns. Several threads run the
+   test at the same time, so that a wrong lock state hangs or crashes. *)
+
+let script = "
+local ok, msg = pcall(fail, 'caught')
+assert(not ok and msg:find('caught'))
+ok, msg = pcall(need_string, {})
+assert(not ok and msg:find('string expected'))
+local s = 0
+for i = 1, 10000 do s = s + i end
+return need_string(tostring(s))"
+
+let fail ls =
+  let msg = LuaL.checkstring ls 1 in
+  LuaL.error ls "failure: %s" msg
+;;
+
+let need_string ls =
+  let s = LuaL.checkstring ls 1 in
+  Lua.pushstring ls (s ^ "!");
+  1
+;;
+
+let run_script ls =
+  match LuaL.loadbuffer ls script "callback_error" with
+  | Lua.LUA_OK -> Lua.pcall ls 0 1 0
+  | err -> err
+;;
+
+let worker iterations () =
+  let ls = LuaL.newstate ~release_runtime:true () in
+  LuaL.openlibs ls;
+  Lua.register ls "fail" fail;
+  Lua.register ls "need_string" need_string;
+  for _i = 1 to iterations do
+    (* errors caught by Lua *)
+    (match run_script ls with
+     | Lua.LUA_OK ->
+         assert (Lua.tostring ls (-1) = Some "50005000!");
+         Lua.pop ls 1
+     | _ -> failwith (match Lua.tostring ls (-1) with Some m -> m | None -> "?"));
+    (* errors returned to OCaml *)
+    Lua.getglobal ls "fail";
+    Lua.pushstring ls "uncaught";
+    assert (Lua.pcall ls 1 0 0 = Lua.LUA_ERRRUN);
+    Lua.pop ls 1;
+    Lua.getglobal ls "need_string";
+    Lua.pushinteger ls 42;
+    assert (Lua.pcall ls 1 1 0 = Lua.LUA_OK);   (* numbers are strings *)
+    Lua.pop ls 1;
+    Lua.getglobal ls "need_string";
+    Lua.pushboolean ls true;
+    assert (Lua.pcall ls 1 1 0 = Lua.LUA_ERRRUN);
+    Lua.pop ls 1;
+    Gc.minor ()
+  done
+;;
+
+let () =
+  let threads = List.init 4 (fun _ -> Thread.create (worker 200) ()) in
+  List.iter Thread.join threads;
+  print_endline "OK"
+;;
@@ -169,8 +169,39 @@ let main thread_num n =
   List.iter Thread.join !th_list;
 ;;
 
-try main Sys.argv.(1) Sys.argv.(2)
+(* The same program as a job of a Lua_executor: each run uses 1 to max_workers
+   warm workers for the same jobs and reports the throughput. *)
+let scaling max_workers jobs n =
+  let max_workers = int_of_string max_workers in
+  let jobs = int_of_string jobs in
+  let n = int_of_string n in
+  for i = 1 to jobs do mkdir (spf "OUTPUT/thread_%05d" i) done;
+  let job = Executor.script ~name:"fasta" ("thread_id, param = ...\n" ^ lua_program) in
+  pf "%d jobs, fasta %d, %d CPUs\n%!" jobs n (Executor.cpu_count ());
+  for workers = 1 to max_workers do
+    let exec = Executor.create ~workers ~pin:true () in
+    let start = Unix.gettimeofday () in
+    let futures =
+      List.init jobs (fun i ->
+        Executor.submit exec job
+          [Lua.Number (float_of_int (i + 1)); Lua.Number (float_of_int n)]) in
+    List.iter (fun f -> ignore (Executor.await f)) futures;
+    let elapsed = Unix.gettimeofday () -. start in
+    let m = Executor.metrics exec in
+    Executor.shutdown exec;
+    pf "%3d workers: %8.2f jobs/s, mean wait %7.1f ms, mean run %7.1f ms, %d stolen\n%!"
+      workers (float_of_int jobs /. elapsed) (m.Executor.mean_wait *. 1000.)
+      (m.Executor.mean_run *. 1000.) m.Executor.stolen
+  done
+;;
+
+try
+  if Sys.argv.(1) = "--scaling"
+  then scaling Sys.argv.(2) Sys.argv.(3) Sys.argv.(4)
+  else main Sys.argv.(1) Sys.argv.(2)
 with Invalid_argument _ -> begin
   Printf.eprintf "Usage: %s <thread_num> <fasta_argument>\n%!" (Sys.argv.(0));
+  Printf.eprintf "       %s --scaling <max_workers> <jobs> <fasta_argument>\n%!"
+    (Sys.argv.(0));
   exit 1;
 end
@@ -0,0 +1,52 @@
+open Lua_api
+
+(* Calls of Lua.Fn handles with every kind of argument, in particular a float
+   as the first argument, which must not turn the vector of the arguments
+   into a flat float array. *)
+
+let script = "
+function score(x, n) return string.format('%.1f/%d', x, n) end
+function hypot(x, y) return math.sqrt(x * x + y * y) end
+function sum(t, k) return t.a + t[1] + k end
+function describe(t) return { kind = type(t), size = #t } end
+function fail(x) error('failed with ' .. x) end"
+
+let check name ok =
+  if not ok then begin
+    Printf.printf "%s: unexpected result\n%!" name;
+    exit 1
+  end
+;;
+
+let () =
+  let ls = LuaL.newstate () in
+  LuaL.openlibs ls;
+  if not (LuaL.dostring ls script) then failwith "cannot load the script";
+
+  let score = Lua.Fn.(of_global ls "score" (Float @-> Int @-> returning String)) in
+  let hypot = Lua.Fn.(of_global ls "hypot" (Float @-> Float @-> returning Float)) in
+  let sum = Lua.Fn.(of_global ls "sum" (Value @-> Float @-> returning Float)) in
+  let describe = Lua.Fn.(of_global ls "describe" (Value @-> returning Value)) in
+  let fail = Lua.Fn.(of_global ls "fail" (String @-> returning Unit)) in
+  let top = Lua.gettop ls in
+
+  for i = 1 to 10_000 do
+    check "float first" (Lua.Fn.call score 3.5 i = Printf.sprintf "3.5/%d" i);
+    check "floats" (Lua.Fn.call hypot 3. 4. = 5.);
+    let t = Lua.Table [ (Lua.String "a", Lua.Number 1.); (Lua.Number 1., Lua.Number 2.) ] in
+    check "value first" (Lua.Fn.call sum t 0.5 = 3.5);
+    (match Lua.Fn.call describe (Lua.Table [ (Lua.Number 1., Lua.Boolean true) ]) with
+     | Lua.Table fields ->
+         check "value result"
+           (List.sort compare fields
+            = [ (Lua.String "kind", Lua.String "table");
+                (Lua.String "size", Lua.Number 1.) ])
+     | _ -> check "value result" false);
+    (match Lua.Fn.call fail "x" with
+     | () -> check "error" false
+     | exception Lua.Call_error msg -> check "error message" (String.length msg > 0));
+    if i mod 1000 = 0 then Gc.compact ()
+  done;
+  check "stack" (Lua.gettop ls = top);
+  print_endline "OK"
+;;
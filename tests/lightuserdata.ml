@@ -0,0 +1,65 @@
+open Lua_api
+
+(* Pushes and releases many light userdata in the same state, checking that
+   neither the OCaml heap nor the Lua state grow with the number of pushes. *)
+
+let pushes = 10_000_000;;
+let checkpoint = 1_000_000;;
+
+type payload =
+  {
+    id : int;
+    name : string;
+  }
+
+let memory_usage ls =
+  let _ = Lua.gc ls Lua.GCCOLLECT 0 in
+  Gc.full_major ();
+  let stat = Gc.quick_stat () in
+  (stat.Gc.heap_words, Lua.gc ls Lua.GCCOUNT 0)
+;;
+
+let check_value ls i =
+  Lua.pushlightuserdata ls { id = i; name = string_of_int i };
+  let () =
+    match Lua.touserdata ls (-1) with
+    | Some `Light_userdata p ->
+        if p.id <> i || p.name <> string_of_int i
+        then failwith "The light userdata is not the expected one!"
+    | _ -> failwith "A light userdata expected" in
+  if not (Lua.releaselightuserdata ls (-1))
+  then failwith "The light userdata has not been released!";
+  if Lua.releaselightuserdata ls (-1)
+  then failwith "The light userdata has been released twice!";
+  (* the released copy must not resolve to the value pushed next *)
+  Lua.pushlightuserdata ls { id = -i; name = "" };
+  (match Lua.touserdata ls (-2) with
+   | None -> ()
+   | Some _ -> failwith "A released light userdata is still resolved!");
+  let _released = Lua.releaselightuserdata ls (-1) in
+  Lua.pop ls 2
+;;
+
+let main () =
+  let ls = LuaL.newstate () in
+  let baseline = ref None in
+  for i = 1 to pushes do
+    Lua.pushlightuserdata ls { id = i; name = "" };
+    let _released = Lua.releaselightuserdata ls (-1) in
+    Lua.pop ls 1;
+    if i mod checkpoint = 0 then begin
+      check_value ls i;
+      let heap_words, lua_kb = memory_usage ls in
+      Test_common.log Test_common.User_info
+        "%9d pushes: OCaml heap %d words, Lua state %d KB" i heap_words lua_kb;
+      match !baseline with
+      | None -> baseline := Some (heap_words, lua_kb)
+      | Some (base_words, base_kb) ->
+          if heap_words > 2 * base_words || lua_kb > 2 * base_kb + 16
+          then failwith "Memory is growing with the number of light userdata!"
+    end
+  done;
+  Test_common.log Test_common.User_info "memory stays flat after %d pushes" pushes
+;;
+
+Test_common.run main ();;
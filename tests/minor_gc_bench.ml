@@ -0,0 +1,64 @@
+open Lua_api
+
+(* Measures the latency of a minor collection against the number of OCaml
+   values (full userdata and closures) kept alive by a Lua state. With classic
+   global roots every minor collection scans all of them, so the latency grows
+   linearly; with generational roots it should stay flat. *)
+
+let live_values = [ 0; 1_000; 10_000; 100_000; 1_000_000 ];;
+let samples = 1_000;;
+
+let pf = Printf.printf;;
+
+type payload =
+  {
+    id : int;
+    name : string;
+  }
+
+(* Fills the table at the top of the stack with [n] values, half of them full
+   userdata and half of them OCaml closures. *)
+let populate ls n =
+  for i = 1 to n do
+    if i land 1 = 0
+    then Lua.newuserdata ls { id = i; name = string_of_int i }
+    else Lua.pushocamlfunction ls (fun _ -> i);
+    Lua.rawseti ls (-2) i
+  done
+;;
+
+(* Allocates some garbage in the minor heap and returns the duration of the
+   following minor collection, in microseconds. *)
+let minor_gc_latency () =
+  let garbage = ref [] in
+  for i = 1 to 1_000 do garbage := (i, string_of_int i) :: !garbage done;
+  let start = Unix.gettimeofday () in
+  Gc.minor ();
+  let stop = Unix.gettimeofday () in
+  ignore (Sys.opaque_identity !garbage);
+  (stop -. start) *. 1_000_000.
+;;
+
+let measure n =
+  let ls = LuaL.newstate () in
+  Lua.newtable ls;
+  populate ls n;
+  Lua.setglobal ls "live_values";
+  (* promote everything to the major heap before measuring *)
+  Gc.full_major ();
+  let timings = Array.init samples (fun _ -> minor_gc_latency ()) in
+  Array.sort compare timings;
+  let total = Array.fold_left (+.) 0. timings in
+  pf "%9d live values: mean %8.2f us, median %8.2f us, max %8.2f us\n%!"
+    n (total /. float_of_int samples) timings.(samples / 2)
+    timings.(samples - 1);
+  Lua.pushnil ls;
+  Lua.setglobal ls "live_values";
+  let _ = Lua.gc ls Lua.GCCOLLECT 0 in
+  ()
+;;
+
+let () =
+  List.iter measure live_values;
+  Gc.compact ()
+;;
@@ -0,0 +1,104 @@
+open Lua_api
+
+(* Lua.pcall_limited against scripts trying to escape the limits: catching
+   the limit error, running in a coroutine created by an earlier call,
+   removing the hook, calling a nested pcall_limited with a larger budget. The
+   state must be usable after every interrupted call. *)
+
+let pf = Printf.printf;;
+
+let load ls script =
+  match LuaL.loadbuffer ls script "pcall_limited" with
+  | Lua.LUA_OK -> ()
+  | err -> raise (Lua.Error err)
+;;
+
+let run ?max_instructions ?timeout ls script =
+  load ls script;
+  let status = Lua.pcall_limited ?max_instructions ?timeout ls 0 0 0 in
+  (match status with
+   | Lua.Finished Lua.LUA_OK -> ()
+   | _ -> Lua.pop ls 1);                    (* the error message *)
+  status
+;;
+
+let expect name expected status =
+  if status <> expected then begin
+    pf "%s: unexpected result\n%!" name;
+    exit 1
+  end
+;;
+
+let check_reusable ls =
+  expect "reuse" (Lua.Finished Lua.LUA_OK)
+    (run ~max_instructions:100_000 ls "result = 0; for i = 1, 100 do result = result + i end");
+  Lua.getglobal ls "result";
+  if Lua.tointeger ls (-1) <> 5050 then (pf "reuse: wrong result\n%!"; exit 1);
+  Lua.pop ls 1
+;;
+
+let () =
+  let ls = LuaL.newstate () in
+  LuaL.openlibs ls;
+
+  expect "infinite loop" Lua.Instruction_limit_reached
+    (run ~max_instructions:100_000 ls "while true do end");
+  check_reusable ls;
+
+  expect "deadline" Lua.Deadline_reached
+    (run ~timeout:0.05 ls "while true do end");
+  check_reusable ls;
+
+  expect "caught limit" Lua.Instruction_limit_reached
+    (run ~max_instructions:100_000 ls
+       "while true do pcall(function() while true do end end) end");
+  check_reusable ls;
+
+  (* the budget is not overshot: an iteration is 4 instructions *)
+  expect "budget" Lua.Instruction_limit_reached
+    (run ~max_instructions:1500 ls "n = 0; while true do n = n + 1 end");
+  Lua.getglobal ls "n";
+  if Lua.tointeger ls (-1) > 400 then (pf "budget: overshot\n%!"; exit 1);
+  Lua.pop ls 1;
+
+  (* coroutines created by an unlimited call, without the hook *)
+  expect "create coroutines" (Lua.Finished Lua.LUA_OK)
+    (run ls "co = coroutine.create(function() while true do end end)
+             wrapped = coroutine.wrap(function() while true do end end)");
+  expect "old coroutine" Lua.Instruction_limit_reached
+    (run ~max_instructions:100_000 ls "coroutine.resume(co)");
+  expect "old wrapped coroutine" Lua.Instruction_limit_reached
+    (run ~max_instructions:100_000 ls "wrapped()");
+  check_reusable ls;
+
+  (* the caller can't catch the limit reached by a coroutine *)
+  expect "coroutine caught limit" Lua.Instruction_limit_reached
+    (run ~max_instructions:100_000 ls
+       "local co = coroutine.create(function() while true do end end)
+        while true do coroutine.resume(co) end");
+  check_reusable ls;
+
+  (* the hook can't be removed by the script *)
+  expect "sethook" Lua.Instruction_limit_reached
+    (run ~max_instructions:100_000 ls "pcall(debug.sethook) while true do end");
+  check_reusable ls;
+
+  (* an inner call can't go beyond the budget left to the outer one *)
+  let inner_status = ref (Lua.Finished Lua.LUA_OK) in
+  Lua.register ls "inner" (fun ls ->
+    inner_status := run ~max_instructions:10_000_000 ls "n = 0; while true do n = n + 1 end";
+    0);
+  expect "nested outer" Lua.Instruction_limit_reached
+    (run ~max_instructions:100_000 ls "inner() while true do end");
+  expect "nested inner" Lua.Instruction_limit_reached !inner_status;
+  Lua.getglobal ls "n";
+  if Lua.tointeger ls (-1) > 30_000 then (pf "nested: overshot\n%!"; exit 1);
+  Lua.pop ls 1;
+  check_reusable ls;
+
+  (* without limits the hook is gone, also from the coroutines *)
+  expect "unlimited" (Lua.Finished Lua.LUA_OK)
+    (run ls "local co = coroutine.wrap(function() for i = 1, 1000000 do end end) co()");
+
+  print_endline "OK"
+;;
@@ -0,0 +1,76 @@
+open Lua_api
+
+(* Compares the latency of getting a ready-to-use state from a LuaL.Pool with
+   the creation of a new state followed by LuaL.openlibs, running the same
+   small script on both. *)
+
+let iterations = 10_000;;
+let pool_size = 4;;
+
+let script = "
+local t = {}
+for i = 1, 10 do t[i] = string.format('%d', i * i) end
+leaked_global = table.concat(t, ',')
+string.leaked_function = function() end"
+
+let pf = Printf.printf;;
+
+let run_script ls =
+  match LuaL.loadbuffer ls script "pool_bench" with
+  | Lua.LUA_OK -> begin
+      match Lua.pcall ls 0 0 0 with
+      | Lua.LUA_OK -> ()
+      | err -> raise (Lua.Error err)
+    end
+  | err -> raise (Lua.Error err)
+;;
+
+let time f =
+  let start = Unix.gettimeofday () in
+  let result = f () in
+  let stop = Unix.gettimeofday () in
+  (result, (stop -. start) *. 1_000_000.)
+;;
+
+let report name timings =
+  Array.sort compare timings;
+  let total = Array.fold_left (+.) 0. timings in
+  let n = Array.length timings in
+  pf "%-22s mean %8.2f us, median %8.2f us, p99 %8.2f us\n%!"
+    name (total /. float_of_int n) timings.(n / 2) timings.(n * 99 / 100)
+;;
+
+let bench_newstate () =
+  Array.init iterations (fun _ ->
+    let ls, t =
+      time (fun () -> let ls = LuaL.newstate () in LuaL.openlibs ls; ls) in
+    run_script ls;
+    t)
+;;
+
+let bench_pool () =
+  let pool = LuaL.Pool.create ~size:pool_size LuaL.openlibs in
+  let checkin = ref [] in
+  let timings =
+    Array.init iterations (fun _ ->
+      let ls, t = time (fun () -> LuaL.Pool.checkout pool) in
+      run_script ls;
+      let (), t_in = time (fun () -> LuaL.Pool.checkin pool ls) in
+      checkin := t_in :: !checkin;
+      t) in
+  (* the state must be clean after a checkin *)
+  LuaL.Pool.with_state pool (fun ls ->
+    Lua.getglobal ls "leaked_global";
+    if not (Lua.isnil ls (-1)) then failwith "A global leaked through the pool!";
+    Lua.getglobal ls "string";
+    Lua.getfield ls (-1) "leaked_function";
+    if not (Lua.isnil ls (-1)) then failwith "A library field leaked through the pool!");
+  (timings, Array.of_list !checkin)
+;;
+
+let () =
+  report "newstate + openlibs" (bench_newstate ());
+  let checkout, checkin = bench_pool () in
+  report "Pool.checkout" checkout;
+  report "Pool.checkin" checkin
+;;
@@ -0,0 +1,133 @@
+open Lua_api
+
+(* Runs the same Lua request handlers against an echo service answering
+   through a socket pair after a fixed latency, the stand-in for a network
+   backend: first with a lookup function blocking on the socket, then with
+   the handlers as coroutines of a Lua_scheduler, whose lookups overlap. *)
+
+let handlers = 100;;
+let lookups_per_handler = 5;;
+let latency = 0.002;;
+
+let script = "
+function handle(n)
+  local size = 0
+  for i = 1, n do
+    size = size + #lookup('key' .. i)
+  end
+  return size
+end"
+
+let pf = Printf.printf;;
+
+(* Echoes every line after [latency] seconds, answering concurrently *)
+let echo_server fd =
+  let ic = Unix.in_channel_of_descr fd in
+  let oc = Unix.out_channel_of_descr fd in
+  let m = Mutex.create () in
+  let reply line =
+    Thread.delay latency;
+    Mutex.lock m;
+    output_string oc (line ^ "\n");
+    flush oc;
+    Mutex.unlock m in
+  try
+    while true do
+      let line = input_line ic in
+      ignore (Thread.create reply line)
+    done
+  with End_of_file -> ()
+;;
+
+let start_backend () =
+  let (client, server) = Unix.socketpair Unix.PF_UNIX Unix.SOCK_STREAM 0 in
+  ignore (Thread.create echo_server server);
+  client
+;;
+
+let next_id = ref 0;;
+
+let send fd =
+  incr next_id;
+  let req = Printf.sprintf "%d\n" !next_id in
+  ignore (Unix.write_substring fd req 0 (String.length req));
+  !next_id
+;;
+
+let new_state () =
+  let ls = LuaL.newstate () in
+  LuaL.openlibs ls;
+  if not (LuaL.dostring ls script) then failwith "cannot load the script";
+  ls
+;;
+
+let time name f =
+  let start = Unix.gettimeofday () in
+  f ();
+  let stop = Unix.gettimeofday () in
+  pf "%-12s %8.1f ms\n%!" name ((stop -. start) *. 1000.);
+  stop -. start
+;;
+
+let blocking () =
+  let fd = start_backend () in
+  let ic = Unix.in_channel_of_descr fd in
+  let ls = new_state () in
+  let lookup ls =
+    ignore (send fd);
+    Lua.pushstring ls (input_line ic);
+    1 in
+  Lua.register ls "lookup" lookup;
+  for _ = 1 to handlers do
+    Lua.getglobal ls "handle";
+    Lua.pushinteger ls lookups_per_handler;
+    if Lua.pcall ls 1 1 0 <> Lua.LUA_OK then failwith "handle failed";
+    Lua.pop ls 1
+  done
+;;
+
+let scheduled () =
+  let fd = start_backend () in
+  let ls = new_state () in
+  let sched = Scheduler.create ls in
+  let pending = Hashtbl.create 128 in
+  let lookup co =
+    let id = send fd in
+    Scheduler.suspend sched co (fun wake -> Hashtbl.replace pending id wake) in
+  (* reads the available replies and wakes their coroutines *)
+  let buf = Bytes.create 65536 and partial = Buffer.create 64 in
+  let wait () =
+    ignore (Unix.select [fd] [] [] (-1.0));
+    let n = Unix.read fd buf 0 (Bytes.length buf) in
+    Buffer.add_subbytes partial buf 0 n;
+    let lines = String.split_on_char '\n' (Buffer.contents partial) in
+    let rec wake_all = function
+      | [] -> ()
+      | [last] -> Buffer.clear partial; Buffer.add_string partial last
+      | line :: rest ->
+          let id = int_of_string line in
+          let wake = Hashtbl.find pending id in
+          Hashtbl.remove pending id;
+          wake (fun co -> Lua.pushstring co line; 1);
+          wake_all rest in
+    wake_all lines in
+  Lua.register ls "lookup" lookup;
+  let tasks =
+    List.init handlers (fun _ ->
+      Lua.getglobal ls "handle";
+      Lua.pushinteger ls lookups_per_handler;
+      Scheduler.spawn sched 1) in
+  Scheduler.run sched ~wait;
+  List.iter
+    (fun task ->
+      if Scheduler.status task <> Scheduler.Finished then failwith "handle failed")
+    tasks
+;;
+
+let () =
+  pf "%d handlers x %d lookups, %.1f ms of latency per lookup\n%!"
+    handlers lookups_per_handler (latency *. 1000.);
+  let before = time "blocking" blocking in
+  let after = time "scheduled" scheduled in
+  pf "speedup: x%.1f\n%!" (before /. after)
+;;
@@ -0,0 +1,43 @@
+open Lua_api
+
+(* Micro-benchmark of the trivial stack primitives, called through the
+   [@@noalloc] unboxed externals exported by the library. The figures are
+   meant to be compared with the same benchmark built against a release
+   before these externals, whose stubs used CAMLparam/CAMLreturn. *)
+
+let iterations = 10_000_000;;
+
+let pf = Printf.printf;;
+
+(* Returns the cost of a call to f, in ns *)
+let ns_per_op f =
+  let start = Unix.gettimeofday () in
+  for i = 1 to iterations do f i done;
+  let stop = Unix.gettimeofday () in
+  (stop -. start) *. 1e9 /. float_of_int iterations
+;;
+
+let bench name f =
+  pf "%-22s %7.2f ns/op\n%!" name (ns_per_op f)
+;;
+
+let () =
+  let ls = LuaL.newstate () in
+  Lua.newtable ls;
+  Lua.pushinteger ls 42;
+  Lua.rawseti ls 1 1;
+  Lua.pushnumber ls 3.14;
+  (* the stack is: [1] = { 42 }, [2] = 3.14 *)
+  let sink = ref 0 and fsink = ref 0. in
+  bench "gettop" (fun _ -> sink := !sink + Lua.gettop ls);
+  bench "settop" (fun _ -> Lua.settop ls 2);
+  bench "pushinteger + settop" (fun i -> Lua.pushinteger ls i; Lua.settop ls 2);
+  bench "pushnumber + settop"
+    (fun i -> Lua.pushnumber ls (float_of_int i); Lua.settop ls 2);
+  bench "type_" (fun _ -> if Lua.type_ ls 2 = Lua.LUA_TNUMBER then incr sink);
+  bench "isnumber" (fun _ -> if Lua.isnumber ls 2 then incr sink);
+  bench "tointeger" (fun _ -> sink := !sink + Lua.tointeger ls 2);
+  bench "tonumber" (fun _ -> fsink := !fsink +. Lua.tonumber ls 2);
+  bench "rawgeti + settop" (fun _ -> Lua.rawgeti ls 1 1; Lua.settop ls 2);
+  ignore (Sys.opaque_identity (!sink, !fsink))
+;;
@@ -0,0 +1,72 @@
+open Lua_api
+
+(* Compares Lua.to_value, which converts a nested table in a single call to C,
+   with the equivalent walk written in OCaml over next, type_, tolstring and
+   pop. Both conversions of the same table must give the same value. *)
+
+let iterations = 2_000;;
+
+let script = "
+data = {}
+for i = 1, 100 do
+  data[i] = { id = i, name = 'item' .. i, price = i * 1.5, active = i % 2 == 0,
+              tags = { 'a', 'b', 'c' }, dims = { w = i, h = i * 2 } }
+end"
+
+let pf = Printf.printf;;
+
+let rec walk ls index =
+  match Lua.type_ ls index with
+  | Lua.LUA_TNIL -> Lua.Nil
+  | Lua.LUA_TBOOLEAN -> Lua.Boolean (Lua.toboolean ls index)
+  | Lua.LUA_TNUMBER -> Lua.Number (Lua.tonumber ls index)
+  | Lua.LUA_TSTRING -> begin
+      match Lua.tolstring ls index with
+      | Some s -> Lua.String s
+      | None -> assert false
+    end
+  | Lua.LUA_TTABLE ->
+      let t = if index < 0 then Lua.gettop ls + index + 1 else index in
+      let rec loop acc =
+        if Lua.next ls t = 0 then List.rev acc
+        else begin
+          let k = walk ls (-2) in
+          let v = walk ls (-1) in
+          Lua.pop ls 1;
+          loop ((k, v) :: acc)
+        end in
+      Lua.pushnil ls;
+      Lua.Table (loop [])
+  | t -> Lua.Opaque t
+;;
+
+(* The order of the pairs depends on the layout of the table *)
+let rec normalize = function
+  | Lua.Table l ->
+      Lua.Table (List.sort compare (List.map (fun (k, v) -> (normalize k, normalize v)) l))
+  | v -> v
+;;
+
+let time name f =
+  let start = Unix.gettimeofday () in
+  for _ = 1 to iterations do ignore (Sys.opaque_identity (f ())) done;
+  let stop = Unix.gettimeofday () in
+  let us = (stop -. start) *. 1_000_000. /. float_of_int iterations in
+  pf "%-22s %10.2f us/conversion\n%!" name us;
+  us
+;;
+
+let () =
+  let ls = LuaL.newstate () in
+  if not (LuaL.dostring ls script) then failwith "cannot run the script";
+  Lua.getglobal ls "data";
+  let native = Lua.to_value ls (-1) in
+  let ocaml = walk ls (-1) in
+  if native <> ocaml then failwith "to_value and the OCaml walk differ";
+  Lua.push_value ls native;
+  if normalize (Lua.to_value ls (-1)) <> normalize native then failwith "push_value is not symmetric";
+  Lua.pop ls 1;
+  let before = time "OCaml walk" (fun () -> walk ls (-1)) in
+  let after = time "to_value" (fun () -> Lua.to_value ls (-1)) in
+  pf "speedup: x%.1f\n%!" (before /. after)
+;;